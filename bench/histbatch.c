@@ -0,0 +1,119 @@
+/*
+ * histbatch: time entering many events one by one and in one batch
+ *
+ * usage: histbatch [events]
+ *
+ * Enter the same strings into a fresh history once with an H_ENTER per
+ * string and once with H_ENTER_BATCH, for a history that keeps them
+ * all, one that keeps the last 1000 and one that also skips
+ * duplicates.  Both ways must leave the same events behind.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "histedit.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Fold the events, oldest first, into one number */
+static unsigned long
+sum(History *h)
+{
+	HistEvent ev;
+	unsigned long s = 0;
+	const char *p;
+	int rv;
+
+	for (rv = history(h, &ev, H_LAST); rv != -1;
+	    rv = history(h, &ev, H_PREV)) {
+		s = s * 31 + (unsigned long)ev.num;
+		for (p = ev.str; *p != '\0'; p++)
+			s = s * 31 + (unsigned char)*p;
+	}
+	return s;
+}
+
+static double
+enter(const char * const *str, int n, int size, int unique, int batch,
+    unsigned long *s)
+{
+	History *h = history_init();
+	HistEvent ev;
+	double t;
+	int i;
+
+	history(h, &ev, H_SETSIZE, size);
+	history(h, &ev, H_SETUNIQUE, unique);
+	t = now();
+	if (batch)
+		history(h, &ev, H_ENTER_BATCH, str, NULL, n);
+	else
+		for (i = 0; i < n; i++)
+			history(h, &ev, H_ENTER, str[i]);
+	t = now() - t;
+	*s = sum(h);
+	history_end(h);
+	return t;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		int size;	/* 0 for all the events */
+		int unique;
+	} run[] = {
+		{ "keep all", 0, 0 },
+		{ "keep 1000", 1000, 0 },
+		{ "keep 1000, unique", 1000, 1 },
+	};
+	char **str;
+	char buf[64];
+	unsigned long s1, s2;
+	double t1, t2;
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int i, size, rv = 0;
+
+	if (n < 1 || (str = malloc((size_t)n * sizeof(*str))) == NULL) {
+		fprintf(stderr, "usage: histbatch [events]\n");
+		return 1;
+	}
+	/* Every so often a string repeats the one before */
+	for (i = 0; i < n; i++) {
+		(void)snprintf(buf, sizeof(buf), "select * from t where id = %d",
+		    i - (i % 7 == 6));
+		if ((str[i] = strdup(buf)) == NULL) {
+			fprintf(stderr, "histbatch: out of memory\n");
+			return 1;
+		}
+	}
+	printf("%-18s %12s %12s\n", "", "H_ENTER ms", "batch ms");
+	for (i = 0; i < (int)(sizeof(run) / sizeof(run[0])); i++) {
+		size = run[i].size != 0 ? run[i].size : n;
+		t1 = enter((const char * const *)str, n, size,
+		    run[i].unique, 0, &s1);
+		t2 = enter((const char * const *)str, n, size,
+		    run[i].unique, 1, &s2);
+		printf("%-18s %12.2f %12.2f\n", run[i].name, t1 * 1e3,
+		    t2 * 1e3);
+		if (s1 != s2) {
+			fprintf(stderr, "histbatch: %s: the events differ\n",
+			    run[i].name);
+			rv = 1;
+		}
+	}
+	for (i = 0; i < n; i++)
+		free(str[i]);
+	free(str);
+	return rv;
+}
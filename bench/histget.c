@@ -0,0 +1,95 @@
+/*
+ * histget: time random access to events of the builtin history
+ *
+ * usage: histget [maxsize [lookups]]
+ *
+ * For histories of 1000 events up to maxsize, ten times larger each
+ * step, look up random events by number with H_SET and H_NEXT_EVENT
+ * from the newest one, and print the time each lookup takes.  Only
+ * operations the history has always had are used, so that older trees
+ * can be timed the same way.
+ *
+ * A lookup does the same few steps at any size, but a random one
+ * misses the caches once the ring and the entries it points to outgrow
+ * them, about 56 bytes an event, so it gets slower up to the memory
+ * latency.  The last column looks up the events with H_SET in order
+ * of their numbers instead, which stays flat.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "histedit.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* The same numbers everywhere, and more of them than rand() may give */
+static int
+pick(int size)
+{
+	static unsigned long seed = 1;
+
+	seed = (seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+	return (int)((seed >> 1) % (unsigned long)size) + 1;
+}
+
+static double
+lookups(History *h, int op, int size, int n, int random)
+{
+	HistEvent ev;
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < n; i++)
+		/* H_NEXT_EVENT looks from the current event back */
+		if (history(h, &ev, H_FIRST) == -1 ||
+		    history(h, &ev, op, random ? pick(size) :
+		    i % size + 1) == -1) {
+			fprintf(stderr, "histget: event not found\n");
+			exit(1);
+		}
+	return (now() - t) / n * 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	History *h;
+	HistEvent ev;
+	char buf[64];
+	int max = argc > 1 ? atoi(argv[1]) : 500000;
+	int n = argc > 2 ? atoi(argv[2]) : 20000;
+	int size, i;
+
+	if (max < 1 || n < 1) {
+		fprintf(stderr, "usage: histget [maxsize [lookups]]\n");
+		return 1;
+	}
+	printf("%10s %14s %16s %14s\n", "events", "H_SET ns", "H_NEXT_EVENT ns",
+	    "in order ns");
+	for (size = max < 1000 ? max : 1000; ;
+	    size = size > max / 10 ? max : size * 10) {
+		h = history_init();
+		history(h, &ev, H_SETSIZE, size);
+		for (i = 0; i < size; i++) {
+			(void)snprintf(buf, sizeof(buf), "command number %d", i);
+			history(h, &ev, H_ENTER, buf);
+		}
+		printf("%10d", size);
+		printf(" %14.1f", lookups(h, H_SET, size, n, 1));
+		printf(" %16.1f", lookups(h, H_NEXT_EVENT, size, n, 1));
+		printf(" %14.1f\n", lookups(h, H_SET, size, n, 0));
+		history_end(h);
+		if (size == max)
+			break;
+	}
+	return 0;
+}
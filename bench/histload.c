@@ -0,0 +1,157 @@
+/*
+ * histload: time loading a large history file
+ *
+ * usage: histload [megabytes [maxthreads]]
+ *
+ * Save a history of about the size given, then load it back with
+ * H_LOAD: from the file itself, which is mapped and decoded on 1, 2,
+ * 4 and so on up to maxthreads threads (8 by default) as H_LOADTHREADS
+ * sets, and through a FIFO, which can only be read line by line.  All
+ * the loads must give the same events.  More threads than processors
+ * online cannot load any faster, so sweep on a machine with enough.
+ */
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histedit.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Fold the events, oldest first, into one number */
+static unsigned long
+sum(History *h)
+{
+	HistEvent ev;
+	unsigned long s = 0;
+	const char *p;
+	int rv;
+
+	for (rv = history(h, &ev, H_LAST); rv != -1;
+	    rv = history(h, &ev, H_PREV))
+		for (p = ev.str; *p != '\0'; p++)
+			s = s * 31 + (unsigned char)*p;
+	return s;
+}
+
+static double
+load(const char *fname, int size, int nthreads, unsigned long *s, int *n)
+{
+	History *h = history_init();
+	HistEvent ev;
+	double t;
+
+	history(h, &ev, H_SETSIZE, size);
+	history(h, &ev, H_LOADTHREADS, nthreads);
+	t = now();
+	*n = history(h, &ev, H_LOAD, fname);
+	t = now() - t;
+	*s = sum(h);
+	history_end(h);
+	return t;
+}
+
+int
+main(int argc, char **argv)
+{
+	char fname[] = "/tmp/histloadXXXXXX", fifo[sizeof(fname) + 5];
+	char buf[128];
+	History *h;
+	HistEvent ev;
+	unsigned long s1, s2;
+	double t1, t2;
+	long mb = argc > 1 ? atol(argv[1]) : 64;
+	int max = argc > 2 ? atoi(argv[2]) : 8;
+	int fd, size, i, n1, n2, rv = 0;
+	pid_t pid;
+
+	if (mb < 1 || mb > 1024 || max < 1 || max > 16) {
+		fprintf(stderr, "usage: histload [megabytes [maxthreads]]\n");
+		return 1;
+	}
+	if ((fd = mkstemp(fname)) == -1) {
+		perror("histload: mkstemp");
+		return 1;
+	}
+	(void)close(fd);
+	(void)snprintf(fifo, sizeof(fifo), "%s.fifo", fname);
+
+	/* Lines of about 64 bytes once encoded, with things to unvis */
+	size = (int)(mb * 1024 * 1024 / 64);
+	h = history_init();
+	history(h, &ev, H_SETSIZE, size);
+	for (i = 0; i < size; i++) {
+		(void)snprintf(buf, sizeof(buf),
+		    "cc -O2 -c\tfile%d.c -o 'out dir/file%d.o' \\\n", i, i);
+		history(h, &ev, H_ENTER, buf);
+	}
+	if (history(h, &ev, H_SAVE, fname) == -1) {
+		fprintf(stderr, "histload: cannot save %s\n", fname);
+		(void)unlink(fname);
+		return 1;
+	}
+	history_end(h);
+
+	printf("%d events, %ld MB, %ld processors\n", size, mb,
+	    sysconf(_SC_NPROCESSORS_ONLN));
+	for (i = 1; ; i = i * 2 > max ? max : i * 2) {
+		t1 = load(fname, size, i, &s1, &n1);
+		printf("file, %2d threads: %8.1f ms, %d events\n", i,
+		    t1 * 1e3, n1);
+		if (i == 1) {
+			s2 = s1;
+			n2 = n1;
+		} else if (n1 != n2 || s1 != s2) {
+			fprintf(stderr, "histload: the loads differ\n");
+			rv = 1;
+		}
+		if (i == max)
+			break;
+	}
+
+	if (mkfifo(fifo, 0600) == -1) {
+		perror("histload: mkfifo");
+		(void)unlink(fname);
+		return 1;
+	}
+	if ((pid = fork()) == -1) {
+		perror("histload: fork");
+		(void)unlink(fifo);
+		(void)unlink(fname);
+		return 1;
+	}
+	if (pid == 0) {
+		ssize_t r;
+		int in = open(fname, O_RDONLY), out = open(fifo, O_WRONLY);
+		char copy[65536];
+
+		while (in != -1 && out != -1 &&
+		    (r = read(in, copy, sizeof(copy))) > 0)
+			if (write(out, copy, (size_t)r) != r)
+				break;
+		_exit(0);
+	}
+	t2 = load(fifo, size, 0, &s1, &n1);
+	(void)waitpid(pid, NULL, 0);
+	(void)unlink(fifo);
+	(void)unlink(fname);
+
+	printf("fifo:             %8.1f ms, %d events\n", t2 * 1e3, n1);
+	if (n1 != n2 || s1 != s2) {
+		fprintf(stderr, "histload: the loads differ\n");
+		rv = 1;
+	}
+	return rv;
+}
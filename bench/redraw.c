@@ -0,0 +1,153 @@
+/*
+ * redraw: time redrawing a screen full of input line
+ *
+ * usage: redraw [columns rows [keys]]
+ *
+ * On a pseudo terminal of the size given, or of 80x24 and then 300x100,
+ * fill all but the last row with one input line and time keys that
+ * each make the line be redrawn: a character inserted and deleted
+ * again at the start of the line, which moves every row, and near the
+ * end of the line, which leaves all rows but the last alone.  The
+ * output goes to a child that throws it away.
+ */
+#ifdef __linux__
+#define	_GNU_SOURCE	/* for posix_openpt() and the like */
+#endif
+
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histedit.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char *
+prompt(EditLine *el)
+{
+	static char p[] = "> ";
+
+	(void)el;
+	return p;
+}
+
+/* Type the line, go to where, then insert and delete keys times */
+static double
+keys(EditLine *el, size_t len, const char *where, int keys)
+{
+	char *in, *p;
+	double t;
+	size_t i;
+	int n;
+
+	if ((in = malloc(len + strlen(where) + (size_t)keys * 2 + 2)) == NULL)
+		return -1;
+	for (p = in, i = 0; i < len; i++)
+		*p++ = (char)('a' + i % 26);
+	(void)strcpy(p, where);
+	p += strlen(where);
+	for (n = 0; n < keys; n++) {
+		*p++ = 'X';
+		*p++ = '\b';
+	}
+	*p++ = '\n';
+	*p = '\0';
+	el_push(el, in);
+	free(in);
+	t = now();
+	if (el_gets(el, &n) == NULL)
+		return -1;
+	return now() - t;
+}
+
+static int
+run(int cols, int rows, int nkeys)
+{
+	struct winsize ws;
+	EditLine *el;
+	FILE *fp;
+	double t0, t1, t2;
+	size_t len;
+	int m, s;
+	pid_t pid;
+
+	if ((m = posix_openpt(O_RDWR | O_NOCTTY)) == -1 || grantpt(m) == -1 ||
+	    unlockpt(m) == -1 || (s = open(ptsname(m), O_RDWR | O_NOCTTY))
+	    == -1) {
+		perror("redraw: pseudo terminal");
+		return -1;
+	}
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_col = (unsigned short)cols;
+	ws.ws_row = (unsigned short)rows;
+	(void)ioctl(s, TIOCSWINSZ, &ws);
+	if ((pid = fork()) == -1) {
+		perror("redraw: fork");
+		return -1;
+	}
+	if (pid == 0) {
+		char buf[65536];
+
+		(void)close(s);
+		while (read(m, buf, sizeof(buf)) > 0)
+			continue;
+		_exit(0);
+	}
+	(void)close(m);
+
+	if ((fp = fdopen(s, "r+")) == NULL) {
+		perror("redraw: fdopen");
+		return -1;
+	}
+	el = el_init("redraw", fp, fp, stderr);
+	el_set(el, EL_EDITOR, "emacs");
+	el_set(el, EL_PROMPT, prompt);
+	len = (size_t)cols * (size_t)(rows - 1) - strlen(prompt(el)) - 1;
+	/* The first round only warms up */
+	t0 = keys(el, len, "\001", nkeys);
+	t1 = keys(el, len, "\001", nkeys);
+	t2 = keys(el, len, "\002\002", nkeys);
+	el_end(el);
+	(void)fclose(fp);
+	(void)waitpid(pid, NULL, 0);
+	if (t0 < 0 || t1 < 0 || t2 < 0) {
+		fprintf(stderr, "redraw: el_gets failed\n");
+		return -1;
+	}
+	printf("%4dx%-4d %16.1f %16.1f\n", cols, rows,
+	    t1 / (2 * nkeys) * 1e6, t2 / (2 * nkeys) * 1e6);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int cols = -1, rows = -1, nkeys = 200;
+
+	if (argc == 2 || argc > 4 ||
+	    (argc > 2 && ((cols = atoi(argv[1])) < 1 || cols > 1000 ||
+	    (rows = atoi(argv[2])) < 2 || rows > 1000)) ||
+	    (argc > 3 && (nkeys = atoi(argv[3])) < 1)) {
+		fprintf(stderr, "usage: redraw [columns rows [keys]]\n");
+		return 1;
+	}
+	/* Output must not depend on whatever terminal this is run from */
+	(void)setenv("TERM", "xterm", 1);
+	printf("%-9s %16s %16s\n", "size", "at start us/key",
+	    "near end us/key");
+	if (cols != -1)
+		return run(cols, rows, nkeys) == -1;
+	return run(80, 24, nkeys) == -1 || run(300, 100, nkeys) == -1;
+}
@@ -98,6 +98,7 @@ c_insert(EditLine *el, int num)
 			return;		/* can't go past end of buffer */
 	}
 
+	re_damage(el, el->el_line.cursor);
 	if (el->el_line.cursor < el->el_line.lastchar) {
 		/* if I must move chars */
 		for (cp = el->el_line.lastchar; cp >= el->el_line.cursor; cp--)
@@ -124,6 +125,7 @@ c_delafter(EditLine *el, int num)
 	if (num > 0) {
 		wchar_t *cp;
 
+		re_damage(el, el->el_line.cursor);
 		for (cp = el->el_line.cursor; cp <= el->el_line.lastchar; cp++)
 			*cp = cp[num];
 
@@ -140,6 +142,7 @@ c_delafter1(EditLine *el)
 {
 	wchar_t *cp;
 
+	re_damage(el, el->el_line.cursor);
 	for (cp = el->el_line.cursor; cp <= el->el_line.lastchar; cp++)
 		*cp = cp[1];
 
@@ -164,6 +167,7 @@ c_delbefore(EditLine *el, int num)
 	if (num > 0) {
 		wchar_t *cp;
 
+		re_damage(el, el->el_line.cursor - num);
 		for (cp = el->el_line.cursor - num;
 		    &cp[num] <= el->el_line.lastchar;
 		    cp++)
@@ -182,6 +186,7 @@ c_delbefore1(EditLine *el)
 {
 	wchar_t *cp;
 
+	re_damage(el, el->el_line.cursor - 1);
 	for (cp = el->el_line.cursor - 1; cp <= el->el_line.lastchar; cp++)
 		*cp = cp[1];
 
@@ -641,6 +646,7 @@ el_deletestr1(EditLine *el, int start, int end)
 
 	p1 = el->el_line.buffer + start;
 	p2 = el->el_line.buffer + end;
+	re_damage(el, p1);
 	for (size_t i = 0; i < len; i++) {
 		*p1++ = *p2++;
 		el->el_line.lastchar--;
@@ -670,6 +676,7 @@ el_wreplacestr(EditLine *el, const wchar_t *s)
 	}
 
 	p = el->el_line.buffer;
+	re_damage(el, p);
 	for (size_t i = 0; i < len; i++)
 		*p++ = *s++;
 
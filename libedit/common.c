@@ -605,8 +605,18 @@ ed_search_prev_history(EditLine *el, wint_t c libedit_unused)
 
 	c_setpat(el);		/* Set search pattern !! */
 
-	for (h = 1; h <= el->el_history.eventno; h++)
-		hp = HIST_NEXT(el);
+	h = el->el_history.eventno + 1;
+	if ((found = c_hsearch(el, h, ED_SEARCH_PREV_HISTORY)) != -1) {
+		if (!found)
+			return CC_ERROR;
+		el->el_history.eventno = found;
+		return hist_get(el);
+	}
+	found = 0;
+	if (h > 1)
+		hp = hist_nth(el, h - 1);
+	else
+		hp = HIST_FIRST(el);
 
 	while (hp != NULL) {
 #ifdef SDEBUG
@@ -662,6 +672,12 @@ ed_search_next_history(EditLine *el, wint_t c libedit_unused)
 
 	c_setpat(el);		/* Set search pattern !! */
 
+	found = c_hsearch(el, el->el_history.eventno - 1,
+	    ED_SEARCH_NEXT_HISTORY);
+	if (found != -1)
+		goto out;
+	found = 0;
+	hp = HIST_FIRST(el);
 	for (h = 1; h < el->el_history.eventno && hp; h++) {
 #ifdef SDEBUG
 		fprintf(el->el_errfile, "Comparing with \"%ls\"\n", hp);
@@ -673,7 +689,7 @@ ed_search_next_history(EditLine *el, wint_t c libedit_unused)
 			found = h;
 		hp = HIST_NEXT(el);
 	}
-
+out:
 	if (!found) {		/* is it the current history number? */
 		if (!c_hmatch(el, el->el_history.buf)) {
 #ifdef SDEBUG
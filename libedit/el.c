@@ -147,6 +147,7 @@ el_end(EditLine *el)
 	prompt_end(el);
 	sig_end(el);
 	literal_end(el);
+	re_end(el);
 
 	el_free(el->el_prog);
 	el_free(el->el_visual.cbuff);
@@ -361,6 +362,7 @@ el_wset(EditLine *el, int op, ...)
 			el->el_infd = fileno(fp);
 			break;
 		case 1:
+			terminal__flush(el);
 			el->el_outfile = fp;
 			el->el_outfd = fileno(fp);
 			break;
@@ -495,6 +497,28 @@ el_wget(EditLine *el, int op, ...)
 		}
 		break;
 	}
+
+	case EL_GETOUTSTATS:
+	{
+		size_t *wp = va_arg(ap, size_t *);
+		size_t *bp = va_arg(ap, size_t *);
+
+		*wp = el->el_terminal.t_owrites;
+		*bp = el->el_terminal.t_obytes;
+		rv = 0;
+		break;
+	}
+
+	case EL_GETMOVESTATS:
+	{
+		size_t *mp = va_arg(ap, size_t *);
+		size_t *sp = va_arg(ap, size_t *);
+
+		*mp = el->el_terminal.t_omoved;
+		*sp = el->el_terminal.t_osaved;
+		rv = 0;
+		break;
+	}
 	default:
 		rv = -1;
 		break;
@@ -344,6 +344,20 @@ el_get(EditLine *el, int op, ...)
 		break;
 	}
 
+	case EL_GETOUTSTATS: {	/* size_t *, size_t * */
+		size_t *wp = va_arg(ap, size_t *);
+		size_t *bp = va_arg(ap, size_t *);
+		ret = el_wget(el, op, wp, bp);
+		break;
+	}
+
+	case EL_GETMOVESTATS: {	/* size_t *, size_t * */
+		size_t *mp = va_arg(ap, size_t *);
+		size_t *sp = va_arg(ap, size_t *);
+		ret = el_wget(el, op, mp, sp);
+		break;
+	}
+
 	default:
 		ret = -1;
 		break;
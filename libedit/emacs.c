@@ -457,6 +457,16 @@ em_inc_search_prev(EditLine *el, wint_t c libedit_unused)
 }
 
 
+/* em_fuzzy_search():
+ *	Emacs fuzzy history search
+ */
+libedit_private el_action_t
+em_fuzzy_search(EditLine *el, wint_t c libedit_unused)
+{
+	return ce_fuzzy_search(el);
+}
+
+
 /* em_delete_prev_char():
  *	Delete the character to the left of the cursor
  *	[^?]
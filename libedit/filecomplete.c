@@ -768,6 +768,7 @@ fn_complete2(EditLine *el,
 		matches_num = (size_t)(i - 1);
 
 		/* newline to get on next line from command line */
+		terminal__flush(el);
 		fprintf(el->el_outfile, "\n");
 
 		/*
@@ -83,6 +83,74 @@ hist_set(EditLine *el, hist_fun_t fun, void *ptr)
 }
 
 
+/* hist_size():
+ *	Return the number of history events.
+ */
+static int
+hist_size(EditLine *el)
+{
+	HistEventW ev;
+	const wchar_t *hp;
+	int n;
+
+	if ((*el->el_history.fun)(el->el_history.ref, &ev, H_GETSIZE) != -1)
+		return ev.num;
+	for (n = 0, hp = HIST_FIRST(el); hp != NULL; hp = HIST_NEXT(el))
+		n++;
+	return n;
+}
+
+
+/* hist_nth():
+ *	Return the n-th history event counting from the first one,
+ *	making it the current event.  Falls back to walking the history
+ *	for history functions that do not know about H_NTH.
+ */
+libedit_private const wchar_t *
+hist_nth(EditLine *el, int n)
+{
+	const wchar_t *hp;
+
+	if ((*el->el_history.fun)(el->el_history.ref, &el->el_history.ev,
+	    H_NTH, n) != -1) {
+		if (el->el_flags & NARROW_HISTORY)
+			return ct_decode_string((const char *)(const void *)
+			    el->el_history.ev.str, &el->el_scratch);
+		return el->el_history.ev.str;
+	}
+	if (n < 0 || n >= hist_size(el))
+		return NULL;
+	for (hp = HIST_FIRST(el); hp != NULL && n > 0; n--)
+		hp = HIST_NEXT(el);
+	return hp;
+}
+
+
+/* hist_search():
+ *	Return the nearest history event containing pat, looking from
+ *	the current one towards older events for H_PREV_SUBSTR and newer
+ *	ones for H_NEXT_SUBSTR, and make it current.  *off is set to its
+ *	distance from the current event, to -1 if there is none, and to
+ *	-2 if the history functions do not know about substring searches.
+ */
+libedit_private const wchar_t *
+hist_search(EditLine *el, int fn, const wchar_t *pat, int *off)
+{
+	const void *arg = pat;
+
+	*off = -2;
+	if (el->el_flags & NARROW_HISTORY)
+		arg = ct_encode_string(pat, &el->el_scratch);
+	if ((*el->el_history.fun)(el->el_history.ref, &el->el_history.ev,
+	    fn, arg, off) == -1)
+		return NULL;
+	if (el->el_flags & NARROW_HISTORY)
+		return ct_decode_string((const char *)(const void *)
+		    el->el_history.ev.str, &el->el_scratch);
+	return el->el_history.ev.str;
+}
+
+
 /* hist_get():
  *	Get a history line and update it in the buffer.
  *	eventno tells us the event to get.
@@ -112,19 +180,19 @@ hist_get(EditLine *el)
 	if (el->el_history.ref == NULL)
 		return CC_ERROR;
 
-	hp = HIST_FIRST(el);
+	hp = hist_nth(el, el->el_history.eventno - 1);
 
-	if (hp == NULL)
-		return CC_ERROR;
-
-	for (h = 1; h < el->el_history.eventno; h++)
-		if ((hp = HIST_NEXT(el)) == NULL)
-			goto out;
+	if (hp == NULL) {
+		/* past the oldest event: settle on it */
+		if ((h = hist_size(el)) <= 0)
+			return CC_ERROR;
+		goto out;
+	}
 
 	hlen = wcslen(hp) + 1;
 	blen = (size_t)(el->el_line.limit - el->el_line.buffer);
 	if (hlen > blen && !ch_enlargebufs(el, hlen))
-		goto out;
+		return CC_ERROR;
 
 	memcpy(el->el_line.buffer, hp, hlen * sizeof(*hp));
 	el->el_line.lastchar = el->el_line.buffer + hlen - 1;
@@ -204,6 +272,9 @@ hist_command(EditLine *el, int argc, const wchar_t **argv)
 	if (wcscmp(argv[1], L"unique") == 0)
 		return history_w(el->el_history.ref, &ev, H_SETUNIQUE, num);
 
+	if (wcscmp(argv[1], L"index") == 0)
+		return history_w(el->el_history.ref, &ev, H_SETINDEX, num);
+
 	return -1;
 }
 
@@ -76,5 +76,8 @@ libedit_private int		hist_set(EditLine *, hist_fun_t, void *);
 libedit_private int		hist_command(EditLine *, int, const wchar_t **);
 libedit_private int		hist_enlargebuf(EditLine *, size_t, size_t);
 libedit_private wchar_t	*hist_convert(EditLine *, int, void *);
+libedit_private const wchar_t *hist_nth(EditLine *, int);
+libedit_private const wchar_t *hist_search(EditLine *, int, const wchar_t *,
+    int *);
 
 #endif /* _h_el_hist */
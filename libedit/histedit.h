@@ -159,6 +159,8 @@ unsigned char	_el_fn_sh_complete(EditLine *, int);
 #define	EL_RESIZE	23	/* , el_zfunc_t, void *);	      set     */
 #define	EL_ALIAS_TEXT	24	/* , el_afunc_t, void *);	      set     */
 #define	EL_SAFEREAD	25	/* , int);			      set/get */
+#define	EL_GETOUTSTATS	26	/* , size_t *, size_t *);	          get */
+#define	EL_GETMOVESTATS	27	/* , size_t *, size_t *);	          get */
 
 #define	EL_BUILTIN_GETCFN	(NULL)
 
@@ -202,6 +204,11 @@ void		history_end(History *);
 
 int		history(History *, HistEvent *, int, ...);
 
+/*
+ * H_FUNC hands the functions the ref given with it from then on.  The
+ * events the History held are dropped and its own storage is freed;
+ * the ref stays the caller's and history_end() does not free it.
+ */
 #define	H_FUNC		 0	/* , UTSL		*/
 #define	H_SETSIZE	 1	/* , const int);	*/
 #define	H_GETSIZE	 2	/* , void);		*/
@@ -230,6 +237,25 @@ int		history(History *, HistEvent *, int, ...);
 #define	H_REPLACE	25	/* , const char *, histdata_t);	*/
 #define	H_SAVE_FP	26	/* , FILE *);		*/
 #define	H_NSAVE_FP	27	/* , size_t, FILE *);	*/
+#define	H_NTH		28	/* , int);		*/
+#define	H_JOURNAL	29	/* , const char *);	*/
+#define	H_COMPACT	30	/* , void);		*/
+#define	H_GETMEM	31	/* , size_t *);		*/
+#define	H_PREV_SUBSTR	32	/* , const char *, int *);	*/
+#define	H_NEXT_SUBSTR	33	/* , const char *, int *);	*/
+#define	H_SETINDEX	34	/* , int);		*/
+#define	H_SHARED	35	/* , const char *, int);	*/
+#define	H_GETBYTES	36	/* , size_t *);		*/
+#define	H_GETGEN	37	/* , unsigned long *, unsigned long *);	*/
+#define	H_ASYNC		39	/* , int);		*/
+#define	H_COMPRESS	40	/* , int);		*/
+#define	H_ENTER_BATCH	41	/* , const char * const *, void * const *, int); */
+#define	H_SETBYTES	42	/* , size_t);		*/
+#define	H_FRECENCY	43	/* , int);		*/
+#define	H_PREV_REGEX	44	/* , const char *, int *);	*/
+#define	H_NEXT_REGEX	45	/* , const char *, int *);	*/
+#define	H_MAPPED	46	/* , const char *);	*/
+#define	H_LOADTHREADS	47	/* , int);		*/
 
 
 
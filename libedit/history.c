@@ -38,11 +38,50 @@
  * hist.c: TYPE(History) access functions
  */
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#if defined(HAVE_MMAP) || defined(HAVE_FLOCK)
+#include <sys/file.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <errno.h>
+#include <limits.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if (defined(HAVE_MMAP) || defined(HAVE_PTHREAD)) && \
+    !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#if defined(HAVE_MMAP) && ATOMIC_LLONG_LOCK_FREE == 2
+#define	H_SHARED_RING		/* Shared ring files can be mapped */
+#define	H_MAPPED_FILE		/* Indexed files can be mapped */
+#endif
+#ifdef HAVE_PTHREAD
+#define	H_ASYNC_WRITER		/* Files can be written in the background */
+#define	H_PARALLEL_SCAN		/* Events can be scanned on many threads */
+#endif
+#endif
+#ifdef REGEX
+#include <sys/types.h>
+#include <regex.h>
+#endif
 
 static const char hist_cookie[] = "_HiStOrY_V2_\n";
+#ifdef H_SHARED_RING
+static const char hist_ring_cookie[] = "_HiStOrY_RiNg1\n";
+#endif
+#ifdef H_MAPPED_FILE
+static const char hist_map_cookie[] = "_HiStOrY_MaP1_\n";
+#endif
 
 #include "vis.h"
 #include "histedit.h"
@@ -55,6 +94,7 @@ static const char hist_cookie[] = "_HiStOrY_V2_\n";
 #define	FUNW(type)		type
 #define	TYPE(type)		type
 #define	STR(x)			x
+#define	UCHAR(c)		((unsigned int)(unsigned char)(c))
 
 #define	Strlen(s)		strlen(s)
 #define	Strdup(s)		strdup(s)
@@ -62,6 +102,7 @@ static const char hist_cookie[] = "_HiStOrY_V2_\n";
 #define	Strncmp(d, s, n)	strncmp(d, s, n)
 #define	Strncpy(d, s, n)	strncpy(d, s, n)
 #define	Strncat(d, s, n)	strncat(d, s, n)
+#define	Strstr(s, p)		strstr(s, p)
 #define	ct_decode_string(s, b)	(s)
 #define	ct_encode_string(s, b)	(s)
 
@@ -73,6 +114,7 @@ static const char hist_cookie[] = "_HiStOrY_V2_\n";
 #define	FUNW(type)		type ## _w
 #define	TYPE(type)		type ## W
 #define	STR(x)			L ## x
+#define	UCHAR(c)		((unsigned int)(c))
 
 #define	Strlen(s)		wcslen(s)
 #define	Strdup(s)		wcsdup(s)
@@ -80,6 +122,7 @@ static const char hist_cookie[] = "_HiStOrY_V2_\n";
 #define	Strncmp(d, s, n)	wcsncmp(d, s, n)
 #define	Strncpy(d, s, n)	wcsncpy(d, s, n)
 #define	Strncat(d, s, n)	wcsncat(d, s, n)
+#define	Strstr(s, p)		wcsstr(s, p)
 
 #endif
 
@@ -102,8 +145,21 @@ struct TYPE(history) {
 	history_vfun_t h_clear;	/* Clear the history list	 */
 	history_efun_t h_enter;	/* Add an element		 */
 	history_efun_t h_add;	/* Append to an element		 */
+	int h_jfd;		/* Journal file descriptor	 */
+	char *h_jname;		/* Journal file name		 */
+	off_t h_jsize;		/* Journal size			 */
+	off_t h_jbase;		/* Journal size when compacted	 */
+	char *h_jbuf;		/* Journal record buffer	 */
+	size_t h_jbufsz;	/* Size of the record buffer	 */
+	struct hwriter_t *h_writer;	/* Background writer	 */
+	int h_lthreads;		/* Most loading threads, 0 for all */
 };
 
+/* Journal growth over twice its compacted size before compacting it */
+#define	H_JOURNAL_SLACK	((off_t)64 << 10)
+/* Journal records a batch of events gathers before writing them */
+#define	H_JOURNAL_BATCH	((size_t)64 << 10)
+
 #define	HNEXT(h, ev)		(*(h)->h_next)((h)->h_ref, ev)
 #define	HFIRST(h, ev)		(*(h)->h_first)((h)->h_ref, ev)
 #define	HPREV(h, ev)		(*(h)->h_prev)((h)->h_ref, ev)
@@ -126,44 +182,170 @@ typedef struct {
 } HistEventPrivate;
 
 
+/* Jobs of the background writer */
+#define	HW_APPEND	0	/* Append buf to the journal		*/
+#define	HW_ADOPT	1	/* Journal to fd, fname from now on	*/
+#define	HW_CLOSE	2	/* Stop journaling			*/
+#define	HW_COMPACT	3	/* Compact the journal to len records	*/
+#define	HW_SAVE		4	/* Save buf as the history file fname	*/
+#define	HW_STOP		5	/* Flush and exit			*/
+
 static int history_setsize(TYPE(History) *, TYPE(HistEvent) *, int);
 static int history_getsize(TYPE(History) *, TYPE(HistEvent) *);
 static int history_setunique(TYPE(History) *, TYPE(HistEvent) *, int);
 static int history_getunique(TYPE(History) *, TYPE(HistEvent) *);
+static int history_getmem(TYPE(History) *, TYPE(HistEvent) *, size_t *);
+static int history_getbytes(TYPE(History) *, TYPE(HistEvent) *, size_t *);
+static int history_setbytes(TYPE(History) *, TYPE(HistEvent) *, size_t);
+static int history_setfrecency(TYPE(History) *, TYPE(HistEvent) *, int);
+static int history_getgen(TYPE(History) *, TYPE(HistEvent) *,
+    unsigned long *, unsigned long *);
 static int history_set_fun(TYPE(History) *, TYPE(History) *);
 static int history_load(TYPE(History) *, const char *);
 static int history_save(TYPE(History) *, const char *);
 static int history_save_fp(TYPE(History) *, size_t, FILE *);
+static int history_journal(TYPE(History) *, const char *);
+static void history_journal_close(TYPE(History) *);
+static int history_compact(TYPE(History) *);
+static int history_writer_file(TYPE(History) *, int, const char *);
+static int history_writer_start(TYPE(History) *);
+static int history_writer_stop(TYPE(History) *);
 static int history_prev_event(TYPE(History) *, TYPE(HistEvent) *, int);
 static int history_next_event(TYPE(History) *, TYPE(HistEvent) *, int);
 static int history_next_string(TYPE(History) *, TYPE(HistEvent) *,
     const Char *);
+static int history_nth(TYPE(History) *, TYPE(HistEvent) *, int);
 static int history_prev_string(TYPE(History) *, TYPE(HistEvent) *,
     const Char *);
+static int history_substr(TYPE(History) *, TYPE(HistEvent) *,
+    const Char *, int, int *);
+static int history_setindex(TYPE(History) *, TYPE(HistEvent) *, int);
+#ifdef REGEX
+static int history_regex(TYPE(History) *, TYPE(HistEvent) *,
+    const Char *, int, int *);
+#endif
 
 
 /***********************************************************************/
 
 /*
  * Builtin- history implementation
+ *
+ * Entries are kept in a power of two sized ring of pointers, newest
+ * first, so that the n-th entry and the entry with a given event number
+ * can be found without walking the history.  Entries come from slabs
+ * and their strings from blocks filled in event order; since events
+ * are mostly evicted in that same order a block is freed as soon as
+ * its last string goes.  A string never moves while its event lives,
+ * as history_get() and friends hand out pointers into the blocks, so
+ * out of order deletions can leave a block holding little live space.
+ *
+ * With H_FRECENCY an event that is entered again counts its uses, and
+ * a heap orders the events by frecency: the event number of the last
+ * use plus halflife events for every doubling of the uses.  Since that
+ * never changes while an event stays unused the heap only needs to be
+ * fixed up when events come and go, and the size and byte limits then
+ * evict the least frecent events instead of the oldest.
  */
 typedef struct hentry_t {
 	TYPE(HistEvent) ev;		/* What we return		 */
-	void *data;		/* data				 */
-	struct hentry_t *next;	/* Next entry			 */
-	struct hentry_t *prev;	/* Previous entry		 */
+	void *data;		/* data, next free entry if free */
+	struct hblock_t *blk;	/* Block holding the string	 */
+	int64_t rank;		/* Frecency, in 1/256 events	 */
+	unsigned int uses;	/* Times entered		 */
+	int hpos;		/* Heap index, -1 if none	 */
 } hentry_t;
 
+#define	H_SLABSIZE	256	/* Entries per slab		*/
+
+typedef struct hslab_t {
+	struct hslab_t *next;	/* Next slab			*/
+	hentry_t ent[H_SLABSIZE];
+} hslab_t;
+
+#define	H_BLOCKSIZE	16384	/* Minimum block size in characters */
+
+typedef struct hblock_t {
+	struct hblock_t *next;	/* Next newer block		*/
+	struct hblock_t *prev;	/* Next older block		*/
+	size_t size;		/* Size in characters		*/
+	size_t used;		/* Characters handed out	*/
+	size_t live;		/* Characters still in use	*/
+	Char str[];
+} hblock_t;
+
 typedef struct history_t {
-	hentry_t list;		/* Fake list header element	*/
-	hentry_t *cursor;	/* Current element in the list	*/
+	hentry_t **slot;	/* Ring of entries, newest first	*/
+	int nslots;		/* Allocated ring size (power of 2)	*/
+	int head;		/* Ring index of the newest entry	*/
+	int cursor;		/* Current element, -1 if none	*/
 	int max;		/* Maximum number of events	*/
 	int cur;		/* Current number of events	*/
 	int eventid;		/* For generation of unique event id	 */
 	int flags;		/* TYPE(History) flags		*/
 #define H_UNIQUE	1	/* Store only unique elements	*/
+#define H_ERASEDUPS	2	/* Erase older equal elements	*/
+#define H_INDEX		4	/* Keep the search indexes	*/
+#define H_FRECENT	8	/* Keep the frecency heap	*/
+	int halflife;		/* Events a doubling of uses is worth */
+	size_t maxbytes;	/* Byte budget, 0 if none	*/
+	hentry_t **heap;	/* Entries, least frecent first	*/
+	int heapn;		/* Entries in the heap		*/
+	int heapsize;		/* Allocated heap size		*/
+	hslab_t *slabs;		/* Entry slabs			*/
+	hentry_t *freent;	/* Free entries			*/
+	hblock_t *oldblk;	/* Oldest string block		*/
+	hblock_t *newblk;	/* Newest string block		*/
+	size_t strsize;		/* Characters in string blocks	*/
+	size_t strlive;		/* Characters in use		*/
+	size_t mem;		/* Bytes allocated		*/
+	unsigned long gen;	/* Bumped by every change	*/
+	unsigned long mgen;	/* gen of the last change other
+				 * than entering an event or
+				 * dropping the oldest one	*/
+	hentry_t **htab;	/* Index of entries by string	*/
+	unsigned int htsize;	/* Index size (power of 2)	*/
+	unsigned int htcount;	/* Indexed entries		*/
+	struct hgram_t *gtab;	/* Trigram index		*/
+	unsigned int gtsize;	/* Trigram index size (power of 2) */
+	unsigned int gtcount;	/* Trigrams in the index	*/
+	struct hnode_t *trie;	/* Prefix trie			*/
 } history_t;
 
+/*
+ * The search indexes map keys to the numbers of the events they
+ * occur in, in increasing order.  Every three character substring of
+ * an event is a key of the trigram index, so that a substring search
+ * only has to look at the events holding the rarest trigram of the
+ * pattern.  The prefix trie has a node for each prefix where event
+ * strings part, listing the events beginning with it.
+ */
+typedef struct hevlist_t {
+	int *ev;		/* Event numbers, increasing	*/
+	int first;		/* First element in use		*/
+	int n;			/* End of the elements in use	*/
+	int size;		/* Allocated elements		*/
+} hevlist_t;
+
+typedef struct hgram_t {
+	uint64_t key;		/* The trigram, 0 if the slot is free */
+	hevlist_t ev;		/* Events containing it		*/
+} hgram_t;
+
+typedef struct hnode_t {
+	struct hnode_t *child;	/* First child			*/
+	struct hnode_t *next;	/* Next sibling			*/
+	hevlist_t ev;		/* Events beginning here	*/
+	size_t len;		/* Label length			*/
+	size_t lsize;		/* Allocated label length	*/
+	Char label[];		/* Characters leading here	*/
+} hnode_t;
+
+#define	H_MINSLOTS	64	/* Initial ring size		*/
+
+/* n-th entry counting from the newest one */
+#define	HENT(h, n)	((h)->slot[((h)->head + (n)) & ((h)->nslots - 1)])
+
 static int history_def_next(void *, TYPE(HistEvent) *);
 static int history_def_first(void *, TYPE(HistEvent) *);
 static int history_def_prev(void *, TYPE(HistEvent) *);
@@ -177,19 +359,247 @@ static int history_def_del(void *, TYPE(HistEvent) *, const int);
 
 static int history_def_init(void **, TYPE(HistEvent) *, int);
 static int history_def_insert(history_t *, TYPE(HistEvent) *, const Char *);
-static void history_def_delete(history_t *, TYPE(HistEvent) *, hentry_t *);
+static void history_def_delete(history_t *, TYPE(HistEvent) *, int);
+static int history_def_find(history_t *, int);
+static int history_def_seek(history_t *, TYPE(HistEvent) *, int, int);
+static hentry_t *history_def_alloc(history_t *);
+static Char *history_def_stralloc(history_t *, hblock_t **, size_t);
+static void history_def_strfree(history_t *, hblock_t *, const Char *);
+static int history_def_replace(history_t *, const Char *, void *);
+static int history_def_setunique(history_t *, int);
+static int history_def_hashput(history_t *, hentry_t *, hentry_t **);
+static void history_def_hashdel(history_t *, hentry_t *);
+static void history_def_hashfree(history_t *);
+static void history_def_reindex(history_t *, hentry_t *);
+static void history_def_evfree(history_t *, hevlist_t *);
+static void history_def_indexput(history_t *, hentry_t *);
+static void history_def_indexdel(history_t *, hentry_t *);
+static int history_def_setindex(history_t *, int);
+static int history_def_heapput(history_t *, hentry_t *);
+static void history_def_heapdel(history_t *, hentry_t *);
+static int history_def_setfrecency(history_t *, int);
+static void history_def_evict(history_t *, TYPE(HistEvent) *);
+static int history_def_scan(history_t *, const Char *, const char *, int);
+static int history_def_substr(history_t *, TYPE(HistEvent) *, const Char *,
+    int, int *);
+static int history_def_prefix(history_t *, TYPE(HistEvent) *, const Char *,
+    int);
 
 static int history_deldata_nth(history_t *, TYPE(HistEvent) *, int, void **);
 static int history_set_nth(void *, TYPE(HistEvent) *, int);
+static int history_def_nth(void *, TYPE(HistEvent) *, int);
+static history_t *history_def_ref(TYPE(History) *);
+
+#ifdef H_SHARED_RING
+/*
+ * A shared ring file is a header followed by a ring of fixed size
+ * slots, indexed by a slot number that only grows.  Writers reserve
+ * the slots of an event by advancing tail atomically, fill them, and
+ * commit each one by storing its slot number in it last.  Every
+ * session keeps the events it has read in its own history_t, and
+ * picks up the new ones from the ring as it goes.  A slot left
+ * uncommitted for H_RING_STALL seconds is taken to belong to a
+ * writer that died and is skipped.
+ */
+#define	H_RING_SLOT	128	/* Bytes per slot		*/
+#define	H_RING_SIZE	8192	/* Default number of slots	*/
+#define	H_RING_STALL	2	/* Seconds a writer may take	*/
+
+typedef struct hring_t {
+	char magic[16];		/* hist_ring_cookie		*/
+	uint32_t slotsz;	/* Bytes per slot		*/
+	uint32_t nslots;	/* Slots in the ring		*/
+	atomic_ullong tail;	/* Slots reserved so far	*/
+} hring_t;
+
+typedef struct hrslot_t {
+	atomic_ullong seq;	/* Slot number once committed	*/
+	uint32_t len;		/* Event bytes, 0 if continued	*/
+	uint32_t spare;
+	char data[H_RING_SLOT - 16];	/* Event bytes		*/
+} hrslot_t;
+
+typedef struct hshared_t {
+	history_t *hist;	/* Events read so far		*/
+	hring_t *ring;		/* The mapped file		*/
+	hrslot_t *slot;		/* Its slots			*/
+	size_t mapsz;		/* Bytes mapped			*/
+	unsigned long long rpos;	/* Next slot to read	*/
+	unsigned long long stall;	/* Last uncommitted slot */
+	struct timespec stallt;	/* When it was first seen	*/
+	char *buf;		/* Event being read		*/
+	size_t bufsz;		/* Its allocated size		*/
+#ifndef NARROWCHAR
+	ct_buffer_t conv;	/* Decoding buffer		*/
+#endif
+} hshared_t;
+
+static int history_ring_first(void *, TYPE(HistEvent) *);
+static int history_ring_next(void *, TYPE(HistEvent) *);
+static int history_ring_last(void *, TYPE(HistEvent) *);
+static int history_ring_prev(void *, TYPE(HistEvent) *);
+static int history_ring_curr(void *, TYPE(HistEvent) *);
+static int history_ring_set(void *, TYPE(HistEvent) *, const int);
+static void history_ring_clear(void *, TYPE(HistEvent) *);
+static int history_ring_enter(void *, TYPE(HistEvent) *, const Char *);
+static int history_ring_add(void *, TYPE(HistEvent) *, const Char *);
+static int history_ring_del(void *, TYPE(HistEvent) *, const int);
+#endif
+static int history_ring_open(TYPE(History) *, TYPE(HistEvent) *,
+    const char *, int);
+static void history_ring_close(TYPE(History) *);
+
+#ifdef H_MAPPED_FILE
+/*
+ * A mapped history file is a header, an index of cap offsets and
+ * the NUL terminated multibyte strings of the events they point to,
+ * oldest first.  Nothing is read when it is opened: events are
+ * returned from the mapping as they are asked for, and entered by
+ * appending the string and then its offset.  Writers hold a lock on
+ * the file, and replace it by a copy with a larger index once the
+ * index is full.  The event numbered base + i + 1 is at index i.
+ * The strings of a narrow history are handed out straight from the
+ * mapping, so they must stay put until the history stops using the
+ * file: the data is only ever appended to, even by H_CLEAR, and the
+ * mappings replaced as the file grows are kept until then.  Wide
+ * histories decode the strings into a buffer of their own.
+ */
+#define	H_MAP_SLOTS	1024	/* Initial index slots		*/
+#define	H_MAP_DATA	16384	/* Initial data bytes		*/
+#define	H_MAP_DEAD	((uint64_t)1 << 63)	/* Deleted offset */
+
+typedef struct hmhead_t {
+	char magic[16];		/* hist_map_cookie		*/
+	uint64_t cap;		/* Slots in the index		*/
+	atomic_ullong n;	/* Slots used			*/
+	uint64_t dead;		/* Of them deleted		*/
+	uint64_t dend;		/* Data bytes used		*/
+	uint64_t base;		/* Events cleared before	*/
+	uint64_t spare;
+} hmhead_t;
+
+typedef struct hmold_t {
+	struct hmold_t *next;	/* Next one replaced		*/
+	void *addr;		/* A mapping replaced		*/
+	size_t len;		/* Its length			*/
+} hmold_t;
+
+typedef struct hmap_t {
+	hmhead_t *head;		/* The mapped file		*/
+	uint64_t *off;		/* Its index			*/
+	char *data;		/* Its event data		*/
+	size_t mapsz;		/* Bytes mapped			*/
+	size_t dsize;		/* Of them data bytes		*/
+	int fd;			/* The file, locked when writing */
+	dev_t dev;		/* Its device			*/
+	ino_t ino;		/* Its inode, to see it replaced */
+	char *fname;		/* Its name			*/
+	uint64_t n;		/* Slots seen			*/
+	uint64_t base;		/* Events cleared before them	*/
+	int live;		/* Events seen			*/
+	int64_t cursor;		/* Slot of the current event, or -1 */
+	int unique;		/* Skip events equal to the newest */
+#ifdef NARROWCHAR
+	hmold_t *old;		/* Mappings replaced		*/
+#else
+	ct_buffer_t conv;	/* Coding buffer		*/
+#endif
+} hmap_t;
+
+static int history_map_first(void *, TYPE(HistEvent) *);
+static int history_map_next(void *, TYPE(HistEvent) *);
+static int history_map_last(void *, TYPE(HistEvent) *);
+static int history_map_prev(void *, TYPE(HistEvent) *);
+static int history_map_curr(void *, TYPE(HistEvent) *);
+static int history_map_set(void *, TYPE(HistEvent) *, const int);
+static void history_map_clear(void *, TYPE(HistEvent) *);
+static int history_map_enter(void *, TYPE(HistEvent) *, const Char *);
+static int history_map_add(void *, TYPE(HistEvent) *, const Char *);
+static int history_map_del(void *, TYPE(HistEvent) *, const int);
+static int history_map_sync(hmap_t *, int);
+static void history_map_free(hmap_t *);
+#define	history_is_mapped(h)	((h)->h_next == history_map_next)
+#else
+#define	history_is_mapped(h)	0
+#endif
+static int history_map_open(TYPE(History) *, TYPE(HistEvent) *,
+    const char *);
+static int history_map_close(TYPE(History) *, TYPE(HistEvent) *);
+
+/*
+ * A packed history front codes its events in blocks of up to
+ * HP_BLOCK of them, oldest first.  Each string is coded as the
+ * length of the prefix it shares with one of the HP_DICT events
+ * before it in the block, which one, and the characters after that
+ * prefix; together with the event number delta these are varints.
+ * Blocks decode on their own, so only the block of the current
+ * event and the newest one, which events are added to, are kept
+ * decoded.
+ */
+#define	HP_BLOCK	64	/* Events per block		*/
+#define	HP_DICT		16	/* Earlier events a prefix comes from */
+#define	HP_MINCODE	256	/* Initial code bytes of a block */
+#ifdef NARROWCHAR
+#define	HP_CHARMAX	1	/* Code bytes per character	*/
+#else
+#define	HP_CHARMAX	5
+#endif
+#define	HP_NUMMAX	10	/* Code bytes per varint	*/
+
+typedef struct hpblk_t {
+	size_t len;		/* Code bytes used		*/
+	size_t size;		/* Code bytes allocated		*/
+	int n;			/* Events coded			*/
+	int skip;		/* Oldest of them dropped	*/
+	int last;		/* Number of the newest event	*/
+	unsigned char code[];
+} hpblk_t;
+
+typedef struct hpview_t {
+	hpblk_t *blk;		/* Block decoded, NULL if none	*/
+	Char *buf;		/* Its strings			*/
+	size_t size;		/* Characters allocated		*/
+	size_t len;		/* Characters used		*/
+	size_t off[HP_BLOCK];	/* Offset of each string	*/
+	int num[HP_BLOCK];	/* Number of each event		*/
+} hpview_t;
+
+typedef struct hpack_t {
+	hpblk_t **blk;		/* Blocks, oldest first		*/
+	int b0;			/* Index of the oldest block	*/
+	int nblk;		/* End of the blocks		*/
+	int blksz;		/* Allocated block pointers	*/
+	int cb;			/* Block of the current event, -1 if none */
+	int ck;			/* Current event in the block	*/
+	int max;		/* Maximum number of events	*/
+	int cur;		/* Current number of events	*/
+	int eventid;		/* For generation of unique event id */
+	int unique;		/* Skip events equal to the newest */
+	size_t mem;		/* Bytes allocated		*/
+	hpview_t tail;		/* The newest block		*/
+	hpview_t view;		/* The block of the current event */
+} hpack_t;
+
+static int history_pack_first(void *, TYPE(HistEvent) *);
+static int history_pack_next(void *, TYPE(HistEvent) *);
+static int history_pack_last(void *, TYPE(HistEvent) *);
+static int history_pack_prev(void *, TYPE(HistEvent) *);
+static int history_pack_curr(void *, TYPE(HistEvent) *);
+static int history_pack_set(void *, TYPE(HistEvent) *, const int);
+static void history_pack_clear(void *, TYPE(HistEvent) *);
+static int history_pack_enter(void *, TYPE(HistEvent) *, const Char *);
+static int history_pack_add(void *, TYPE(HistEvent) *, const Char *);
+static int history_pack_del(void *, TYPE(HistEvent) *, const int);
+static int history_pack_open(TYPE(History) *, TYPE(HistEvent) *);
+static int history_pack_close(TYPE(History) *, TYPE(HistEvent) *);
+static void history_pack_free(hpack_t *);
+static hpack_t *history_pack_ref(TYPE(History) *);
 
 #define	history_def_setsize(p, num) (((history_t *)p)->max = (num))
 #define	history_def_getsize(p)  (((history_t *)p)->cur)
-#define	history_def_getunique(p) (((((history_t *)p)->flags) & H_UNIQUE) != 0)
-#define	history_def_setunique(p, uni) \
-    if (uni) \
-	(((history_t *)p)->flags) |= H_UNIQUE; \
-    else \
-	(((history_t *)p)->flags) &= ~H_UNIQUE
+#define	history_def_getunique(p) \
+    ((((history_t *)p)->flags & H_ERASEDUPS) ? 2 : \
+    (((history_t *)p)->flags & H_UNIQUE) != 0)
 
 #define	he_strerror(code)	he_errlist[code]
 #define	he_seterrev(evp, code)	{\
@@ -242,13 +652,13 @@ history_def_first(void *p, TYPE(HistEvent) *ev)
 {
 	history_t *h = (history_t *) p;
 
-	h->cursor = h->list.next;
-	if (h->cursor != &h->list)
-		*ev = h->cursor->ev;
-	else {
+	if (h->cur == 0) {
+		h->cursor = -1;
 		he_seterrev(ev, _HE_FIRST_NOTFOUND);
 		return -1;
 	}
+	h->cursor = 0;
+	*ev = HENT(h, h->cursor)->ev;
 
 	return 0;
 }
@@ -262,13 +672,13 @@ history_def_last(void *p, TYPE(HistEvent) *ev)
 {
 	history_t *h = (history_t *) p;
 
-	h->cursor = h->list.prev;
-	if (h->cursor != &h->list)
-		*ev = h->cursor->ev;
-	else {
+	if (h->cur == 0) {
+		h->cursor = -1;
 		he_seterrev(ev, _HE_LAST_NOTFOUND);
 		return -1;
 	}
+	h->cursor = h->cur - 1;
+	*ev = HENT(h, h->cursor)->ev;
 
 	return 0;
 }
@@ -282,18 +692,18 @@ history_def_next(void *p, TYPE(HistEvent) *ev)
 {
 	history_t *h = (history_t *) p;
 
-	if (h->cursor == &h->list) {
+	if (h->cursor == -1) {
 		he_seterrev(ev, _HE_EMPTY_LIST);
 		return -1;
 	}
 
-	if (h->cursor->next == &h->list) {
+	if (h->cursor + 1 >= h->cur) {
 		he_seterrev(ev, _HE_END_REACHED);
 		return -1;
 	}
 
-        h->cursor = h->cursor->next;
-        *ev = h->cursor->ev;
+	h->cursor++;
+	*ev = HENT(h, h->cursor)->ev;
 
 	return 0;
 }
@@ -307,19 +717,19 @@ history_def_prev(void *p, TYPE(HistEvent) *ev)
 {
 	history_t *h = (history_t *) p;
 
-	if (h->cursor == &h->list) {
+	if (h->cursor == -1) {
 		he_seterrev(ev,
 		    (h->cur > 0) ? _HE_END_REACHED : _HE_EMPTY_LIST);
 		return -1;
 	}
 
-	if (h->cursor->prev == &h->list) {
+	if (h->cursor == 0) {
 		he_seterrev(ev, _HE_START_REACHED);
 		return -1;
 	}
 
-        h->cursor = h->cursor->prev;
-        *ev = h->cursor->ev;
+	h->cursor--;
+	*ev = HENT(h, h->cursor)->ev;
 
 	return 0;
 }
@@ -333,8 +743,8 @@ history_def_curr(void *p, TYPE(HistEvent) *ev)
 {
 	history_t *h = (history_t *) p;
 
-	if (h->cursor != &h->list)
-		*ev = h->cursor->ev;
+	if (h->cursor != -1)
+		*ev = HENT(h, h->cursor)->ev;
 	else {
 		he_seterrev(ev,
 		    (h->cur > 0) ? _HE_CURR_INVALID : _HE_EMPTY_LIST);
@@ -345,546 +755,5369 @@ history_def_curr(void *p, TYPE(HistEvent) *ev)
 }
 
 
-/* history_def_set():
- *	Default function to set the current event in the history to the
- *	given one.
+/* history_def_find():
+ *	Return the position of the event numbered num, or -1.
+ *	Event numbers decrease strictly from the newest entry on, so
+ *	unless entries were deleted out of order the event is found
+ *	directly and a binary search is only the fallback.
  */
 static int
-history_def_set(void *p, TYPE(HistEvent) *ev, const int n)
+history_def_find(history_t *h, int num)
 {
-	history_t *h = (history_t *) p;
+	int lo, hi, mid, n;
 
-	if (h->cur == 0) {
-		he_seterrev(ev, _HE_EMPTY_LIST);
-		return -1;
-	}
-	if (h->cursor == &h->list || h->cursor->ev.num != n) {
-		for (h->cursor = h->list.next; h->cursor != &h->list;
-		    h->cursor = h->cursor->next)
-			if (h->cursor->ev.num == n)
-				break;
-	}
-	if (h->cursor == &h->list) {
-		he_seterrev(ev, _HE_NOT_FOUND);
+	if (h->cur == 0)
 		return -1;
+
+	lo = HENT(h, 0)->ev.num - num;
+	if (lo >= 0 && lo < h->cur && HENT(h, lo)->ev.num == num)
+		return lo;
+
+	for (lo = 0, hi = h->cur - 1; lo <= hi;) {
+		mid = lo + (hi - lo) / 2;
+		n = HENT(h, mid)->ev.num;
+		if (n == num)
+			return mid;
+		if (n > num)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
 	}
-	return 0;
+	return -1;
 }
 
 
-/* history_set_nth():
- *	Default function to set the current event in the history to the
- *	n-th one.
+/* history_def_seek():
+ *	Move the cursor to the event numbered num, looking only
+ *	towards newer (dir < 0) or older (dir > 0) events than the
+ *	current one.  Leaves the cursor where a walk would have left
+ *	it when the event is not found.
  */
 static int
-history_set_nth(void *p, TYPE(HistEvent) *ev, int n)
+history_def_seek(history_t *h, TYPE(HistEvent) *ev, int num, int dir)
 {
-	history_t *h = (history_t *) p;
+	int n;
 
-	if (h->cur == 0) {
-		he_seterrev(ev, _HE_EMPTY_LIST);
+	if (h->cursor == -1) {
+		he_seterrev(ev, _HE_NOT_FOUND);
 		return -1;
 	}
-	for (h->cursor = h->list.prev; h->cursor != &h->list;
-	    h->cursor = h->cursor->prev)
-		if (n-- <= 0)
-			break;
-	if (h->cursor == &h->list) {
+	n = history_def_find(h, num);
+	if (n == -1 || (dir < 0 ? n > h->cursor : n < h->cursor)) {
+		h->cursor = dir < 0 ? 0 : h->cur - 1;
 		he_seterrev(ev, _HE_NOT_FOUND);
 		return -1;
 	}
+	h->cursor = n;
+	*ev = HENT(h, n)->ev;
 	return 0;
 }
 
 
-/* history_def_add():
- *	Append string to element
+/* history_def_alloc():
+ *	Get a free entry, carving up a new slab if needed
  */
-static int
-history_def_add(void *p, TYPE(HistEvent) *ev, const Char *str)
+static hentry_t *
+history_def_alloc(history_t *h)
 {
-	history_t *h = (history_t *) p;
-	size_t len, elen, slen;
+	hslab_t *sl;
+	hentry_t *c;
+	int i;
+
+	if (h->freent == NULL) {
+		if ((sl = h_malloc(sizeof(*sl))) == NULL)
+			return NULL;
+		sl->next = h->slabs;
+		h->slabs = sl;
+		h->mem += sizeof(*sl);
+		for (i = H_SLABSIZE - 1; i >= 0; i--) {
+			sl->ent[i].data = h->freent;
+			h->freent = &sl->ent[i];
+		}
+	}
+	c = h->freent;
+	h->freent = c->data;
+	return c;
+}
+
+
+/* history_def_stralloc():
+ *	Get room for a string of len characters from the newest block,
+ *	starting a new block if it does not fit
+ */
+static Char *
+history_def_stralloc(history_t *h, hblock_t **blk, size_t len)
+{
+	hblock_t *b = h->newblk;
 	Char *s;
-	HistEventPrivate *evp = (void *)&h->cursor->ev;
 
-	if (h->cursor == &h->list)
-		return history_def_enter(p, ev, str);
-	elen = Strlen(evp->str);
-	slen = Strlen(str);
-	len = elen + slen + 1;
-	s = h_malloc(len * sizeof(*s));
-	if (s == NULL) {
-		he_seterrev(ev, _HE_MALLOC_FAILED);
-		return -1;
+	if (b == NULL || b->size - b->used < len) {
+		size_t size = len > H_BLOCKSIZE ? len : H_BLOCKSIZE;
+		if ((b = h_malloc(sizeof(*b) + size * sizeof(*b->str))) == NULL)
+			return NULL;
+		b->size = size;
+		b->used = b->live = 0;
+		b->next = NULL;
+		b->prev = h->newblk;
+		if (h->newblk != NULL)
+			h->newblk->next = b;
+		else
+			h->oldblk = b;
+		h->newblk = b;
+		h->strsize += size;
+		h->mem += sizeof(*b) + size * sizeof(*b->str);
 	}
-	memcpy(s, evp->str, elen * sizeof(*s));
-	memcpy(s + elen, str, slen * sizeof(*s)); 
-        s[len - 1] = '\0';
-	h_free(evp->str);
-	evp->str = s;
-	*ev = h->cursor->ev;
-	return 0;
+	s = b->str + b->used;
+	b->used += len;
+	b->live += len;
+	h->strlive += len;
+	*blk = b;
+	return s;
+}
+
+
+/* history_def_strfree():
+ *	Release string s of block b, freeing the block once unused
+ */
+static void
+history_def_strfree(history_t *h, hblock_t *b, const Char *s)
+{
+	size_t len = Strlen(s) + 1;
+
+	b->live -= len;
+	h->strlive -= len;
+	if (b->live != 0)
+		return;
+	if (b == h->newblk) {
+		b->used = 0;
+		return;
+	}
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		h->oldblk = b->next;
+	b->next->prev = b->prev;
+	h->strsize -= b->size;
+	h->mem -= sizeof(*b) + b->size * sizeof(*b->str);
+	h_free(b);
+}
+
+
+/* history_def_hash():
+ *	FNV-1a hash of an event string
+ */
+static unsigned int
+history_def_hash(const Char *s)
+{
+	unsigned int hv = 2166136261U;
+
+	while (*s)
+		hv = (hv ^ UCHAR(*s++)) * 16777619U;
+	return hv;
+}
+
+
+/* history_def_lookup():
+ *	Return the hash index slot holding str, or the empty slot
+ *	where it would go
+ */
+static hentry_t **
+history_def_lookup(history_t *h, const Char *str)
+{
+	unsigned int i, mask = h->htsize - 1;
+
+	for (i = history_def_hash(str) & mask; h->htab[i] != NULL;
+	    i = (i + 1) & mask)
+		if (Strcmp(h->htab[i]->ev.str, str) == 0)
+			break;
+	return &h->htab[i];
 }
 
 
+/* history_def_hashput():
+ *	Index entry c, growing the index to keep it at most half full.
+ *	An entry already indexed under the same string stays there if
+ *	it is the newer of the two, and is returned.
+ */
 static int
-history_deldata_nth(history_t *h, TYPE(HistEvent) *ev,
-    int num, void **data)
+history_def_hashput(history_t *h, hentry_t *c, hentry_t **dup)
 {
-	if (history_set_nth(h, ev, num) != 0)
-		return -1;
-	/* magic value to skip delete (just set to n-th history) */
-	if (data == (void **)-1)
+	hentry_t **slot, **otab;
+	unsigned int i, osize;
+
+	if ((h->htcount + 1) * 2 > h->htsize) {
+		otab = h->htab;
+		osize = h->htsize;
+		h->htsize = osize ? osize * 2 : H_MINSLOTS;
+		h->htab = h_malloc(h->htsize * sizeof(*h->htab));
+		if (h->htab == NULL) {
+			h->htab = otab;
+			h->htsize = osize;
+			return -1;
+		}
+		memset(h->htab, 0, h->htsize * sizeof(*h->htab));
+		for (i = 0; i < osize; i++)
+			if (otab[i] != NULL)
+				*history_def_lookup(h, otab[i]->ev.str) =
+				    otab[i];
+		h_free(otab);
+		h->mem += (h->htsize - osize) * sizeof(*h->htab);
+	}
+	slot = history_def_lookup(h, c->ev.str);
+	*dup = *slot;
+	if (*slot == NULL)
+		h->htcount++;
+	else if ((*slot)->ev.num > c->ev.num)
 		return 0;
-	ev->str = Strdup(h->cursor->ev.str);
-	ev->num = h->cursor->ev.num;
-	if (data)
-		*data = h->cursor->data;
-	history_def_delete(h, ev, h->cursor);
+	*slot = c;
 	return 0;
 }
 
 
-/* history_def_del():
- *	Delete element hp of the h list
+/* history_def_hashdel():
+ *	Drop entry c from the index, closing the gap in its probe
+ *	sequence
  */
-static int
-history_def_del(void *p, TYPE(HistEvent) *ev libedit_unused, const int num)
+static void
+history_def_hashdel(history_t *h, hentry_t *c)
 {
-	history_t *h = (history_t *) p;
-	if (history_def_set(h, ev, num) != 0)
-		return -1;
-	ev->str = Strdup(h->cursor->ev.str);
-	ev->num = h->cursor->ev.num;
-	history_def_delete(h, ev, h->cursor);
-	return 0;
+	unsigned int i, j, k, mask = h->htsize - 1;
+	hentry_t **slot = history_def_lookup(h, c->ev.str);
+
+	if (*slot != c)
+		return;
+	for (i = j = (unsigned int)(slot - h->htab);;) {
+		j = (j + 1) & mask;
+		if (h->htab[j] == NULL)
+			break;
+		k = history_def_hash(h->htab[j]->ev.str) & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		h->htab[i] = h->htab[j];
+		i = j;
+	}
+	h->htab[i] = NULL;
+	h->htcount--;
 }
 
 
-/* history_def_delete():
- *	Delete element hp of the h list
+/* history_def_hashfree():
+ *	Free the duplicate index
  */
 static void
-history_def_delete(history_t *h, TYPE(HistEvent) *ev libedit_unused,
-	hentry_t *hp)
+history_def_hashfree(history_t *h)
 {
-	HistEventPrivate *evp = (void *)&hp->ev;
-	if (hp == &h->list)
-		abort();
-	if (h->cursor == hp) {
-		h->cursor = hp->prev;
-		if (h->cursor == &h->list)
-			h->cursor = hp->next;
-	}
-	hp->prev->next = hp->next;
-	hp->next->prev = hp->prev;
-	h_free(evp->str);
-	h_free(hp);
-	h->cur--;
+	h->mem -= h->htsize * sizeof(*h->htab);
+	h_free(h->htab);
+	h->htab = NULL;
+	h->htsize = 0;
+	h->htcount = 0;
 }
 
 
-/* history_def_insert():
- *	Insert element with string str in the h list
+/* history_def_reindex():
+ *	Index entry c after its string changed; if the index cannot
+ *	grow, stop erasing duplicates rather than fail the caller
  */
-static int
-history_def_insert(history_t *h, TYPE(HistEvent) *ev, const Char *str)
+static void
+history_def_reindex(history_t *h, hentry_t *c)
 {
-	hentry_t *c;
+	hentry_t *dup;
 
-	c = h_malloc(sizeof(*c));
-	if (c == NULL)
-		goto oomem;
-	if ((c->ev.str = h_strdup(str)) == NULL) {
-		h_free(c);
-		goto oomem;
+	if (history_def_hashput(h, c, &dup) == -1) {
+		history_def_hashfree(h);
+		h->flags &= ~H_ERASEDUPS;
 	}
-	c->data = NULL;
-	c->ev.num = ++h->eventid;
-	c->next = h->list.next;
-	c->prev = &h->list;
-	h->list.next->prev = c;
-	h->list.next = c;
-	h->cur++;
-	h->cursor = c;
-
-	*ev = c->ev;
-	return 0;
-oomem:
-	he_seterrev(ev, _HE_MALLOC_FAILED);
-	return -1;
 }
 
 
-/* history_def_enter():
- *	Default function to enter an item in the history
+/* history_def_setunique():
+ *	Set how duplicate events are handled: 0 keeps them, 1 skips
+ *	an event equal to the last one and 2 erases all older equal
+ *	events.  Switching to 2 erases the duplicates already present.
  */
 static int
-history_def_enter(void *p, TYPE(HistEvent) *ev, const Char *str)
+history_def_setunique(history_t *h, int uni)
 {
-	history_t *h = (history_t *) p;
+	hentry_t *c, *dup;
+	int i, n, cursor = -1, rv = 0;
 
-	if ((h->flags & H_UNIQUE) != 0 && h->list.next != &h->list &&
-	    Strcmp(h->list.next->ev.str, str) == 0)
-	    return 0;
+	if (uni == 2 && (h->flags & H_ERASEDUPS) != 0)
+		return 0;
+	h->flags &= ~(H_UNIQUE | H_ERASEDUPS);
+	history_def_hashfree(h);
+	if (uni != 2) {
+		if (uni)
+			h->flags |= H_UNIQUE;
+		return 0;
+	}
 
-	if (history_def_insert(h, ev, str) == -1)
-		return -1;	/* error, keep error message */
+	for (i = n = 0; i < h->cur; i++) {
+		c = HENT(h, i);
+		/* Out of memory, keep the rest as they are */
+		if (rv == 0 && history_def_hashput(h, c, &dup) == -1)
+			rv = -1;
+		if (rv == 0 && dup != NULL) {
+			if ((h->flags & H_INDEX) != 0)
+				history_def_indexdel(h, c);
+			if (c->hpos != -1)
+				history_def_heapdel(h, c);
+			if (dup->uses < UINT_MAX - c->uses)
+				dup->uses += c->uses;
+			else
+				dup->uses = UINT_MAX;
+			if (dup->hpos != -1) {
+				history_def_heapdel(h, dup);
+				(void)history_def_heapput(h, dup);
+			}
+			history_def_strfree(h, c->blk, c->ev.str);
+			c->data = h->freent;
+			h->freent = c;
+		} else
+			HENT(h, n++) = c;
+		if (i == h->cursor)
+			cursor = n - 1;
+	}
+	/* Events left the middle, so positions taken so far are stale */
+	if (n < h->cur)
+		h->mgen = ++h->gen;
+	h->cur = n;
+	h->cursor = cursor;
+	if (rv == -1) {
+		history_def_hashfree(h);
+		return -1;
+	}
+	h->flags |= H_ERASEDUPS;
+	return 0;
+}
 
-	/*
-         * Always keep at least one entry.
-         * This way we don't have to check for the empty list.
-         */
-	while (h->cur > h->max && h->cur > 0)
-		history_def_delete(h, ev, h->list.prev);
 
-	return 1;
+/* history_def_evfind():
+ *	Return the first element of event list l that is not less
+ *	than num
+ */
+static int
+history_def_evfind(const hevlist_t *l, int num)
+{
+	int lo = l->first, hi = l->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (l->ev[mid] < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
 
-/* history_def_init():
- *	Default history initialization function
+/* history_def_evput():
+ *	Add event num to event list l unless it is there already
  */
 static int
-history_def_init(void **p, TYPE(HistEvent) *ev libedit_unused, int n)
+history_def_evput(history_t *h, hevlist_t *l, int num)
 {
-	history_t *h = (history_t *) h_malloc(sizeof(*h));
-	if (h == NULL)
-		return -1;
+	int i;
 
-	if (n <= 0)
-		n = 0;
-	h->eventid = 0;
-	h->cur = 0;
-	h->max = n;
-	h->list.next = h->list.prev = &h->list;
-	h->list.ev.str = NULL;
-	h->list.ev.num = 0;
-	h->cursor = &h->list;
-	h->flags = 0;
-	*p = h;
+	if (l->first == l->n || l->ev[l->n - 1] < num)
+		i = l->n;
+	else if ((i = history_def_evfind(l, num)) < l->n && l->ev[i] == num)
+		return 0;
+	if (l->n == l->size && l->first > l->size / 2) {
+		memmove(l->ev, l->ev + l->first,
+		    (size_t)(l->n - l->first) * sizeof(*l->ev));
+		i -= l->first;
+		l->n -= l->first;
+		l->first = 0;
+	}
+	if (l->n == l->size) {
+		int nsize = l->size ? l->size * 2 : 4;
+		int *nev = h_realloc(l->ev, (size_t)nsize * sizeof(*nev));
+		if (nev == NULL)
+			return -1;
+		h->mem += (size_t)(nsize - l->size) * sizeof(*nev);
+		l->ev = nev;
+		l->size = nsize;
+	}
+	memmove(l->ev + i + 1, l->ev + i, (size_t)(l->n - i) * sizeof(*l->ev));
+	l->ev[i] = num;
+	l->n++;
 	return 0;
 }
 
 
-/* history_def_clear():
- *	Default history cleanup function
+/* history_def_evdel():
+ *	Remove event num from event list l, freeing the list once empty
  */
 static void
-history_def_clear(void *p, TYPE(HistEvent) *ev)
+history_def_evdel(history_t *h, hevlist_t *l, int num)
 {
-	history_t *h = (history_t *) p;
+	int i;
 
-	while (h->list.prev != &h->list)
-		history_def_delete(h, ev, h->list.prev);
-	h->cursor = &h->list;
-	h->eventid = 0;
-	h->cur = 0;
+	if ((i = history_def_evfind(l, num)) == l->n || l->ev[i] != num)
+		return;
+	if (i == l->first)
+		l->first++;
+	else {
+		memmove(l->ev + i, l->ev + i + 1,
+		    (size_t)(l->n - i - 1) * sizeof(*l->ev));
+		l->n--;
+	}
+	if (l->first == l->n)
+		history_def_evfree(h, l);
 }
 
 
+/* history_def_evfree():
+ *	Free event list l
+ */
+static void
+history_def_evfree(history_t *h, hevlist_t *l)
+{
+	h->mem -= (size_t)l->size * sizeof(*l->ev);
+	h_free(l->ev);
+	l->ev = NULL;
+	l->first = l->n = l->size = 0;
+}
 
 
-/************************************************************************/
-
-/* history_init():
- *	Initialization function.
+/* history_def_evnear():
+ *	Return the position of the event of list l nearest to the
+ *	current one, looking from it towards older (dir > 0) or newer
+ *	(dir < 0) events, for which match() holds if it is not NULL.
  */
-TYPE(History) *
-FUN(history,init)()
+static int
+history_def_evnear(history_t *h, const hevlist_t *l, int dir,
+    int (*match)(const Char *, const Char *), const Char *str)
 {
-	TYPE(HistEvent) ev;
-	TYPE(History) *h = (TYPE(History) *) h_malloc(sizeof(*h));
-	if (h == NULL)
-		return NULL;
-
-	if (history_def_init(&h->h_ref, &ev, 0) == -1) {
-		h_free(h);
-		return NULL;
+	int i, n, num = HENT(h, h->cursor)->ev.num;
+
+	i = history_def_evfind(l, num);
+	if (dir > 0 && (i == l->n || l->ev[i] != num))
+		i--;
+	for (; i >= l->first && i < l->n; i -= dir) {
+		n = history_def_find(h, l->ev[i]);
+		if (n != -1 && (match == NULL ||
+		    (*match)(HENT(h, n)->ev.str, str)))
+			return n;
 	}
-	h->h_ent = -1;
-	h->h_next = history_def_next;
-	h->h_first = history_def_first;
-	h->h_last = history_def_last;
-	h->h_prev = history_def_prev;
-	h->h_curr = history_def_curr;
-	h->h_set = history_def_set;
-	h->h_clear = history_def_clear;
-	h->h_enter = history_def_enter;
-	h->h_add = history_def_add;
-	h->h_del = history_def_del;
+	return -1;
+}
 
-	return h;
+
+/* history_def_gramkey():
+ *	Key of the trigram starting at s, which must have three
+ *	characters left
+ */
+static uint64_t
+history_def_gramkey(const Char *s)
+{
+	return ((uint64_t)UCHAR(s[0]) << 42) |
+	    ((uint64_t)UCHAR(s[1]) << 21) | (uint64_t)UCHAR(s[2]);
 }
 
 
-/* history_end():
- *	clean up history;
+/* history_def_gramslot():
+ *	Return the trigram index slot for key, or the free slot where
+ *	it would go
  */
-void
-FUN(history,end)(TYPE(History) *h)
+static hgram_t *
+history_def_gramslot(history_t *h, uint64_t key)
 {
-	TYPE(HistEvent) ev;
+	unsigned int i, mask = h->gtsize - 1;
 
-	if (h->h_next == history_def_next)
-		history_def_clear(h->h_ref, &ev);
-	h_free(h->h_ref);
-	h_free(h);
+	for (i = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	    h->gtab[i].key != 0; i = (i + 1) & mask)
+		if (h->gtab[i].key == key)
+			break;
+	return &h->gtab[i];
 }
 
 
-
-/* history_setsize():
- *	Set history number of events
+/* history_def_gramgrow():
+ *	Make room for another trigram, dropping the trigrams no event
+ *	contains any more
+ */
+static int
+history_def_gramgrow(history_t *h)
+{
+	hgram_t *otab = h->gtab;
+	unsigned int i, osize = h->gtsize, live = 0;
+
+	if ((h->gtcount + 1) * 2 <= h->gtsize)
+		return 0;
+	for (i = 0; i < osize; i++)
+		if (otab[i].key != 0 && otab[i].ev.first != otab[i].ev.n)
+			live++;
+	h->gtsize = osize == 0 ? H_MINSLOTS :
+	    (live + 1) * 4 <= osize ? osize : osize * 2;
+	if ((h->gtab = h_malloc(h->gtsize * sizeof(*h->gtab))) == NULL) {
+		h->gtab = otab;
+		h->gtsize = osize;
+		return -1;
+	}
+	memset(h->gtab, 0, h->gtsize * sizeof(*h->gtab));
+	for (i = 0; i < osize; i++)
+		if (otab[i].key != 0 && otab[i].ev.first != otab[i].ev.n)
+			*history_def_gramslot(h, otab[i].key) = otab[i];
+	h_free(otab);
+	h->mem += (h->gtsize - osize) * sizeof(*h->gtab);
+	h->gtcount = live;
+	return 0;
+}
+
+
+/* history_def_gramput():
+ *	Add the trigrams of entry c to the index
+ */
+static int
+history_def_gramput(history_t *h, hentry_t *c)
+{
+	const Char *s;
+	hgram_t *g;
+
+	for (s = c->ev.str; s[0] && s[1] && s[2]; s++) {
+		if (history_def_gramgrow(h) == -1)
+			return -1;
+		g = history_def_gramslot(h, history_def_gramkey(s));
+		if (g->key == 0) {
+			g->key = history_def_gramkey(s);
+			h->gtcount++;
+		}
+		if (history_def_evput(h, &g->ev, c->ev.num) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/* history_def_gramdel():
+ *	Remove the trigrams of entry c from the index
+ */
+static void
+history_def_gramdel(history_t *h, hentry_t *c)
+{
+	const Char *s;
+	hgram_t *g;
+
+	if (h->gtsize == 0)
+		return;
+	for (s = c->ev.str; s[0] && s[1] && s[2]; s++) {
+		g = history_def_gramslot(h, history_def_gramkey(s));
+		if (g->key != 0)
+			history_def_evdel(h, &g->ev, c->ev.num);
+	}
+}
+
+
+/* history_def_gramfree():
+ *	Free the trigram index
+ */
+static void
+history_def_gramfree(history_t *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->gtsize; i++)
+		history_def_evfree(h, &h->gtab[i].ev);
+	h->mem -= h->gtsize * sizeof(*h->gtab);
+	h_free(h->gtab);
+	h->gtab = NULL;
+	h->gtsize = 0;
+	h->gtcount = 0;
+}
+
+
+/* history_def_trienode():
+ *	Allocate a prefix trie node with room for a label of size
+ *	characters, reached through the len characters at s
+ */
+static hnode_t *
+history_def_trienode(history_t *h, const Char *s, size_t len, size_t size)
+{
+	hnode_t *n;
+
+	if ((n = h_malloc(sizeof(*n) + size * sizeof(*n->label))) == NULL)
+		return NULL;
+	memset(n, 0, sizeof(*n));
+	memcpy(n->label, s, len * sizeof(*n->label));
+	n->len = len;
+	n->lsize = size;
+	h->mem += sizeof(*n) + size * sizeof(*n->label);
+	return n;
+}
+
+
+/* history_def_triefree():
+ *	Free prefix trie node n and the nodes below it
+ */
+static void
+history_def_triefree(history_t *h, hnode_t *n)
+{
+	hnode_t *c;
+
+	while ((c = n->child) != NULL) {
+		n->child = c->next;
+		history_def_triefree(h, c);
+	}
+	history_def_evfree(h, &n->ev);
+	h->mem -= sizeof(*n) + n->lsize * sizeof(*n->label);
+	h_free(n);
+}
+
+
+/* history_def_triechild():
+ *	Return the link to the child of n whose label starts with ch
+ */
+static hnode_t **
+history_def_triechild(hnode_t *n, Char ch)
+{
+	hnode_t **np;
+
+	for (np = &n->child; *np != NULL && (*np)->label[0] != ch;
+	    np = &(*np)->next)
+		continue;
+	return np;
+}
+
+
+/* history_def_trieput():
+ *	Add entry c to the prefix trie, splitting the label that its
+ *	string leaves or ends in
+ */
+static int
+history_def_trieput(history_t *h, hentry_t *c)
+{
+	const Char *s = c->ev.str;
+	hnode_t **np, *n, *m;
+	size_t i;
+
+	if (h->trie == NULL && (h->trie = history_def_trienode(h, s, 0, 0)) == NULL)
+		return -1;
+	n = h->trie;
+	if (history_def_evput(h, &n->ev, c->ev.num) == -1)
+		return -1;
+	while (*s) {
+		np = history_def_triechild(n, *s);
+		if ((m = *np) == NULL) {
+			i = Strlen(s);
+			if ((m = history_def_trienode(h, s, i, i)) == NULL)
+				return -1;
+			*np = m;
+			return history_def_evput(h, &m->ev, c->ev.num);
+		}
+		for (i = 1; i < m->len && s[i] == m->label[i]; i++)
+			continue;
+		if (i < m->len) {
+			if ((n = history_def_trienode(h, m->label, i, i)) == NULL)
+				return -1;
+			n->ev.size = m->ev.n - m->ev.first;
+			n->ev.ev = h_malloc((size_t)n->ev.size * sizeof(int));
+			if (n->ev.ev == NULL) {
+				n->ev.size = 0;
+				history_def_triefree(h, n);
+				return -1;
+			}
+			h->mem += (size_t)n->ev.size * sizeof(int);
+			memcpy(n->ev.ev, m->ev.ev + m->ev.first,
+			    (size_t)n->ev.size * sizeof(int));
+			n->ev.n = n->ev.size;
+			memmove(m->label, m->label + i,
+			    (m->len - i) * sizeof(*m->label));
+			m->len -= i;
+			n->child = m;
+			n->next = m->next;
+			m->next = NULL;
+			*np = m = n;
+		}
+		if (history_def_evput(h, &m->ev, c->ev.num) == -1)
+			return -1;
+		s += i;
+		n = m;
+	}
+	return 0;
+}
+
+
+/* history_def_triemerge():
+ *	Merge node *np into its only child if no event ends there
+ */
+static void
+history_def_triemerge(history_t *h, hnode_t **np)
+{
+	hnode_t *n = *np, *c = n->child, *m;
+
+	if (c == NULL || c->next != NULL ||
+	    c->ev.n - c->ev.first != n->ev.n - n->ev.first)
+		return;
+	m = history_def_trienode(h, n->label, n->len, n->len + c->len);
+	if (m == NULL)
+		return;
+	memcpy(m->label + n->len, c->label, c->len * sizeof(*m->label));
+	m->len += c->len;
+	m->ev = c->ev;
+	m->child = c->child;
+	m->next = n->next;
+	c->ev.ev = NULL;
+	c->ev.size = 0;
+	c->child = NULL;
+	n->child = NULL;
+	*np = m;
+	history_def_triefree(h, c);
+	history_def_triefree(h, n);
+}
+
+
+/* history_def_triedel():
+ *	Remove entry c from the prefix trie, freeing the nodes no event
+ *	reaches any more and merging the ones left with a single child
+ */
+static void
+history_def_triedel(history_t *h, hentry_t *c)
+{
+	const Char *s = c->ev.str;
+	hnode_t **np, *n = h->trie, *m;
+	size_t i;
+
+	if (n == NULL)
+		return;
+	history_def_evdel(h, &n->ev, c->ev.num);
+	while (*s) {
+		if ((m = *(np = history_def_triechild(n, *s))) == NULL)
+			return;
+		history_def_evdel(h, &m->ev, c->ev.num);
+		if (m->ev.first == m->ev.n) {
+			*np = m->next;
+			m->next = NULL;
+			history_def_triefree(h, m);
+			break;
+		}
+		s += m->len;
+		n = m;
+	}
+
+	for (s = c->ev.str, n = h->trie; *s; s += i, n = m) {
+		if (*(np = history_def_triechild(n, *s)) == NULL)
+			return;
+		history_def_triemerge(h, np);
+		m = *np;
+		for (i = 0; i < m->len && s[i] == m->label[i]; i++)
+			continue;
+		if (i < m->len)
+			return;
+	}
+}
+
+
+/* history_def_trieget():
+ *	Return the event list of the strings starting with str
+ */
+static const hevlist_t *
+history_def_trieget(history_t *h, const Char *str)
+{
+	hnode_t *n = h->trie;
+	size_t i;
+
+	while (*str) {
+		if ((n = *history_def_triechild(n, *str)) == NULL)
+			return NULL;
+		for (i = 1; i < n->len && str[i]; i++)
+			if (str[i] != n->label[i])
+				return NULL;
+		str += i;
+	}
+	return &n->ev;
+}
+
+
+/* history_def_indexput():
+ *	Add entry c to the search indexes; if they cannot grow, stop
+ *	keeping them rather than fail the caller
+ */
+static void
+history_def_indexput(history_t *h, hentry_t *c)
+{
+	if (history_def_gramput(h, c) == -1 ||
+	    history_def_trieput(h, c) == -1)
+		(void)history_def_setindex(h, 0);
+}
+
+
+/* history_def_indexdel():
+ *	Remove entry c from the search indexes
+ */
+static void
+history_def_indexdel(history_t *h, hentry_t *c)
+{
+	history_def_gramdel(h, c);
+	history_def_triedel(h, c);
+}
+
+
+/* history_def_setindex():
+ *	Start or stop keeping the search indexes, building them from
+ *	the events present
+ */
+static int
+history_def_setindex(history_t *h, int on)
+{
+	int i;
+
+	if (on && (h->flags & H_INDEX) != 0)
+		return 0;
+	h->flags &= ~H_INDEX;
+	history_def_gramfree(h);
+	if (h->trie != NULL) {
+		history_def_triefree(h, h->trie);
+		h->trie = NULL;
+	}
+	if (!on)
+		return 0;
+	for (i = h->cur - 1; i >= 0; i--)
+		if (history_def_gramput(h, HENT(h, i)) == -1 ||
+		    history_def_trieput(h, HENT(h, i)) == -1) {
+			(void)history_def_setindex(h, 0);
+			return -1;
+		}
+	h->flags |= H_INDEX;
+	return 0;
+}
+
+
+/* history_def_rank():
+ *	Frecency of entry c, in 1/256 events: its event number plus
+ *	halflife events for each doubling of its uses, with log2()
+ *	interpolated linearly between powers of two
+ */
+static int64_t
+history_def_rank(const history_t *h, const hentry_t *c)
+{
+	uint64_t u = c->uses;
+	int b = 0;
+
+	while ((u >> b) > 1)
+		b++;
+	return ((int64_t)c->ev.num << 8) + (int64_t)h->halflife *
+	    (((int64_t)b << 8) + (int64_t)((u << 8) >> b) - 256);
+}
+
+
+/* history_def_heapless():
+ *	Return if entry a is less frecent than entry b
+ */
+static int
+history_def_heapless(const hentry_t *a, const hentry_t *b)
+{
+	if (a->rank != b->rank)
+		return a->rank < b->rank;
+	return a->ev.num < b->ev.num;
+}
+
+
+/* history_def_heapmove():
+ *	Move the entry at heap index i up or down to where it belongs
+ */
+static void
+history_def_heapmove(history_t *h, int i)
+{
+	hentry_t *c = h->heap[i];
+	int j;
+
+	for (; i > 0 && history_def_heapless(c, h->heap[(i - 1) / 2]);
+	    i = j) {
+		j = (i - 1) / 2;
+		h->heap[i] = h->heap[j];
+		h->heap[i]->hpos = i;
+	}
+	for (; (j = 2 * i + 1) < h->heapn; i = j) {
+		if (j + 1 < h->heapn &&
+		    history_def_heapless(h->heap[j + 1], h->heap[j]))
+			j++;
+		if (!history_def_heapless(h->heap[j], c))
+			break;
+		h->heap[i] = h->heap[j];
+		h->heap[i]->hpos = i;
+	}
+	h->heap[i] = c;
+	c->hpos = i;
+}
+
+
+/* history_def_heapput():
+ *	Rank entry c and add it to the frecency heap
+ */
+static int
+history_def_heapput(history_t *h, hentry_t *c)
+{
+	hentry_t **nheap;
+	int nsize;
+
+	if (h->heapn == h->heapsize) {
+		if (h->heapsize > INT_MAX / 2)
+			return -1;
+		nsize = h->heapsize ? h->heapsize * 2 : H_MINSLOTS;
+		nheap = h_realloc(h->heap, (size_t)nsize * sizeof(*nheap));
+		if (nheap == NULL)
+			return -1;
+		h->mem += (size_t)(nsize - h->heapsize) * sizeof(*nheap);
+		h->heap = nheap;
+		h->heapsize = nsize;
+	}
+	c->rank = history_def_rank(h, c);
+	h->heap[h->heapn] = c;
+	history_def_heapmove(h, h->heapn++);
+	return 0;
+}
+
+
+/* history_def_heapdel():
+ *	Remove entry c from the frecency heap
+ */
+static void
+history_def_heapdel(history_t *h, hentry_t *c)
+{
+	int i = c->hpos;
+
+	c->hpos = -1;
+	if (i != --h->heapn) {
+		h->heap[i] = h->heap[h->heapn];
+		history_def_heapmove(h, i);
+	}
+}
+
+
+/* history_def_setfrecency():
+ *	Start keeping the frecency of the events, a doubling of uses
+ *	being worth halflife events, or stop if it is 0.  Equal events
+ *	are merged, so this also erases the older duplicates.
+ */
+static int
+history_def_setfrecency(history_t *h, int halflife)
+{
+	int i;
+
+	h->flags &= ~H_FRECENT;
+	for (i = 0; i < h->heapn; i++)
+		h->heap[i]->hpos = -1;
+	h->heapn = 0;
+	if (halflife == 0) {
+		h->mem -= (size_t)h->heapsize * sizeof(*h->heap);
+		h_free(h->heap);
+		h->heap = NULL;
+		h->heapsize = 0;
+		return 0;
+	}
+	if (history_def_setunique(h, 2) == -1)
+		return -1;
+	h->halflife = halflife;
+	for (i = h->cur - 1; i >= 0; i--)
+		if (history_def_heapput(h, HENT(h, i)) == -1) {
+			(void)history_def_setfrecency(h, 0);
+			return -1;
+		}
+	h->flags |= H_FRECENT;
+	return 0;
+}
+
+
+/* history_def_over():
+ *	Return if the history holds more events than its size, or
+ *	more bytes of strings and entries than its byte budget
+ */
+static int
+history_def_over(const history_t *h)
+{
+	return h->cur > h->max || (h->maxbytes != 0 &&
+	    h->strlive * sizeof(Char) + (size_t)h->cur * sizeof(hentry_t) >
+	    h->maxbytes);
+}
+
+
+/* history_def_evict():
+ *	Drop events until the history is within its size and byte
+ *	budget, the oldest first or, keeping frecency, the least
+ *	frecent ones but the newest first.
+ */
+static void
+history_def_evict(history_t *h, TYPE(HistEvent) *ev)
+{
+	hentry_t *c;
+
+	if ((h->flags & H_FRECENT) != 0 && h->cur > 1 &&
+	    history_def_over(h)) {
+		/* its heap slot stays, so it can always go back */
+		c = HENT(h, 0);
+		history_def_heapdel(h, c);
+		while (h->heapn > 0 && history_def_over(h))
+			history_def_delete(h, ev,
+			    history_def_find(h, h->heap[0]->ev.num));
+		(void)history_def_heapput(h, c);
+	}
+	while (h->cur > 0 && history_def_over(h))
+		history_def_delete(h, ev, h->cur - 1);
+}
+
+
+/* history_def_contains():
+ *	Return if str occurs in s
+ */
+static int
+history_def_contains(const Char *s, const Char *str)
+{
+	return Strstr(s, str) != NULL;
+}
+
+
+/*
+ * Searches that have to look at every event scan the H_SCAN_MIN events
+ * nearest the current one first, where matches usually are.  Only if
+ * none matches are the rest split into slices scanned on their own
+ * threads, once there are more than H_SCAN_MIN of them.  Slices are
+ * numbered from the current event on and the match of the lowest
+ * numbered one wins, so a slice gives up as soon as one before it has
+ * found a match.  Each slice compiles its own regular expression, as
+ * a regex_t may not be used by several threads at once.
+ */
+#define	H_SCAN_MIN	65536	/* Events per slice at least	*/
+#define	H_SCAN_THREADS	16	/* Maximum scanning threads	*/
+
+typedef struct hscan_t {
+	history_t *h;
+	const Char *str;	/* Substring looked for		*/
+	const char *pat;	/* Or regular expression matched */
+#ifdef REGEX
+	regex_t re;		/* pat compiled			*/
+	int compiled;		/* re is valid			*/
+#endif
+	int beg;		/* Position scanned first	*/
+	int n;			/* Number of positions		*/
+	int dir;		/* Towards older (1) or newer (-1) */
+	int slice;		/* Slice number			*/
+#ifdef H_PARALLEL_SCAN
+	_Atomic int *best;	/* Lowest slice with a match	*/
+#endif
+#ifndef NARROWCHAR
+	ct_buffer_t conv;	/* For regexec()		*/
+#endif
+	int found;		/* Position matched, or -1	*/
+} hscan_t;
+
+
+/* history_scan_match():
+ *	Return if s contains the substring or matches the regular
+ *	expression looked for
+ */
+static int
+history_scan_match(hscan_t *sc, const Char *s)
+{
+#ifdef REGEX
+	const char *mb;
+#endif
+
+	if (Strstr(s, sc->str) != NULL)
+		return 1;
+#ifdef REGEX
+	if (sc->compiled && (mb = ct_encode_string(s, &sc->conv)) != NULL)
+		return regexec(&sc->re, mb, (size_t)0, NULL, 0) == 0;
+#endif
+	return 0;
+}
+
+
+/* history_scan_run():
+ *	Scan a slice for its first match
+ */
+static void *
+history_scan_run(void *arg)
+{
+	hscan_t *sc = arg;
+	int i, n;
+#ifdef H_PARALLEL_SCAN
+	int b;
+#endif
+
+	sc->found = -1;
+#ifdef REGEX
+	sc->compiled = sc->pat != NULL && regcomp(&sc->re, sc->pat, 0) == 0;
+#endif
+	for (i = 0, n = sc->beg; i < sc->n; i++, n += sc->dir) {
+#ifdef H_PARALLEL_SCAN
+		if ((i & 255) == 0 && sc->best != NULL &&
+		    atomic_load_explicit(sc->best, memory_order_relaxed) <
+		    sc->slice)
+			break;
+#endif
+		if (history_scan_match(sc, HENT(sc->h, n)->ev.str)) {
+			sc->found = n;
+			break;
+		}
+	}
+#ifdef H_PARALLEL_SCAN
+	if (sc->found != -1 && sc->best != NULL)
+		for (b = atomic_load(sc->best); b > sc->slice &&
+		    !atomic_compare_exchange_weak(sc->best, &b, sc->slice);)
+			continue;
+#endif
+#ifdef REGEX
+	if (sc->compiled)
+		regfree(&sc->re);
+#endif
+#ifndef NARROWCHAR
+	h_free(sc->conv.cbuff);
+	h_free(sc->conv.wbuff);
+#endif
+	return NULL;
+}
+
+
+/* history_scan_slices():
+ *	Scan the len positions from beg on in nthreads slices, and
+ *	return the first one that matches, or -1
+ */
+static int
+history_scan_slices(history_t *h, const Char *str, const char *pat,
+    int dir, int beg, int len, int nthreads)
+{
+	hscan_t sc[H_SCAN_THREADS];
+	int i;
+#ifdef H_PARALLEL_SCAN
+	pthread_t tid[H_SCAN_THREADS];
+	int started[H_SCAN_THREADS];
+	_Atomic int best;
+
+	atomic_init(&best, nthreads);
+#endif
+	for (i = 0; i < nthreads; i++) {
+		memset(&sc[i], 0, sizeof(sc[i]));
+		sc[i].h = h;
+		sc[i].str = str;
+		sc[i].pat = pat;
+		sc[i].dir = dir;
+		sc[i].slice = i;
+		sc[i].beg = (int)((int64_t)len * i / nthreads);
+		sc[i].n = (int)((int64_t)len * (i + 1) / nthreads) - sc[i].beg;
+		sc[i].beg = beg + dir * sc[i].beg;
+#ifdef H_PARALLEL_SCAN
+		sc[i].best = nthreads > 1 ? &best : NULL;
+#endif
+	}
+#ifdef H_PARALLEL_SCAN
+	for (i = 1; i < nthreads; i++) {
+		started[i] = pthread_create(&tid[i], NULL,
+		    history_scan_run, &sc[i]) == 0;
+		if (!started[i])
+			history_scan_run(&sc[i]);
+	}
+	history_scan_run(&sc[0]);
+	for (i = 1; i < nthreads; i++)
+		if (started[i])
+			pthread_join(tid[i], NULL);
+#else
+	history_scan_run(&sc[0]);
+#endif
+	for (i = 0; i < nthreads; i++)
+		if (sc[i].found != -1)
+			return sc[i].found;
+	return -1;
+}
+
+
+/* history_def_scan():
+ *	Return the position of the nearest event from the current one
+ *	on, towards older (dir > 0) or newer (dir < 0) events, that
+ *	contains str or, if pat is not NULL, matches it as a basic
+ *	regular expression.  Returns -1 if there is none.
+ */
+static int
+history_def_scan(history_t *h, const Char *str, const char *pat, int dir)
+{
+	int n, len, nthreads = 1;
+#ifdef H_PARALLEL_SCAN
+	long ncpu;
+#endif
+
+	if (h->cursor == -1)
+		return -1;
+	len = dir > 0 ? h->cur - h->cursor : h->cursor + 1;
+	n = history_scan_slices(h, str, pat, dir, h->cursor,
+	    len < H_SCAN_MIN ? len : H_SCAN_MIN, 1);
+	if (n != -1 || len <= H_SCAN_MIN)
+		return n;
+	len -= H_SCAN_MIN;
+#ifdef H_PARALLEL_SCAN
+	if (len / 2 >= H_SCAN_MIN &&
+	    (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 1) {
+		nthreads = len / H_SCAN_MIN;
+		if (nthreads > ncpu)
+			nthreads = (int)ncpu;
+		if (nthreads > H_SCAN_THREADS)
+			nthreads = H_SCAN_THREADS;
+	}
+#endif
+	return history_scan_slices(h, str, pat, dir,
+	    h->cursor + dir * H_SCAN_MIN, len, nthreads);
+}
+
+
+/* history_def_hit():
+ *	Make the event at position n current after a search, setting
+ *	*off to its distance from the current one, or fail with *off
+ *	set to -1 if n is -1
+ */
+static int
+history_def_hit(history_t *h, TYPE(HistEvent) *ev, int n, int *off)
+{
+	if (n == -1) {
+		if (off)
+			*off = -1;
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	if (off)
+		*off = n > h->cursor ? n - h->cursor : h->cursor - n;
+	h->cursor = n;
+	*ev = HENT(h, n)->ev;
+	return 0;
+}
+
+
+/* history_def_substr():
+ *	Find the nearest event containing str, looking from the current
+ *	one towards older (dir > 0) or newer (dir < 0) events, and make
+ *	it current.  *off is set to its distance from the current event,
+ *	or -1 if there is none, in which case the cursor stays put.
+ */
+static int
+history_def_substr(history_t *h, TYPE(HistEvent) *ev, const Char *str,
+    int dir, int *off)
+{
+	const Char *s;
+	hgram_t *g, *rare = NULL;
+
+	if (h->cursor == -1)
+		return history_def_hit(h, ev, -1, off);
+	if ((h->flags & H_INDEX) == 0 || h->gtsize == 0 ||
+	    !str[0] || !str[1] || !str[2])
+		return history_def_hit(h, ev,
+		    history_def_scan(h, str, NULL, dir), off);
+
+	for (s = str; s[0] && s[1] && s[2]; s++) {
+		g = history_def_gramslot(h, history_def_gramkey(s));
+		if (g->key == 0 || g->ev.first == g->ev.n)
+			return history_def_hit(h, ev, -1, off);
+		if (rare == NULL ||
+		    g->ev.n - g->ev.first < rare->ev.n - rare->ev.first)
+			rare = g;
+	}
+	return history_def_hit(h, ev, history_def_evnear(h, &rare->ev, dir,
+	    history_def_contains, str), off);
+}
+
+
+#ifdef REGEX
+/* history_def_regex():
+ *	Like history_def_substr(), but for events that contain str or
+ *	match it as a basic regular expression, like el_match() does
+ */
+static int
+history_def_regex(history_t *h, TYPE(HistEvent) *ev, const Char *str,
+    int dir, int *off)
+{
+	const char *pat;
+	int n;
+#ifndef NARROWCHAR
+	ct_buffer_t conv = { NULL, 0, NULL, 0 };
+#endif
+
+	if (h->cursor == -1)
+		return history_def_hit(h, ev, -1, off);
+	pat = ct_encode_string(str, &conv);
+	n = history_def_scan(h, str, pat, dir);
+#ifndef NARROWCHAR
+	h_free(conv.cbuff);
+	h_free(conv.wbuff);
+#endif
+	return history_def_hit(h, ev, n, off);
+}
+#endif
+
+
+/* history_def_prefix():
+ *	Find the nearest event beginning with str through the prefix
+ *	trie, looking from the current one towards older (dir > 0) or
+ *	newer (dir < 0) events.  Leaves the cursor where a walk would
+ *	have left it when there is none.
+ */
+static int
+history_def_prefix(history_t *h, TYPE(HistEvent) *ev, const Char *str,
+    int dir)
+{
+	const hevlist_t *l;
+	int n;
+
+	if (h->cursor == -1) {
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	if ((l = history_def_trieget(h, str)) == NULL ||
+	    (n = history_def_evnear(h, l, dir, NULL, NULL)) == -1) {
+		h->cursor = dir > 0 ? h->cur - 1 : 0;
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	h->cursor = n;
+	*ev = HENT(h, n)->ev;
+	return 0;
+}
+
+
+/* history_def_set():
+ *	Default function to set the current event in the history to the
+ *	given one.
+ */
+static int
+history_def_set(void *p, TYPE(HistEvent) *ev, const int n)
+{
+	history_t *h = (history_t *) p;
+
+	if (h->cur == 0) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (h->cursor == -1 || HENT(h, h->cursor)->ev.num != n)
+		h->cursor = history_def_find(h, n);
+	if (h->cursor == -1) {
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* history_set_nth():
+ *	Default function to set the current event in the history to the
+ *	n-th one.
+ */
+static int
+history_set_nth(void *p, TYPE(HistEvent) *ev, int n)
+{
+	history_t *h = (history_t *) p;
+
+	if (h->cur == 0) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (n < 0)
+		n = 0;
+	if (n >= h->cur) {
+		h->cursor = -1;
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	h->cursor = h->cur - 1 - n;
+	return 0;
+}
+
+
+/* history_def_nth():
+ *	Default function to set the current event in the history to the
+ *	n-th one counting from the first, and return it.
+ */
+static int
+history_def_nth(void *p, TYPE(HistEvent) *ev, int n)
+{
+	history_t *h = (history_t *) p;
+
+	if (h->cur == 0) {
+		h->cursor = -1;
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (n < 0) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	if (n >= h->cur) {
+		h->cursor = h->cur - 1;
+		he_seterrev(ev, _HE_END_REACHED);
+		return -1;
+	}
+	h->cursor = n;
+	*ev = HENT(h, n)->ev;
+	return 0;
+}
+
+
+/* history_def_erasedup():
+ *	With H_ERASEDUPS, erase the other event equal to c, whose
+ *	string has just changed, so that the index keeps finding
+ *	every string; c stands for both from now on
+ */
+static void
+history_def_erasedup(history_t *h, hentry_t *c)
+{
+	hentry_t *dup;
+
+	if ((h->flags & H_ERASEDUPS) == 0 || h->htsize == 0)
+		return;
+	if ((dup = *history_def_lookup(h, c->ev.str)) != NULL && dup != c)
+		history_def_delete(h, NULL, history_def_find(h, dup->ev.num));
+}
+
+
+/* history_def_add():
+ *	Append string to element
+ */
+static int
+history_def_add(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	history_t *h = (history_t *) p;
+	size_t len, elen, slen;
+	Char *s;
+	HistEventPrivate *evp;
+	hentry_t *c;
+	hblock_t *blk;
+
+	if (h->cursor == -1)
+		return history_def_enter(p, ev, str);
+	c = HENT(h, h->cursor);
+	evp = (void *)&c->ev;
+	elen = Strlen(evp->str);
+	slen = Strlen(str);
+	len = elen + slen + 1;
+	s = history_def_stralloc(h, &blk, len);
+	if (s == NULL) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	memcpy(s, evp->str, elen * sizeof(*s));
+	memcpy(s + elen, str, slen * sizeof(*s)); 
+        s[len - 1] = '\0';
+	if (h->htsize != 0)
+		history_def_hashdel(h, c);
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexdel(h, c);
+	history_def_strfree(h, c->blk, evp->str);
+	evp->str = s;
+	c->blk = blk;
+	history_def_erasedup(h, c);
+	if (h->htsize != 0)
+		history_def_reindex(h, c);
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexput(h, c);
+	h->mgen = ++h->gen;
+	*ev = HENT(h, h->cursor)->ev;
+	return 0;
+}
+
+
+/* history_def_replace():
+ *	Replace the string and data of the current element
+ */
+static int
+history_def_replace(history_t *h, const Char *line, void *d)
+{
+	hentry_t *c;
+	hblock_t *blk;
+	size_t len;
+	Char *s;
+
+	if (h->cursor == -1)
+		return -1;
+	c = HENT(h, h->cursor);
+	len = Strlen(line) + 1;
+	if ((s = history_def_stralloc(h, &blk, len)) == NULL)
+		return -1;
+	memcpy(s, line, len * sizeof(*s));
+	if (h->htsize != 0)
+		history_def_hashdel(h, c);
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexdel(h, c);
+	history_def_strfree(h, c->blk, c->ev.str);
+	c->ev.str = s;
+	c->blk = blk;
+	c->data = d;
+	history_def_erasedup(h, c);
+	if (h->htsize != 0)
+		history_def_reindex(h, c);
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexput(h, c);
+	h->mgen = ++h->gen;
+	return 0;
+}
+
+
+static int
+history_deldata_nth(history_t *h, TYPE(HistEvent) *ev,
+    int num, void **data)
+{
+	hentry_t *hp;
+
+	if (history_set_nth(h, ev, num) != 0)
+		return -1;
+	/* magic value to skip delete (just set to n-th history) */
+	if (data == (void **)-1)
+		return 0;
+	hp = HENT(h, h->cursor);
+	ev->str = Strdup(hp->ev.str);
+	ev->num = hp->ev.num;
+	if (data)
+		*data = hp->data;
+	history_def_delete(h, ev, h->cursor);
+	return 0;
+}
+
+
+/* history_def_del():
+ *	Delete element hp of the h list
+ */
+static int
+history_def_del(void *p, TYPE(HistEvent) *ev libedit_unused, const int num)
+{
+	history_t *h = (history_t *) p;
+	hentry_t *hp;
+
+	if (history_def_set(h, ev, num) != 0)
+		return -1;
+	hp = HENT(h, h->cursor);
+	ev->str = Strdup(hp->ev.str);
+	ev->num = hp->ev.num;
+	history_def_delete(h, ev, h->cursor);
+	return 0;
+}
+
+
+/* history_def_delete():
+ *	Delete the n-th element of the h list, closing the gap from
+ *	whichever end of the ring is nearer.
+ */
+static void
+history_def_delete(history_t *h, TYPE(HistEvent) *ev libedit_unused,
+	int n)
+{
+	hentry_t *hp;
+	int i;
+
+	if (n < 0 || n >= h->cur)
+		abort();
+	hp = HENT(h, n);
+	if (h->cursor == n) {
+		if (n > 0)
+			h->cursor = n - 1;
+		else if (h->cur == 1)
+			h->cursor = -1;
+	} else if (h->cursor > n)
+		h->cursor--;
+	if (n < h->cur / 2) {
+		for (i = n; i > 0; i--)
+			HENT(h, i) = HENT(h, i - 1);
+		h->head = (h->head + 1) & (h->nslots - 1);
+	} else {
+		for (i = n; i < h->cur - 1; i++)
+			HENT(h, i) = HENT(h, i + 1);
+	}
+	if (h->htsize != 0)
+		history_def_hashdel(h, hp);
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexdel(h, hp);
+	if (hp->hpos != -1)
+		history_def_heapdel(h, hp);
+	history_def_strfree(h, hp->blk, hp->ev.str);
+	hp->data = h->freent;
+	h->freent = hp;
+	h->gen++;
+	if (n != --h->cur)
+		h->mgen = h->gen;
+}
+
+
+/* history_def_grow():
+ *	Double the size of the ring, unwrapping it in the process
+ */
+static int
+history_def_grow(history_t *h)
+{
+	hentry_t **nslot;
+	int i, n;
+
+	if (h->nslots > INT_MAX / 2)
+		return -1;
+	n = h->nslots ? h->nslots * 2 : H_MINSLOTS;
+	nslot = h_malloc((size_t)n * sizeof(*nslot));
+	if (nslot == NULL)
+		return -1;
+	for (i = 0; i < h->cur; i++)
+		nslot[i] = HENT(h, i);
+	h_free(h->slot);
+	h->mem += (size_t)(n - h->nslots) * sizeof(*nslot);
+	h->slot = nslot;
+	h->nslots = n;
+	h->head = 0;
+	return 0;
+}
+
+
+/* history_def_insert():
+ *	Insert element with string str in the h list
+ */
+static int
+history_def_insert(history_t *h, TYPE(HistEvent) *ev, const Char *str)
+{
+	hentry_t *c;
+	Char *s;
+	size_t len;
+
+	if (h->cur == h->nslots && history_def_grow(h) == -1)
+		goto oomem;
+	if ((c = history_def_alloc(h)) == NULL)
+		goto oomem;
+	len = Strlen(str) + 1;
+	if ((s = history_def_stralloc(h, &c->blk, len)) == NULL) {
+		c->data = h->freent;
+		h->freent = c;
+		goto oomem;
+	}
+	memcpy(s, str, len * sizeof(*s));
+	c->ev.str = s;
+	c->data = NULL;
+	c->uses = 1;
+	c->hpos = -1;
+	c->ev.num = ++h->eventid;
+	h->head = (h->head - 1) & (h->nslots - 1);
+	HENT(h, 0) = c;
+	h->cur++;
+	h->cursor = 0;
+	h->gen++;
+
+	*ev = c->ev;
+	return 0;
+oomem:
+	he_seterrev(ev, _HE_MALLOC_FAILED);
+	return -1;
+}
+
+
+/* history_def_enter():
+ *	Default function to enter an item in the history
+ */
+static int
+history_def_enter(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	history_t *h = (history_t *) p;
+
+	hentry_t *dup;
+	unsigned int uses = 0;
+
+	if ((h->flags & H_UNIQUE) != 0 && h->cur > 0 &&
+	    Strcmp(HENT(h, 0)->ev.str, str) == 0)
+	    return 0;
+
+	if ((h->flags & H_ERASEDUPS) != 0 && h->htsize != 0)
+		dup = *history_def_lookup(h, str);
+	else
+		dup = NULL;
+
+	/* the older duplicate only goes once the event is in */
+	if (history_def_insert(h, ev, str) == -1)
+		return -1;	/* error, keep error message */
+	if (dup != NULL) {
+		uses = dup->uses;
+		history_def_delete(h, ev, history_def_find(h, dup->ev.num));
+	}
+	if (uses < UINT_MAX)
+		HENT(h, 0)->uses += uses;
+
+	if ((h->flags & H_ERASEDUPS) != 0)
+		history_def_reindex(h, HENT(h, 0));
+	if ((h->flags & H_INDEX) != 0)
+		history_def_indexput(h, HENT(h, 0));
+	if ((h->flags & H_FRECENT) != 0 &&
+	    history_def_heapput(h, HENT(h, 0)) == -1)
+		(void)history_def_setfrecency(h, 0);
+
+	history_def_evict(h, ev);
+
+	return 1;
+}
+
+
+/* history_def_init():
+ *	Default history initialization function
+ */
+static int
+history_def_init(void **p, TYPE(HistEvent) *ev libedit_unused, int n)
+{
+	history_t *h = (history_t *) h_malloc(sizeof(*h));
+	if (h == NULL)
+		return -1;
+
+	if (n <= 0)
+		n = 0;
+	h->eventid = 0;
+	h->cur = 0;
+	h->max = n;
+	h->slot = NULL;
+	h->nslots = 0;
+	h->head = 0;
+	h->cursor = -1;
+	h->flags = 0;
+	h->slabs = NULL;
+	h->freent = NULL;
+	h->oldblk = h->newblk = NULL;
+	h->strsize = h->strlive = 0;
+	h->mem = 0;
+	h->gen = h->mgen = 0;
+	h->htab = NULL;
+	h->htsize = h->htcount = 0;
+	h->gtab = NULL;
+	h->gtsize = h->gtcount = 0;
+	h->trie = NULL;
+	h->halflife = 0;
+	h->maxbytes = 0;
+	h->heap = NULL;
+	h->heapn = h->heapsize = 0;
+	*p = h;
+	return 0;
+}
+
+
+/* history_def_clear():
+ *	Default history cleanup function
+ */
+static void
+history_def_clear(void *p, TYPE(HistEvent) *ev libedit_unused)
+{
+	history_t *h = (history_t *) p;
+	hslab_t *sl;
+	hblock_t *b;
+
+	history_def_gramfree(h);
+	if (h->trie != NULL) {
+		history_def_triefree(h, h->trie);
+		h->trie = NULL;
+	}
+	while ((sl = h->slabs) != NULL) {
+		h->slabs = sl->next;
+		h_free(sl);
+	}
+	while ((b = h->oldblk) != NULL) {
+		h->oldblk = b->next;
+		h_free(b);
+	}
+	h_free(h->slot);
+	h_free(h->htab);
+	h_free(h->heap);
+	h->slot = NULL;
+	h->nslots = 0;
+	h->head = 0;
+	h->cursor = -1;
+	h->eventid = 0;
+	h->cur = 0;
+	h->freent = NULL;
+	h->htab = NULL;
+	h->htsize = h->htcount = 0;
+	h->heap = NULL;
+	h->heapn = h->heapsize = 0;
+	h->newblk = NULL;
+	h->strsize = h->strlive = 0;
+	h->mem = 0;
+	h->mgen = ++h->gen;
+}
+
+
+/* history_def_ref():
+ *	Return the history_t holding the events, or NULL if they are
+ *	kept by history functions set with H_FUNC
+ */
+static history_t *
+history_def_ref(TYPE(History) *h)
+{
+	if (h->h_next == history_def_next)
+		return h->h_ref;
+#ifdef H_SHARED_RING
+	if (h->h_next == history_ring_next)
+		return ((hshared_t *)h->h_ref)->hist;
+#endif
+	return NULL;
+}
+
+
+
+
+/************************************************************************/
+
+/* history_init():
+ *	Initialization function.
+ */
+TYPE(History) *
+FUN(history,init)()
+{
+	TYPE(HistEvent) ev;
+	TYPE(History) *h = (TYPE(History) *) h_malloc(sizeof(*h));
+	if (h == NULL)
+		return NULL;
+
+	if (history_def_init(&h->h_ref, &ev, 0) == -1) {
+		h_free(h);
+		return NULL;
+	}
+	h->h_ent = -1;
+	h->h_next = history_def_next;
+	h->h_first = history_def_first;
+	h->h_last = history_def_last;
+	h->h_prev = history_def_prev;
+	h->h_curr = history_def_curr;
+	h->h_set = history_def_set;
+	h->h_clear = history_def_clear;
+	h->h_enter = history_def_enter;
+	h->h_add = history_def_add;
+	h->h_del = history_def_del;
+	h->h_jfd = -1;
+	h->h_jname = NULL;
+	h->h_jbuf = NULL;
+	h->h_jbufsz = 0;
+	h->h_writer = NULL;
+	h->h_lthreads = 0;
+
+	return h;
+}
+
+
+/* history_end():
+ *	clean up history;
+ */
+void
+FUN(history,end)(TYPE(History) *h)
+{
+	TYPE(HistEvent) ev;
+
+	(void)history_writer_stop(h);
+	history_ring_close(h);
+	if (h->h_next == history_def_next) {
+		history_def_clear(h->h_ref, &ev);
+		h_free(h->h_ref);
+	} else if (h->h_next == history_pack_next)
+		history_pack_free(h->h_ref);
+#ifdef H_MAPPED_FILE
+	else if (h->h_next == history_map_next)
+		history_map_free(h->h_ref);
+#endif
+	history_journal_close(h);
+	h_free(h->h_jbuf);
+	h_free(h);
+}
+
+
+
+/* history_setsize():
+ *	Set history number of events
  */
 static int
 history_setsize(TYPE(History) *h, TYPE(HistEvent) *ev, int num)
 {
-	if (h->h_next != history_def_next) {
-		he_seterrev(ev, _HE_NOT_ALLOWED);
+	history_t *hd = history_def_ref(h);
+	hpack_t *hp = history_pack_ref(h);
+
+	if (hd == NULL && hp == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (num < 0) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	if (hp != NULL)
+		hp->max = num;
+	else
+		history_def_setsize(hd, num);
+	return 0;
+}
+
+
+/* history_getsize():
+ *      Get number of events currently in history
+ */
+static int
+history_getsize(TYPE(History) *h, TYPE(HistEvent) *ev)
+{
+	history_t *hd;
+	hpack_t *hp;
+
+	if ((hp = history_pack_ref(h)) != NULL) {
+		ev->num = hp->cur;
+		return 0;
+	}
+#ifdef H_MAPPED_FILE
+	if (h->h_next == history_map_next) {
+		(void)history_map_sync(h->h_ref, 0);
+		ev->num = ((hmap_t *)h->h_ref)->live;
+		return 0;
+	}
+#endif
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	ev->num = history_def_getsize(hd);
+	if (ev->num < -1) {
+		he_seterrev(ev, _HE_SIZE_NEGATIVE);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* history_setunique():
+ *	Set if adjacent, or with 2 any older, equal events should not be
+ *	kept in history.
+ */
+static int
+history_setunique(TYPE(History) *h, TYPE(HistEvent) *ev, int uni)
+{
+	history_t *hd;
+	hpack_t *hp;
+
+	/* A packed history only compares with the newest event */
+	if ((hp = history_pack_ref(h)) != NULL && uni < 2) {
+		hp->unique = uni != 0;
+		return 0;
+	}
+#ifdef H_MAPPED_FILE
+	/* So does a mapped one */
+	if (h->h_next == history_map_next && uni < 2) {
+		((hmap_t *)h->h_ref)->unique = uni != 0;
+		return 0;
+	}
+#endif
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (history_def_setunique(hd, uni) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* history_getunique():
+ *	Get if adjacent equal events should not be entered in history.
+ */
+static int
+history_getunique(TYPE(History) *h, TYPE(HistEvent) *ev)
+{
+	history_t *hd;
+	hpack_t *hp;
+
+	if ((hp = history_pack_ref(h)) != NULL) {
+		ev->num = hp->unique;
+		return 0;
+	}
+#ifdef H_MAPPED_FILE
+	if (h->h_next == history_map_next) {
+		ev->num = ((hmap_t *)h->h_ref)->unique;
+		return 0;
+	}
+#endif
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	ev->num = history_def_getunique(hd);
+	return 0;
+}
+
+
+/* history_setindex():
+ *	Set if a trigram index and a prefix trie of the events should be
+ *	kept to speed up substring and prefix searches.
+ */
+static int
+history_setindex(TYPE(History) *h, TYPE(HistEvent) *ev, int on)
+{
+	history_t *hd;
+
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (history_def_setindex(hd, on) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* history_getmem():
+ *	Get the number of bytes allocated for the history
+ */
+static int
+history_getmem(TYPE(History) *h, TYPE(HistEvent) *ev, size_t *mem)
+{
+	history_t *hd = history_def_ref(h);
+	hpack_t *hp = history_pack_ref(h);
+
+	if (hd == NULL && hp == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (mem == NULL) {
+		he_seterrev(ev, _HE_PARAM_MISSING);
+		return -1;
+	}
+	if (hp != NULL)
+		*mem = sizeof(*hp) + hp->mem;
+	else
+		*mem = sizeof(history_t) + hd->mem;
+	return 0;
+}
+
+
+/* history_getbytes():
+ *	Get the number of bytes in the event strings, without their NULs
+ */
+static int
+history_getbytes(TYPE(History) *h, TYPE(HistEvent) *ev, size_t *bytes)
+{
+	history_t *hd;
+
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (bytes == NULL) {
+		he_seterrev(ev, _HE_PARAM_MISSING);
+		return -1;
+	}
+	*bytes = (hd->strlive - (size_t)hd->cur) * sizeof(Char);
+	return 0;
+}
+
+
+/* history_setbytes():
+ *	Set the most bytes the event strings and their entries may
+ *	take, 0 for no limit.
+ */
+static int
+history_setbytes(TYPE(History) *h, TYPE(HistEvent) *ev, size_t bytes)
+{
+	history_t *hd;
+
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	hd->maxbytes = bytes;
+	return 0;
+}
+
+
+/* history_setfrecency():
+ *	Set if events should be evicted by frecency, a doubling of the
+ *	uses of an event being worth halflife newer events, rather
+ *	than by age.
+ */
+static int
+history_setfrecency(TYPE(History) *h, TYPE(HistEvent) *ev, int halflife)
+{
+	history_t *hd;
+
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (halflife < 0) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	if (history_def_setfrecency(hd, halflife) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* history_getgen():
+ *	Get the generation of the history, which changes whenever it
+ *	does, and the generation of its last change other than entering
+ *	new events or dropping the oldest ones.  Event strings that
+ *	were returned before the latter keep their addresses.
+ */
+static int
+history_getgen(TYPE(History) *h, TYPE(HistEvent) *ev, unsigned long *gen,
+    unsigned long *mgen)
+{
+	history_t *hd;
+
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	if (gen == NULL || mgen == NULL) {
+		he_seterrev(ev, _HE_PARAM_MISSING);
+		return -1;
+	}
+	*gen = hd->gen;
+	*mgen = hd->mgen;
+	return 0;
+}
+
+
+/* history_set_fun():
+ *	Set history functions
+ */
+static int
+history_set_fun(TYPE(History) *h, TYPE(History) *nh)
+{
+	TYPE(HistEvent) ev;
+
+	history_ring_close(h);
+	if (h->h_next == history_pack_next) {
+		/* Replaced like the builtin history is */
+		history_pack_free(h->h_ref);
+		h->h_next = NULL;
+	}
+#ifdef H_MAPPED_FILE
+	if (h->h_next == history_map_next) {
+		history_map_free(h->h_ref);
+		h->h_next = NULL;
+	}
+#endif
+	if (nh->h_first == NULL || nh->h_next == NULL || nh->h_last == NULL ||
+	    nh->h_prev == NULL || nh->h_curr == NULL || nh->h_set == NULL ||
+	    nh->h_enter == NULL || nh->h_add == NULL || nh->h_clear == NULL ||
+	    nh->h_del == NULL || nh->h_ref == NULL) {
+		if (h->h_next != history_def_next) {
+			if (history_def_init(&h->h_ref, &ev, 0) == -1)
+				return -1;
+			h->h_first = history_def_first;
+			h->h_next = history_def_next;
+			h->h_last = history_def_last;
+			h->h_prev = history_def_prev;
+			h->h_curr = history_def_curr;
+			h->h_set = history_def_set;
+			h->h_clear = history_def_clear;
+			h->h_enter = history_def_enter;
+			h->h_add = history_def_add;
+			h->h_del = history_def_del;
+		}
+		return -1;
+	}
+	if (h->h_next == history_def_next) {
+		history_def_clear(h->h_ref, &ev);
+		h_free(h->h_ref);
+	}
+
+	h->h_ref = nh->h_ref;
+	h->h_ent = -1;
+	h->h_first = nh->h_first;
+	h->h_next = nh->h_next;
+	h->h_last = nh->h_last;
+	h->h_prev = nh->h_prev;
+	h->h_curr = nh->h_curr;
+	h->h_set = nh->h_set;
+	h->h_clear = nh->h_clear;
+	h->h_enter = nh->h_enter;
+	h->h_add = nh->h_add;
+	h->h_del = nh->h_del;
+
+	return 0;
+}
+
+
+#ifdef HAVE_MMAP
+/*
+ * Memory mapped history loader: the file is split on line boundaries
+ * into chunks that are unvis(3)-decoded in parallel, one round of
+ * chunks at a time to bound the memory used, and the decoded lines are
+ * then entered in order.  There are as many threads as processors
+ * online, or as H_LOADTHREADS asked for, up to H_LOAD_THREADS.
+ */
+#define	H_LOAD_CHUNK	((size_t)1 << 20)	/* Bytes per chunk	*/
+#define	H_LOAD_THREADS	16	/* Maximum decoding threads	*/
+
+typedef struct hchunk_t {
+	const char *beg;	/* First line of the chunk	*/
+	const char *end;	/* End of the last line		*/
+	Char *buf;		/* Decoded lines, NUL separated	*/
+	size_t len;		/* Used length of buf		*/
+	size_t size;		/* Allocated length of buf	*/
+	int nlines;		/* Lines read			*/
+	int error;		/* Out of memory		*/
+} hchunk_t;
+
+
+/* history_unvis():
+ *	strunvis() the len bytes at src, which need not be NUL
+ *	terminated.  Like strunvis() decoding stops at a NUL byte; a
+ *	bad escape sequence keeps what was decoded before it.
+ */
+static void
+history_unvis(char *dst, const char *src, size_t len)
+{
+	const char *end = src + len, *q;
+	char c = '\0', t = '\0';
+	int state = 0;
+	size_t n;
+
+	for (; src < end && (c = *src) != '\0'; src++) {
+		if (state == 0 && c != '\\') {
+			/* Copy the run up to the next escape in bulk */
+			n = (size_t)(end - src);
+			if ((q = memchr(src, '\\', n)) != NULL)
+				n = (size_t)(q - src);
+			if ((q = memchr(src, '\0', n)) != NULL)
+				n = (size_t)(q - src);
+			(void)memcpy(dst, src, n);
+			dst += n;
+			src += n - 1;
+			continue;
+		}
+ again:
+		switch (unvis(&t, c, &state, 0)) {
+		case UNVIS_VALID:
+			*dst++ = t;
+			break;
+		case UNVIS_VALIDPUSH:
+			*dst++ = t;
+			goto again;
+		case 0:
+		case UNVIS_NOCHAR:
+			break;
+		default:
+			*dst = '\0';
+			return;
+		}
+	}
+	if (unvis(&t, c, &state, UNVIS_END) == UNVIS_VALID)
+		*dst++ = t;
+	*dst = '\0';
+}
+
+
+/* history_load_chunk():
+ *	Decode the lines of a chunk into its buffer
+ */
+static void *
+history_load_chunk(void *arg)
+{
+	hchunk_t *c = arg;
+	const char *p, *q;
+	char *ptr = NULL;
+	size_t sz, max_size = 0;
+	Char *decode_result;
+#ifndef NARROWCHAR
+	ct_buffer_t conv = { NULL, 0, NULL, 0 };
+#endif
+
+	for (p = c->beg; p < c->end; p = q + 1) {
+		if ((q = memchr(p, '\n', (size_t)(c->end - p))) == NULL)
+			q = c->end;
+		sz = (size_t)(q - p);
+		c->nlines++;
+		if (max_size <= sz) {
+			char *nptr;
+			max_size = (sz + 1024) & (size_t)~1023;
+			nptr = h_realloc(ptr, max_size * sizeof(*ptr));
+			if (nptr == NULL)
+				goto oomem;
+			ptr = nptr;
+		}
+		history_unvis(ptr, p, sz);
+		decode_result = ct_decode_string(ptr, &conv);
+		if (decode_result == NULL)
+			continue;
+		sz = Strlen(decode_result) + 1;
+		if (c->len + sz > c->size) {
+			Char *nbuf;
+			size_t nsize = c->size + (c->size >> 1) + sz + 1024;
+			nbuf = h_realloc(c->buf, nsize * sizeof(*nbuf));
+			if (nbuf == NULL)
+				goto oomem;
+			c->buf = nbuf;
+			c->size = nsize;
+		}
+		memcpy(c->buf + c->len, decode_result, sz * sizeof(*c->buf));
+		c->len += sz;
+	}
+	goto done;
+oomem:
+	c->error = 1;
+done:
+	h_free(ptr);
+#ifndef NARROWCHAR
+	h_free(conv.cbuff);
+	h_free(conv.wbuff);
+#endif
+	return NULL;
+}
+
+
+/* history_load_run():
+ *	Decode n chunks, each on its own thread when possible
+ */
+static void
+history_load_run(hchunk_t *chunk, int n)
+{
+#ifdef HAVE_PTHREAD
+	pthread_t tid[H_LOAD_THREADS];
+	int started[H_LOAD_THREADS];
+	int i;
+
+	for (i = 1; i < n; i++) {
+		started[i] = pthread_create(&tid[i], NULL,
+		    history_load_chunk, &chunk[i]) == 0;
+		if (!started[i])
+			history_load_chunk(&chunk[i]);
+	}
+	history_load_chunk(&chunk[0]);
+	for (i = 1; i < n; i++)
+		if (started[i])
+			pthread_join(tid[i], NULL);
+#else
+	int i;
+
+	for (i = 0; i < n; i++)
+		history_load_chunk(&chunk[i]);
+#endif
+}
+
+
+/* history_load_map():
+ *	Load the history file open on fp by mapping it.  Returns -1
+ *	if the file cannot be mapped, otherwise 0 with the result of
+ *	the load in *nread.
+ */
+static int
+history_load_map(TYPE(History) *h, FILE *fp, int *nread)
+{
+	struct stat st;
+	TYPE(HistEvent) ev;
+	hchunk_t chunk[H_LOAD_THREADS];
+	const char *map, *p, *end;
+	size_t len, sz;
+	Char *s;
+	int i, n, nthreads = 1;
+
+	if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0 || (off_t)(size_t)st.st_size != st.st_size)
+		return -1;
+	len = (size_t)st.st_size;
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (map == MAP_FAILED)
+		return -1;
+	(void)posix_madvise((void *)(intptr_t)map, len,
+	    POSIX_MADV_SEQUENTIAL);
+	end = map + len;
+
+	*nread = -1;
+	if ((p = memchr(map, '\n', len)) == NULL)
+		p = end;
+	else
+		p++;
+	sz = (size_t)(p - map);
+	if (strncmp(map, hist_cookie,
+	    sz < sizeof(hist_cookie) ? sz : sizeof(hist_cookie)) != 0)
+		goto done;
+
+#ifdef HAVE_PTHREAD
+	{
+		long ncpu = h->h_lthreads > 0 ? h->h_lthreads :
+		    sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu > H_LOAD_THREADS)
+			nthreads = H_LOAD_THREADS;
+		else if (ncpu > 1)
+			nthreads = (int)ncpu;
+	}
+#endif
+
+	*nread = 0;
+	while (p < end) {
+		for (n = 0; n < nthreads && p < end; n++) {
+			memset(&chunk[n], 0, sizeof(chunk[n]));
+			chunk[n].beg = p;
+			if ((size_t)(end - p) <= H_LOAD_CHUNK ||
+			    (p = memchr(p + H_LOAD_CHUNK, '\n',
+			    (size_t)(end - p) - H_LOAD_CHUNK)) == NULL)
+				p = end;
+			else
+				p++;
+			chunk[n].end = p;
+		}
+		history_load_run(chunk, n);
+		for (i = 0; i < n; i++) {
+			if (chunk[i].error)
+				*nread = -1;
+			for (s = chunk[i].buf; *nread != -1 &&
+			    s < chunk[i].buf + chunk[i].len; s += Strlen(s) + 1)
+				if (HENTER(h, &ev, s) == -1)
+					*nread = -1;
+			if (*nread != -1)
+				*nread += chunk[i].nlines;
+			h_free(chunk[i].buf);
+		}
+		if (*nread == -1)
+			break;
+	}
+done:
+	munmap((void *)(intptr_t)map, len);
+	return 0;
+}
+#endif
+
+
+/* history_load():
+ *	TYPE(History) load function
+ */
+static int
+history_load(TYPE(History) *h, const char *fname)
+{
+	FILE *fp;
+	char *line;
+	size_t llen;
+	ssize_t sz;
+	size_t max_size;
+	char *ptr;
+	int i = -1;
+	TYPE(HistEvent) ev;
+	Char *decode_result;
+#ifndef NARROWCHAR
+	static ct_buffer_t conv;
+#endif
+
+	if ((fp = fopen(fname, "r")) == NULL)
+		return i;
+
+#ifdef HAVE_MMAP
+	if (history_load_map(h, fp, &i) == 0) {
+		fclose(fp);
+		return i;
+	}
+#endif
+
+	line = NULL;
+	llen = 0;
+	if ((sz = getline(&line, &llen, fp)) == -1)
+		goto done;
+
+	if (strncmp(line, hist_cookie, (size_t)sz) != 0)
+		goto done;
+
+	ptr = h_malloc((max_size = 1024) * sizeof(*ptr));
+	if (ptr == NULL)
+		goto done;
+	for (i = 0; (sz = getline(&line, &llen, fp)) != -1; i++) {
+		if (sz > 0 && line[sz - 1] == '\n')
+			line[--sz] = '\0';
+		if (max_size < (size_t)sz) {
+			char *nptr;
+			max_size = ((size_t)sz + 1024) & (size_t)~1023;
+			nptr = h_realloc(ptr, max_size * sizeof(*ptr));
+			if (nptr == NULL) {
+				i = -1;
+				goto oomem;
+			}
+			ptr = nptr;
+		}
+		strunvis(ptr, line);
+		decode_result = ct_decode_string(ptr, &conv);
+		if (decode_result == NULL)
+			continue;
+		if (HENTER(h, &ev, decode_result) == -1) {
+			i = -1;
+			goto oomem;
+		}
+	}
+oomem:
+	h_free(ptr);
+done:
+	free(line);
+	fclose(fp);
+	return i;
+}
+
+
+/* history_vis():
+ *	Append str as one visually encoded record to the *lenp bytes
+ *	held in the buffer *bufp of size *sizep, growing the buffer
+ */
+static int
+history_vis(char **bufp, size_t *sizep, size_t *lenp, const char *str)
+{
+	size_t len = *lenp + strlen(str) * 4 + 2;
+
+	if (len > *sizep) {
+		char *nbuf;
+		size_t nsize = (len + 1024) & (size_t)~1023;
+		if (nsize < *sizep * 2)
+			nsize = *sizep * 2;
+		if ((nbuf = h_realloc(*bufp, nsize)) == NULL)
+			return -1;
+		*bufp = nbuf;
+		*sizep = nsize;
+	}
+	*lenp += (size_t)strvis(*bufp + *lenp, str, VIS_WHITE);
+	(*bufp)[(*lenp)++] = '\n';
+	return 0;
+}
+
+
+/* history_save_fp():
+ *	TYPE(History) save function
+ */
+static int
+history_save_fp(TYPE(History) *h, size_t nelem, FILE *fp)
+{
+	TYPE(HistEvent) ev;
+	int i = -1, retval;
+	size_t len, max_size = 0;
+	char *ptr = NULL;
+	const char *str;
+#ifndef NARROWCHAR
+	static ct_buffer_t conv;
+#endif
+
+	if (fchmod(fileno(fp), S_IREAD|S_IWRITE) == -1)
+		goto done;
+	if (ftell(fp) == 0 && fputs(hist_cookie, fp) == EOF)
+		goto done;
+	if (nelem != (size_t)-1) {
+		for (retval = HFIRST(h, &ev); retval != -1 && nelem-- > 0;
+		    retval = HNEXT(h, &ev))
+			continue;
+	} else
+		retval = -1;
+
+	if (retval == -1)
+		retval = HLAST(h, &ev);
+
+	for (i = 0; retval != -1; retval = HPREV(h, &ev), i++) {
+		str = ct_encode_string(ev.str, &conv);
+		len = 0;
+		if (history_vis(&ptr, &max_size, &len, str) == -1) {
+			i = -1;
+			break;
+		}
+		(void)fwrite(ptr, 1, len, fp);
+	}
+	h_free(ptr);
+done:
+	return i;
+}
+
+
+/* history_save():
+ *    History save function
+ */
+static int
+history_save(TYPE(History) *h, const char *fname)
+{
+    FILE *fp;
+    int i;
+
+    if (h->h_writer != NULL)
+	return history_writer_file(h, HW_SAVE, fname);
+    if ((fp = fopen(fname, "w")) == NULL)
+	return -1;
+
+    i = history_save_fp(h, (size_t)-1, fp);
+
+    fclose(fp);
+    return i;
+}
+
+
+/* history_writev():
+ *	Write all of the n buffers in iov to fd
+ */
+static int
+history_writev(int fd, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = writev(fd, iov, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+			r -= (ssize_t)iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= (size_t)r;
+		}
+	}
+	return 0;
+}
+
+
+/* history_journal_open():
+ *	Open the journal fname for appending, creating it with the
+ *	cookie if needed
+ */
+static int
+history_journal_open(const char *fname)
+{
+	struct stat st;
+	size_t len = sizeof(hist_cookie) - 1;
+	int fd;
+
+	if ((fd = open(fname, O_WRONLY | O_APPEND | O_CREAT,
+	    S_IRUSR | S_IWUSR)) == -1)
+		return -1;
+#ifdef HAVE_FLOCK
+	if (flock(fd, LOCK_EX) == -1)
+		goto fail;
+#endif
+	if (fstat(fd, &st) == -1 ||
+	    (st.st_size == 0 && write(fd, hist_cookie, len) != (ssize_t)len))
+		goto fail;
+#ifdef HAVE_FLOCK
+	(void)flock(fd, LOCK_UN);
+#endif
+	return fd;
+fail:
+	(void)close(fd);
+	return -1;
+}
+
+
+/* history_journal_write():
+ *	Append the n buffers of records in iov to the journal fname
+ *	open as *fdp.  Under a shared lock, the journal is reopened
+ *	first if fname names another file now, as it does once some
+ *	session has compacted it, so that no record goes to a file
+ *	already unlinked.  Stores the size of the journal in *sizep.
+ */
+static int
+history_journal_write(int *fdp, const char *fname, struct iovec *iov, int n,
+    off_t *sizep)
+{
+	struct stat sf, sp;
+	off_t len = 0;
+	int i, fd, retval = -1;
+
+	for (;;) {
+#ifdef HAVE_FLOCK
+		if (flock(*fdp, LOCK_SH) == -1)
+			return -1;
+#endif
+		if (fstat(*fdp, &sf) == -1)
+			goto out;
+		if (stat(fname, &sp) == 0 && sp.st_dev == sf.st_dev &&
+		    sp.st_ino == sf.st_ino)
+			break;
+		if ((fd = history_journal_open(fname)) == -1)
+			goto out;
+		(void)close(*fdp);
+		*fdp = fd;
+	}
+	for (i = 0; i < n; i++)
+		len += (off_t)iov[i].iov_len;
+	if ((retval = history_writev(*fdp, iov, n)) == 0 && sizep != NULL)
+		*sizep = sf.st_size + len;
+out:
+#ifdef HAVE_FLOCK
+	(void)flock(*fdp, LOCK_UN);
+#endif
+	return retval;
+}
+
+
+#ifdef HAVE_FLOCK
+/* history_journal_rewrite():
+ *	Compact the journal fname open as *fdp to its newest keep
+ *	records.  The journal is read back and replaced under an
+ *	exclusive lock, so the records other sessions have appended
+ *	are kept and those they append meanwhile wait for the new
+ *	file.  Stores the size of the new journal in *sizep.
+ */
+static int
+history_journal_rewrite(int *fdp, const char *fname, size_t keep,
+    off_t *sizep)
+{
+	struct stat sf, sp;
+	char *buf, *tmp;
+	size_t len, off, n, clen = sizeof(hist_cookie) - 1;
+	ssize_t r;
+	int fd, tfd, jfd, retval = -1;
+
+	/* Lock the file fname names, which a rename may change */
+	for (;;) {
+		if ((fd = open(fname, O_RDONLY)) == -1)
+			return -1;
+		if (flock(fd, LOCK_EX) == -1 || fstat(fd, &sf) == -1 ||
+		    stat(fname, &sp) == -1)
+			goto out1;
+		if (sp.st_dev == sf.st_dev && sp.st_ino == sf.st_ino)
+			break;
+		(void)close(fd);
+	}
+
+	len = (size_t)sf.st_size;
+	if ((buf = h_malloc(len + 1)) == NULL)
+		goto out1;
+	for (off = 0; off < len; off += (size_t)r)
+		if ((r = read(fd, buf + off, len - off)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			goto out2;
+		}
+	if (len < clen || memcmp(buf, hist_cookie, clen) != 0)
+		goto out2;
+
+	/* Find the oldest of the newest keep records */
+	for (off = len, n = 0; keep > 0 && off > clen; off--)
+		if (buf[off - 1] == '\n' && off < len && ++n == keep)
+			break;
+	if (off == clen) {
+		if (sizep != NULL)
+			*sizep = sf.st_size;
+		retval = 0;
+		goto out2;
+	}
+
+	len -= off;
+	off -= clen;
+	(void)memcpy(buf + off, hist_cookie, clen);
+	len += clen;
+	n = strlen(fname) + sizeof(".XXXXXX");
+	if ((tmp = h_malloc(n)) == NULL)
+		goto out2;
+	(void)snprintf(tmp, n, "%s.XXXXXX", fname);
+	if ((tfd = mkstemp(tmp)) == -1)
+		goto out3;
+	if (write(tfd, buf + off, len) != (ssize_t)len || fsync(tfd) == -1) {
+		(void)close(tfd);
+		goto out4;
+	}
+	if (close(tfd) == -1 || rename(tmp, fname) == -1)
+		goto out4;
+	if ((jfd = open(fname, O_WRONLY | O_APPEND)) == -1)
+		goto out3;
+	(void)close(*fdp);
+	*fdp = jfd;
+	if (sizep != NULL)
+		*sizep = (off_t)len;
+	retval = 0;
+	goto out3;
+out4:
+	(void)unlink(tmp);
+out3:
+	h_free(tmp);
+out2:
+	h_free(buf);
+out1:
+	(void)close(fd);
+	return retval;
+}
+#endif
+
+
+/*
+ * Background writer: with H_ASYNC the history file updates are
+ * encoded here and handed as jobs to a thread that does the I/O.
+ * The queue is a linked list with a single producer, the thread
+ * using the history, and a single consumer, the writer, which
+ * always keeps the last job it ran as the head of the list.
+ */
+#ifdef H_ASYNC_WRITER
+#define	H_WRITER_IOV	64	/* Records appended per writev(2)	*/
+
+typedef struct hwjob_t {
+	struct hwjob_t *_Atomic next;	/* Next job in the queue	*/
+	int op;			/* HW_* operation		*/
+	int fd;			/* File descriptor for HW_ADOPT	*/
+	char *fname;		/* File name			*/
+	char *buf;		/* Encoded records		*/
+	size_t len;		/* Length of buf, or records kept */
+	char data[];		/* Storage of HW_APPEND records	*/
+} hwjob_t;
+
+typedef struct hwriter_t {
+	pthread_t thread;	/* The writer			*/
+	pthread_mutex_t lock;	/* Protects the sleep on wake	*/
+	pthread_cond_t wake;	/* Signaled when jobs arrive	*/
+	atomic_int sleeping;	/* The writer waits for wake	*/
+	atomic_int err;		/* A job has failed		*/
+	hwjob_t *tail;		/* Last job queued; producer's	*/
+	hwjob_t *head;		/* Last job run; writer's	*/
+	hwjob_t *stop;		/* Preallocated HW_STOP job	*/
+	int fd;			/* Journal file descriptor	*/
+	char *fname;		/* Journal file name		*/
+	int dirty;		/* Journal written since fsync	*/
+} hwriter_t;
+
+
+/* history_writer_new():
+ *	Allocate a job with room for len bytes of records
+ */
+static hwjob_t *
+history_writer_new(int op, size_t len)
+{
+	hwjob_t *j;
+
+	if ((j = h_malloc(sizeof(*j) + len)) == NULL)
+		return NULL;
+	atomic_init(&j->next, NULL);
+	j->op = op;
+	j->fd = -1;
+	j->fname = NULL;
+	j->buf = j->data;
+	j->len = len;
+	return j;
+}
+
+
+/* history_writer_release():
+ *	Free the storage of a job that has been run
+ */
+static void
+history_writer_release(hwjob_t *j)
+{
+	if (j->buf != j->data)
+		h_free(j->buf);
+	h_free(j->fname);
+	j->buf = j->data;
+	j->fname = NULL;
+}
+
+
+/* history_writer_enqueue():
+ *	Queue a job, and wake the writer if it sleeps.  The writer
+ *	announces its sleep before it looks at the queue one last
+ *	time, so either it sees the job or we see it sleeping.
+ */
+static void
+history_writer_enqueue(hwriter_t *w, hwjob_t *j)
+{
+	atomic_store(&w->tail->next, j);
+	w->tail = j;
+	if (atomic_load(&w->sleeping)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+
+/* history_writer_wait():
+ *	Return the job after the head, waiting for one to be queued.
+ *	The journal is synced once the queue runs dry, so a burst of
+ *	appends costs a single fsync(2).
+ */
+static hwjob_t *
+history_writer_wait(hwriter_t *w)
+{
+	hwjob_t *j;
+
+	if ((j = atomic_load(&w->head->next)) != NULL)
+		return j;
+	if (w->dirty) {
+		if (fsync(w->fd) == -1)
+			atomic_store(&w->err, 1);
+		w->dirty = 0;
+		if ((j = atomic_load(&w->head->next)) != NULL)
+			return j;
+	}
+	pthread_mutex_lock(&w->lock);
+	atomic_store(&w->sleeping, 1);
+	while ((j = atomic_load(&w->head->next)) == NULL)
+		pthread_cond_wait(&w->wake, &w->lock);
+	atomic_store(&w->sleeping, 0);
+	pthread_mutex_unlock(&w->lock);
+	return j;
+}
+
+
+/* history_writer_put():
+ *	Write a history file with the records of j to fd
+ */
+static int
+history_writer_put(int fd, hwjob_t *j)
+{
+	struct iovec iov[2];
+	char cookie[sizeof(hist_cookie)];
+
+	(void)memcpy(cookie, hist_cookie, sizeof(cookie));
+	iov[0].iov_base = cookie;
+	iov[0].iov_len = sizeof(cookie) - 1;
+	iov[1].iov_base = j->buf;
+	iov[1].iov_len = j->len;
+	return history_writev(fd, iov, 2);
+}
+
+
+/* history_writer_compact():
+ *	Compact the journal to the newest j->len records, like
+ *	history_compact()
+ */
+static int
+history_writer_compact(hwriter_t *w, hwjob_t *j)
+{
+#ifdef HAVE_FLOCK
+	if (w->fd == -1 ||
+	    history_journal_rewrite(&w->fd, w->fname, j->len, NULL) == -1)
+		return -1;
+	w->dirty = 0;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+/* history_writer_run():
+ *	The writer thread: run the jobs in order until HW_STOP,
+ *	gathering runs of journal records into one writev(2)
+ */
+static void *
+history_writer_run(void *arg)
+{
+	hwriter_t *w = arg;
+	struct iovec iov[H_WRITER_IOV];
+	hwjob_t *j, *next;
+	int n, fd, retval;
+
+	for (;;) {
+		j = history_writer_wait(w);
+		retval = 0;
+		switch (j->op) {
+		case HW_APPEND:
+			for (n = 0;; j = next) {
+				iov[n].iov_base = j->buf;
+				iov[n++].iov_len = j->len;
+				if (n == H_WRITER_IOV ||
+				    (next = atomic_load(&j->next)) == NULL ||
+				    next->op != HW_APPEND)
+					break;
+			}
+			if (w->fd != -1) {
+				retval = history_journal_write(&w->fd,
+				    w->fname, iov, n, NULL);
+				w->dirty = 1;
+			}
+			break;
+		case HW_ADOPT:
+			if (w->fd != -1)
+				(void)close(w->fd);
+			h_free(w->fname);
+			w->fd = j->fd;
+			w->fname = j->fname;
+			j->fname = NULL;
+			w->dirty = 0;
+			break;
+		case HW_CLOSE:
+			if (w->fd != -1 && w->dirty)
+				retval = fsync(w->fd);
+			if (w->fd != -1)
+				(void)close(w->fd);
+			h_free(w->fname);
+			w->fd = -1;
+			w->fname = NULL;
+			w->dirty = 0;
+			break;
+		case HW_COMPACT:
+			retval = history_writer_compact(w, j);
+			break;
+		case HW_SAVE:
+			if ((fd = open(j->fname, O_WRONLY | O_CREAT | O_TRUNC,
+			    S_IRUSR | S_IWUSR)) == -1) {
+				retval = -1;
+				break;
+			}
+			if (fchmod(fd, S_IREAD|S_IWRITE) == -1 ||
+			    history_writer_put(fd, j) == -1)
+				retval = -1;
+			if (close(fd) == -1)
+				retval = -1;
+			break;
+		default:
+			break;
+		}
+		if (retval == -1)
+			atomic_store(&w->err, 1);
+
+		/* Retire the jobs run; the last becomes the head */
+		while (w->head != j) {
+			next = atomic_load(&w->head->next);
+			history_writer_release(w->head);
+			h_free(w->head);
+			w->head = next;
+		}
+		history_writer_release(j);
+		if (j->op == HW_STOP)
+			break;
+	}
+	if (w->fd != -1 && w->dirty && fsync(w->fd) == -1)
+		atomic_store(&w->err, 1);
+	return NULL;
+}
+
+
+/* history_writer_failed():
+ *	Report, once, that a job has failed since the last call
+ */
+static int
+history_writer_failed(TYPE(History) *h)
+{
+	return atomic_exchange(&h->h_writer->err, 0);
+}
+
+
+/* history_writer_push():
+ *	Queue a job for the writer, which owns buf from now on
+ */
+static int
+history_writer_push(TYPE(History) *h, int op, const char *fname, char *buf,
+    size_t len, int fd)
+{
+	hwjob_t *j;
+
+	if ((j = history_writer_new(op, 0)) == NULL)
+		goto fail;
+	if (fname != NULL && (j->fname = strdup(fname)) == NULL) {
+		h_free(j);
+		goto fail;
+	}
+	j->buf = buf;
+	j->len = len;
+	j->fd = fd;
+	history_writer_enqueue(h->h_writer, j);
+	return 0;
+fail:
+	h_free(buf);
+	return -1;
+}
+
+
+/* history_writer_append():
+ *	Queue len bytes of journal records
+ */
+static int
+history_writer_append(TYPE(History) *h, const char *buf, size_t len)
+{
+	hwjob_t *j;
+
+	if ((j = history_writer_new(HW_APPEND, len)) == NULL)
+		return -1;
+	(void)memcpy(j->data, buf, len);
+	history_writer_enqueue(h->h_writer, j);
+	return history_writer_failed(h) ? -1 : 0;
+}
+
+
+/* history_writer_file():
+ *	Encode all the events and queue them to be written to the
+ *	history file fname by op, HW_SAVE.  Returns the number of
+ *	events queued.
+ */
+static int
+history_writer_file(TYPE(History) *h, int op, const char *fname)
+{
+	TYPE(HistEvent) ev;
+	char *buf = NULL;
+	const char *str;
+	size_t len = 0, size = 0;
+	int i, retval;
+#ifndef NARROWCHAR
+	static ct_buffer_t conv;
+#endif
+
+	for (i = 0, retval = HLAST(h, &ev); retval != -1;
+	    retval = HPREV(h, &ev), i++)
+		if ((str = ct_encode_string(ev.str, &conv)) == NULL ||
+		    history_vis(&buf, &size, &len, str) == -1) {
+			h_free(buf);
+			return -1;
+		}
+	if (history_writer_push(h, op, fname, buf, len, -1) == -1)
+		return -1;
+	return history_writer_failed(h) ? -1 : i;
+}
+
+
+/* history_writer_start():
+ *	Start the background writer
+ */
+static int
+history_writer_start(TYPE(History) *h)
+{
+	hwriter_t *w;
+	sigset_t all, old;
+	int err;
+
+	if ((w = h_malloc(sizeof(*w))) == NULL)
+		return -1;
+	if ((w->head = history_writer_new(HW_STOP, 0)) == NULL)
+		goto out1;
+	if ((w->stop = history_writer_new(HW_STOP, 0)) == NULL)
+		goto out2;
+	w->tail = w->head;
+	atomic_init(&w->sleeping, 0);
+	atomic_init(&w->err, 0);
+	w->fd = h->h_jfd;
+	w->fname = NULL;
+	w->dirty = 0;
+	if (h->h_jname != NULL && (w->fname = strdup(h->h_jname)) == NULL)
+		goto out3;
+	if (pthread_mutex_init(&w->lock, NULL) != 0)
+		goto out3;
+	if (pthread_cond_init(&w->wake, NULL) != 0)
+		goto out4;
+	/* Leave the signals of the application to its own threads */
+	(void)sigfillset(&all);
+	(void)pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&w->thread, NULL, history_writer_run, w);
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0)
+		goto out5;
+	h->h_writer = w;
+	return 0;
+out5:
+	pthread_cond_destroy(&w->wake);
+out4:
+	pthread_mutex_destroy(&w->lock);
+out3:
+	h_free(w->fname);
+	h_free(w->stop);
+out2:
+	h_free(w->head);
+out1:
+	h_free(w);
+	return -1;
+}
+
+
+/* history_writer_stop():
+ *	Stop the background writer once it has run all the jobs
+ *	queued, and take the journal back
+ */
+static int
+history_writer_stop(TYPE(History) *h)
+{
+	hwriter_t *w = h->h_writer;
+	int err;
+
+	if (w == NULL)
+		return 0;
+	history_writer_enqueue(w, w->stop);
+	(void)pthread_join(w->thread, NULL);
+	err = atomic_load(&w->err);
+	h->h_jfd = w->fd;
+	if (h->h_jfd == -1 && h->h_jname != NULL) {
+		h_free(h->h_jname);
+		h->h_jname = NULL;
+	}
+	h->h_writer = NULL;
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	h_free(w->fname);
+	h_free(w->stop);
+	h_free(w);
+	return err ? -1 : 0;
+}
+#else
+static int
+history_writer_push(TYPE(History) *h libedit_unused, int op libedit_unused,
+    const char *fname libedit_unused, char *buf, size_t len libedit_unused,
+    int fd libedit_unused)
+{
+	h_free(buf);
+	return -1;
+}
+
+
+static int
+history_writer_append(TYPE(History) *h libedit_unused,
+    const char *buf libedit_unused, size_t len libedit_unused)
+{
+	return -1;
+}
+
+
+static int
+history_writer_file(TYPE(History) *h libedit_unused, int op libedit_unused,
+    const char *fname libedit_unused)
+{
+	return -1;
+}
+
+
+static int
+history_writer_start(TYPE(History) *h libedit_unused)
+{
+	return -1;
+}
+
+
+static int
+history_writer_stop(TYPE(History) *h libedit_unused)
+{
+	return 0;
+}
+#endif
+
+
+/* history_journal_close():
+ *	Stop journaling events
+ */
+static void
+history_journal_close(TYPE(History) *h)
+{
+	if (h->h_jfd == -1)
+		return;
+	if (h->h_writer != NULL)
+		(void)history_writer_push(h, HW_CLOSE, NULL, NULL, 0, -1);
+	else
+		(void)close(h->h_jfd);
+	h_free(h->h_jname);
+	h->h_jfd = -1;
+	h->h_jname = NULL;
+}
+
+
+/* history_journal():
+ *	Append entered events to the history file fname from now on,
+ *	stop journaling if fname is NULL.  Other sessions may journal
+ *	to fname too.
+ */
+static int
+history_journal(TYPE(History) *h, const char *fname)
+{
+	struct stat st;
+	int fd;
+
+	history_journal_close(h);
+	if (fname == NULL)
+		return 0;
+
+	if ((fd = history_journal_open(fname)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1)
+		goto fail;
+	if ((h->h_jname = strdup(fname)) == NULL)
+		goto fail;
+	if (h->h_writer != NULL &&
+	    history_writer_push(h, HW_ADOPT, fname, NULL, 0, fd) == -1) {
+		h_free(h->h_jname);
+		h->h_jname = NULL;
+		goto fail;
+	}
+	h->h_jfd = fd;
+	h->h_jsize = h->h_jbase = st.st_size;
+	return 0;
+fail:
+	(void)close(fd);
+	return -1;
+}
+
+
+/* history_compact():
+ *	Compact the journal to its newest records, as many as the
+ *	history holds at most.  The records come from the journal
+ *	itself, read back under a lock, so the events the other
+ *	sessions journaled are not lost.
+ */
+static int
+history_compact(TYPE(History) *h)
+{
+#ifdef HAVE_FLOCK
+	TYPE(HistEvent) ev;
+	history_t *hd;
+	hpack_t *hp;
+	size_t keep;
+	int retval;
+
+	if (h->h_jfd == -1)
+		return -1;
+	for (keep = 0, retval = HLAST(h, &ev); retval != -1;
+	    retval = HPREV(h, &ev))
+		keep++;
+	if ((hd = history_def_ref(h)) != NULL && hd->max > 0 &&
+	    (size_t)hd->max > keep)
+		keep = (size_t)hd->max;
+	else if ((hp = history_pack_ref(h)) != NULL && hp->max > 0 &&
+	    (size_t)hp->max > keep)
+		keep = (size_t)hp->max;
+	if (h->h_writer != NULL) {
+		if (history_writer_push(h, HW_COMPACT, NULL, NULL, keep,
+		    -1) == -1)
+			return -1;
+		h->h_jbase = h->h_jsize;
+		return history_writer_failed(h) ? -1 : 0;
+	}
+	if (history_journal_rewrite(&h->h_jfd, h->h_jname, keep,
+	    &h->h_jsize) == -1)
+		return -1;
+	h->h_jbase = h->h_jsize;
+	return 0;
+#else
+	/* Without locks the other sessions could lose their records */
+	return -1;
+#endif
+}
+
+
+/* history_journal_add():
+ *	Add an entered event as one record to the *lenp bytes of
+ *	records in the journal buffer
+ */
+static int
+history_journal_add(TYPE(History) *h, const Char *s, size_t *lenp)
+{
+	const char *str;
+#ifndef NARROWCHAR
+	static ct_buffer_t conv;
+#endif
+
+	if ((str = ct_encode_string(s, &conv)) == NULL)
+		return -1;
+	return history_vis(&h->h_jbuf, &h->h_jbufsz, lenp, str);
+}
+
+
+/* history_journal_flush():
+ *	Append the len bytes of records in the journal buffer to the
+ *	journal, and compact the journal once it has grown enough
+ */
+static int
+history_journal_flush(TYPE(History) *h, size_t len)
+{
+	struct iovec iov;
+
+	if (len == 0)
+		return 0;
+	if (h->h_writer != NULL) {
+		if (history_writer_append(h, h->h_jbuf, len) == -1)
+			return -1;
+		h->h_jsize += (off_t)len;
+	} else {
+		iov.iov_base = h->h_jbuf;
+		iov.iov_len = len;
+		if (history_journal_write(&h->h_jfd, h->h_jname, &iov, 1,
+		    &h->h_jsize) == -1)
+			return -1;
+	}
+
+#ifdef HAVE_FLOCK
+	if (h->h_jsize > 2 * h->h_jbase + H_JOURNAL_SLACK)
+		return history_compact(h);
+#endif
+	return 0;
+}
+
+
+/* history_journal_enter():
+ *	Append an entered event to the journal as one record
+ */
+static int
+history_journal_enter(TYPE(History) *h, const Char *s)
+{
+	size_t len = 0;
+
+	if (history_journal_add(h, s, &len) == -1)
+		return -1;
+	return history_journal_flush(h, len);
+}
+
+
+#ifdef H_SHARED_RING
+/* history_ring_sync():
+ *	Read the events committed to the ring since the last call into
+ *	the private history.  If the slot of mine is read and entered,
+ *	*num is set to its event number.
+ */
+static void
+history_ring_sync(hshared_t *hs, TYPE(HistEvent) *ev,
+    unsigned long long mine, int *num)
+{
+	hring_t *ring = hs->ring;
+	unsigned long long n = ring->nslots, r = hs->rpos, tail, i, k;
+	size_t len, chunk = sizeof(hs->slot->data);
+	hrslot_t *s;
+	const Char *str;
+	struct timespec now;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	while (r < tail) {
+		if (tail - r > n)	/* overwritten before we got there */
+			r = tail - n;
+		s = &hs->slot[r % n];
+		if (atomic_load_explicit(&s->seq, memory_order_acquire) != r)
+			goto uncommitted;
+		if ((len = s->len) == 0) {	/* the end of a lost event */
+			r++;
+			continue;
+		}
+		k = (len + chunk - 1) / chunk;
+		if (r + k > tail) {		/* not ours to read */
+			r++;
+			continue;
+		}
+		if (len > hs->bufsz) {
+			char *nbuf;
+			size_t nsize = (len + 1024) & (size_t)~1023;
+			if ((nbuf = h_realloc(hs->buf, nsize)) == NULL)
+				break;
+			hs->buf = nbuf;
+			hs->bufsz = nsize;
+		}
+		for (i = 0; i < k; i++) {
+			s = &hs->slot[(r + i) % n];
+			if (i > 0 && atomic_load_explicit(&s->seq,
+			    memory_order_acquire) != r + i)
+				goto uncommitted;
+			memcpy(hs->buf + i * chunk, s->data,
+			    i + 1 < k ? chunk : len - i * chunk);
+		}
+		/* A writer may have lapped us while we were copying */
+		atomic_thread_fence(memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		if (tail - r > n)
+			continue;
+		hs->buf[len - 1] = '\0';
+		if ((str = ct_decode_string(hs->buf, &hs->conv)) != NULL &&
+		    history_def_enter(hs->hist, ev, str) == 1 && r == mine &&
+		    num != NULL)
+			*num = HENT(hs->hist, 0)->ev.num;
+		r += k;
+		continue;
+uncommitted:
+		/*
+		 * Its writer is still busy; but if it has been for too
+		 * long it must have died, so skip the slot.
+		 */
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+			break;
+		if (hs->stall != r) {
+			hs->stall = r;
+			hs->stallt = now;
+			break;
+		}
+		if (now.tv_sec - hs->stallt.tv_sec < H_RING_STALL ||
+		    (now.tv_sec - hs->stallt.tv_sec == H_RING_STALL &&
+		    now.tv_nsec < hs->stallt.tv_nsec))
+			break;
+		r++;
+	}
+	hs->rpos = r;
+}
+
+
+/* history_ring_append():
+ *	Append an event to the ring, returning its first slot in *pos
+ */
+static int
+history_ring_append(hshared_t *hs, const char *str, unsigned long long *pos)
+{
+	hring_t *ring = hs->ring;
+	unsigned long long n = ring->nslots, r, i, k;
+	size_t len = strlen(str) + 1, chunk = sizeof(hs->slot->data);
+	hrslot_t *s;
+
+	k = (len + chunk - 1) / chunk;
+	if (k > n / 2 || len > UINT32_MAX)
+		return -1;
+	r = atomic_fetch_add_explicit(&ring->tail, k, memory_order_relaxed);
+	/*
+	 * A reader we lap checks tail after copying a slot; make it see
+	 * the new tail if it sees any of the bytes written below
+	 */
+	atomic_thread_fence(memory_order_release);
+	for (i = 0; i < k; i++) {
+		s = &hs->slot[(r + i) % n];
+		s->len = i == 0 ? (uint32_t)len : 0;
+		memcpy(s->data, str + i * chunk,
+		    i + 1 < k ? chunk : len - i * chunk);
+	}
+	/* Commit the first slot last, so readers never start too early */
+	for (i = k; i-- > 0;)
+		atomic_store_explicit(&hs->slot[(r + i) % n].seq, r + i,
+		    memory_order_release);
+	*pos = r;
+	return 0;
+}
+
+
+/* history_ring_first():
+ *	Pick up the events from other sessions and return the newest one
+ */
+static int
+history_ring_first(void *p, TYPE(HistEvent) *ev)
+{
+	hshared_t *hs = p;
+
+	history_ring_sync(hs, ev, ULLONG_MAX, NULL);
+	return history_def_first(hs->hist, ev);
+}
+
+
+/* history_ring_last():
+ *	Pick up the events from other sessions and return the oldest one
+ */
+static int
+history_ring_last(void *p, TYPE(HistEvent) *ev)
+{
+	hshared_t *hs = p;
+
+	history_ring_sync(hs, ev, ULLONG_MAX, NULL);
+	return history_def_last(hs->hist, ev);
+}
+
+
+/* history_ring_next():
+ *	Move to the next older event seen so far
+ */
+static int
+history_ring_next(void *p, TYPE(HistEvent) *ev)
+{
+	return history_def_next(((hshared_t *)p)->hist, ev);
+}
+
+
+/* history_ring_prev():
+ *	Move to the next newer event seen so far
+ */
+static int
+history_ring_prev(void *p, TYPE(HistEvent) *ev)
+{
+	return history_def_prev(((hshared_t *)p)->hist, ev);
+}
+
+
+/* history_ring_curr():
+ *	Return the current event
+ */
+static int
+history_ring_curr(void *p, TYPE(HistEvent) *ev)
+{
+	return history_def_curr(((hshared_t *)p)->hist, ev);
+}
+
+
+/* history_ring_set():
+ *	Make the event numbered n current
+ */
+static int
+history_ring_set(void *p, TYPE(HistEvent) *ev, const int n)
+{
+	return history_def_set(((hshared_t *)p)->hist, ev, n);
+}
+
+
+/* history_ring_add():
+ *	Append to the current event, in this session only
+ */
+static int
+history_ring_add(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	return history_def_add(((hshared_t *)p)->hist, ev, str);
+}
+
+
+/* history_ring_del():
+ *	Delete the event numbered n, in this session only
+ */
+static int
+history_ring_del(void *p, TYPE(HistEvent) *ev, const int n)
+{
+	return history_def_del(((hshared_t *)p)->hist, ev, n);
+}
+
+
+/* history_ring_clear():
+ *	Forget the events seen so far; the ring itself is left alone
+ */
+static void
+history_ring_clear(void *p, TYPE(HistEvent) *ev)
+{
+	hshared_t *hs = p;
+
+	history_def_clear(hs->hist, ev);
+	hs->rpos = atomic_load_explicit(&hs->ring->tail, memory_order_acquire);
+}
+
+
+/* history_ring_enter():
+ *	Append an event to the ring, then read it back along with the
+ *	ones other sessions entered before it
+ */
+static int
+history_ring_enter(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	hshared_t *hs = p;
+	unsigned long long pos;
+	const char *s;
+	int num = -1;
+
+	if ((s = ct_encode_string(str, &hs->conv)) == NULL ||
+	    history_ring_append(hs, s, &pos) == -1) {
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	history_ring_sync(hs, ev, pos, &num);
+	if (num == -1)		/* a duplicate, or overrun already */
+		return history_def_first(hs->hist, ev) == -1 ? -1 : 0;
+	return history_def_set(hs->hist, ev, num) == -1 ? -1 : 1;
+}
+
+
+/* history_ring_open():
+ *	Map the shared ring file fname, creating it with size slots
+ *	if it does not exist, and switch to reading and appending the
+ *	events there
+ */
+static int
+history_ring_open(TYPE(History) *h, TYPE(HistEvent) *ev, const char *fname,
+    int size)
+{
+	TYPE(History) nh;
+	struct stat st;
+	hshared_t *hs;
+	hring_t *ring;
+	void *p;
+	size_t mapsz;
+	int fd;
+
+	if (size < 0 || size > INT_MAX / H_RING_SLOT - 1) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	if (size == 0)
+		size = H_RING_SIZE;
+	if ((fd = open(fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+		goto fail;
+	/* Only one session may create the ring */
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+		goto fail1;
+	mapsz = st.st_size != 0 ? (size_t)st.st_size :
+	    ((size_t)size + 1) * H_RING_SLOT;
+	if (st.st_size == 0 && ftruncate(fd, (off_t)mapsz) == -1)
+		goto fail1;
+	if ((p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED)
+		goto fail1;
+	ring = p;
+	if (st.st_size == 0) {
+		ring->slotsz = H_RING_SLOT;
+		ring->nslots = (uint32_t)size;
+		atomic_init(&ring->tail, 0);
+		memcpy(ring->magic, hist_ring_cookie, sizeof(ring->magic));
+	} else if (mapsz < 2 * H_RING_SLOT || memcmp(ring->magic,
+	    hist_ring_cookie, sizeof(ring->magic)) != 0 ||
+	    ring->slotsz != H_RING_SLOT ||
+	    ((size_t)ring->nslots + 1) * H_RING_SLOT != mapsz)
+		goto fail2;
+	(void)flock(fd, LOCK_UN);
+	(void)close(fd);
+
+	if ((hs = h_malloc(sizeof(*hs))) == NULL) {
+		(void)munmap(p, mapsz);
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	if (history_def_init((void **)&hs->hist, ev, (int)ring->nslots)
+	    == -1) {
+		h_free(hs);
+		(void)munmap(p, mapsz);
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	hs->ring = ring;
+	hs->slot = (hrslot_t *)(void *)((char *)p + H_RING_SLOT);
+	hs->mapsz = mapsz;
+	hs->rpos = 0;
+	hs->stall = ULLONG_MAX;
+	hs->buf = NULL;
+	hs->bufsz = 0;
+#ifndef NARROWCHAR
+	memset(&hs->conv, 0, sizeof(hs->conv));
+#endif
+	history_ring_sync(hs, ev, ULLONG_MAX, NULL);
+
+	nh.h_ref = hs;
+	nh.h_first = history_ring_first;
+	nh.h_next = history_ring_next;
+	nh.h_last = history_ring_last;
+	nh.h_prev = history_ring_prev;
+	nh.h_curr = history_ring_curr;
+	nh.h_set = history_ring_set;
+	nh.h_clear = history_ring_clear;
+	nh.h_enter = history_ring_enter;
+	nh.h_add = history_ring_add;
+	nh.h_del = history_ring_del;
+	return history_set_fun(h, &nh);
+
+fail2:
+	(void)munmap(p, mapsz);
+fail1:
+	(void)close(fd);
+fail:
+	he_seterrev(ev, _HE_HIST_READ);
+	return -1;
+}
+
+
+/* history_ring_close():
+ *	Stop sharing events, keeping the ones seen so far in the
+ *	builtin history
+ */
+static void
+history_ring_close(TYPE(History) *h)
+{
+	hshared_t *hs;
+
+	if (h->h_next != history_ring_next)
+		return;
+	hs = h->h_ref;
+	(void)munmap(hs->ring, hs->mapsz);
+	h_free(hs->buf);
+#ifndef NARROWCHAR
+	h_free(hs->conv.cbuff);
+	h_free(hs->conv.wbuff);
+#endif
+	h->h_ref = hs->hist;
+	h_free(hs);
+	h->h_ent = -1;
+	h->h_first = history_def_first;
+	h->h_next = history_def_next;
+	h->h_last = history_def_last;
+	h->h_prev = history_def_prev;
+	h->h_curr = history_def_curr;
+	h->h_set = history_def_set;
+	h->h_clear = history_def_clear;
+	h->h_enter = history_def_enter;
+	h->h_add = history_def_add;
+	h->h_del = history_def_del;
+}
+#else
+static int
+history_ring_open(TYPE(History) *h libedit_unused, TYPE(HistEvent) *ev,
+    const char *fname libedit_unused, int size libedit_unused)
+{
+	he_seterrev(ev, _HE_NOT_ALLOWED);
+	return -1;
+}
+
+
+static void
+history_ring_close(TYPE(History) *h libedit_unused)
+{
+}
+#endif
+
+
+#ifdef H_MAPPED_FILE
+/* history_map_retire():
+ *	Set the mapping aside until the file is closed, when the strings
+ *	handed out may point into it
+ */
+static int
+history_map_retire(hmap_t *hm)
+{
+#ifdef NARROWCHAR
+	hmold_t *o;
+
+	if ((o = h_malloc(sizeof(*o))) == NULL)
+		return -1;
+	o->addr = hm->head;
+	o->len = hm->mapsz;
+	o->next = hm->old;
+	hm->old = o;
+#else
+	(void)munmap(hm->head, hm->mapsz);
+#endif
+	return 0;
+}
+
+
+/* history_map_attach():
+ *	Map the history file open on fd, in place of the mapping so far
+ */
+static int
+history_map_attach(hmap_t *hm, int fd)
+{
+	struct stat st;
+	hmhead_t *head;
+	size_t mapsz;
+	void *p;
+
+	if (fstat(fd, &st) == -1 || (uintmax_t)st.st_size > SIZE_MAX ||
+	    (size_t)st.st_size <= sizeof(*head))
+		return -1;
+	mapsz = (size_t)st.st_size;
+	if ((p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED)
+		return -1;
+	head = p;
+	/* The data must end in a NUL, so that no string runs off it */
+	if (memcmp(head->magic, hist_map_cookie, sizeof(head->magic)) != 0 ||
+	    head->cap > (mapsz - sizeof(*head) - 1) / sizeof(*hm->off) ||
+	    ((char *)p)[mapsz - 1] != '\0' ||
+	    (hm->head != NULL && history_map_retire(hm) == -1)) {
+		(void)munmap(p, mapsz);
+		return -1;
+	}
+	hm->head = head;
+	hm->off = (uint64_t *)(void *)(head + 1);
+	hm->data = (char *)(void *)(hm->off + head->cap);
+	hm->mapsz = mapsz;
+	hm->dsize = mapsz - (size_t)(hm->data - (char *)p);
+	hm->dev = st.st_dev;
+	hm->ino = st.st_ino;
+	return 0;
+}
+
+
+/* history_map_reopen():
+ *	Map the file that replaced the one mapped
+ */
+static int
+history_map_reopen(hmap_t *hm)
+{
+	int fd;
+
+	if ((fd = open(hm->fname, O_RDWR)) == -1)
+		return -1;
+	if (history_map_attach(hm, fd) == -1) {
+		(void)close(fd);
+		return -1;
+	}
+	/* The old mapping may outlive the descriptor, and its lock too */
+	(void)flock(hm->fd, LOCK_UN);
+	(void)close(hm->fd);
+	hm->fd = fd;
+	return 0;
+}
+
+
+/* history_map_sync():
+ *	Pick up the events entered by other sessions, with the file
+ *	locked for writing if lock is set
+ */
+static int
+history_map_sync(hmap_t *hm, int lock)
+{
+	struct stat st;
+	hmhead_t *head;
+	uint64_t n;
+
+	for (;;) {
+		if (lock && flock(hm->fd, LOCK_EX) == -1)
+			return -1;
+		if (stat(hm->fname, &st) == -1 ||
+		    (st.st_dev == hm->dev && st.st_ino == hm->ino))
+			break;
+		/* Replaced by a copy with a larger index */
+		if (history_map_reopen(hm) == -1) {
+			if (!lock)
+				break;
+			(void)flock(hm->fd, LOCK_UN);
+			return -1;
+		}
+	}
+	head = hm->head;
+	n = atomic_load_explicit(&head->n, memory_order_acquire);
+	if (n > head->cap)
+		n = head->cap;
+	if (n != hm->n && fstat(hm->fd, &st) == 0 &&
+	    (size_t)st.st_size != hm->mapsz)
+		(void)history_map_attach(hm, hm->fd);
+	head = hm->head;
+	if (head->base != hm->base || hm->cursor >= (int64_t)n)
+		hm->cursor = -1;
+	hm->n = n;
+	hm->base = head->base;
+	hm->live = head->dead < n ? (int)(n - head->dead) : 0;
+	return 0;
+}
+
+
+/* history_map_unlock():
+ *	Let other sessions write to the file again
+ */
+static void
+history_map_unlock(hmap_t *hm)
+{
+	(void)flock(hm->fd, LOCK_UN);
+}
+
+
+/* history_map_step():
+ *	Return the first live slot from i on in direction dir, or -1
+ */
+static int64_t
+history_map_step(hmap_t *hm, int64_t i, int dir)
+{
+	while (i >= 0 && i < (int64_t)hm->n && (hm->off[i] & H_MAP_DEAD))
+		i += dir;
+	return i >= 0 && i < (int64_t)hm->n ? i : -1;
+}
+
+
+/* history_map_ev():
+ *	Return the current event, straight from the mapping
+ */
+static int
+history_map_ev(hmap_t *hm, TYPE(HistEvent) *ev)
+{
+	uint64_t o = hm->off[hm->cursor] & ~H_MAP_DEAD;
+
+	if (o >= hm->dsize) {
+		he_seterrev(ev, _HE_HIST_READ);
+		return -1;
+	}
+	if ((ev->str = ct_decode_string(hm->data + o, &hm->conv)) == NULL) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	ev->num = (int)(hm->base + (uint64_t)hm->cursor + 1);
+	return 0;
+}
+
+
+/* history_map_first():
+ *	Pick up the events from other sessions and return the newest one
+ */
+static int
+history_map_first(void *p, TYPE(HistEvent) *ev)
+{
+	hmap_t *hm = p;
+
+	(void)history_map_sync(hm, 0);
+	if ((hm->cursor = history_map_step(hm, (int64_t)hm->n - 1, -1))
+	    == -1) {
+		he_seterrev(ev, _HE_FIRST_NOTFOUND);
+		return -1;
+	}
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_last():
+ *	Pick up the events from other sessions and return the oldest one
+ */
+static int
+history_map_last(void *p, TYPE(HistEvent) *ev)
+{
+	hmap_t *hm = p;
+
+	(void)history_map_sync(hm, 0);
+	if ((hm->cursor = history_map_step(hm, 0, 1)) == -1) {
+		he_seterrev(ev, _HE_LAST_NOTFOUND);
+		return -1;
+	}
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_next():
+ *	Move to the next older event
+ */
+static int
+history_map_next(void *p, TYPE(HistEvent) *ev)
+{
+	hmap_t *hm = p;
+	int64_t i;
+
+	if (hm->cursor == -1) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if ((i = history_map_step(hm, hm->cursor - 1, -1)) == -1) {
+		he_seterrev(ev, _HE_END_REACHED);
+		return -1;
+	}
+	hm->cursor = i;
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_prev():
+ *	Move to the next newer event
+ */
+static int
+history_map_prev(void *p, TYPE(HistEvent) *ev)
+{
+	hmap_t *hm = p;
+	int64_t i;
+
+	if (hm->cursor == -1) {
+		he_seterrev(ev, hm->live > 0 ? _HE_END_REACHED :
+		    _HE_EMPTY_LIST);
+		return -1;
+	}
+	if ((i = history_map_step(hm, hm->cursor + 1, 1)) == -1) {
+		he_seterrev(ev, _HE_START_REACHED);
+		return -1;
+	}
+	hm->cursor = i;
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_curr():
+ *	Return the current event
+ */
+static int
+history_map_curr(void *p, TYPE(HistEvent) *ev)
+{
+	hmap_t *hm = p;
+
+	if (hm->cursor == -1) {
+		he_seterrev(ev, hm->live > 0 ? _HE_CURR_INVALID :
+		    _HE_EMPTY_LIST);
+		return -1;
+	}
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_set():
+ *	Make the event numbered n current, found by its slot
+ */
+static int
+history_map_set(void *p, TYPE(HistEvent) *ev, const int n)
+{
+	hmap_t *hm = p;
+	int64_t i = (int64_t)n - (int64_t)hm->base - 1;
+
+	if (hm->live == 0) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (i < 0 || i >= (int64_t)hm->n || (hm->off[i] & H_MAP_DEAD)) {
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
+	hm->cursor = i;
+	return 0;
+}
+
+
+/* history_map_rewrite():
+ *	Replace the file by a copy with cap index slots and dsize data
+ *	bytes, locked for writing like the file is
+ */
+static int
+history_map_rewrite(hmap_t *hm, uint64_t cap, size_t dsize)
+{
+	hmhead_t *head = hm->head, *nhead;
+	size_t len, mapsz, isz;
+	char *tmp;
+	void *p;
+	int fd, ofd = hm->fd, retval = -1;
+
+	if (cap > (SIZE_MAX - sizeof(*head) - dsize) / sizeof(*hm->off))
+		return -1;
+	isz = (size_t)cap * sizeof(*hm->off);
+	mapsz = sizeof(*head) + isz + dsize;
+	len = strlen(hm->fname) + sizeof(".XXXXXX");
+	if ((tmp = h_malloc(len)) == NULL)
+		return -1;
+	(void)snprintf(tmp, len, "%s.XXXXXX", hm->fname);
+	if ((fd = mkstemp(tmp)) == -1)
+		goto out1;
+	if (flock(fd, LOCK_EX) == -1 || ftruncate(fd, (off_t)mapsz) == -1 ||
+	    (p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0)) == MAP_FAILED)
+		goto out2;
+	nhead = p;
+	memcpy(nhead, head, sizeof(*nhead));
+	nhead->cap = cap;
+	memcpy(nhead + 1, hm->off, (size_t)hm->n * sizeof(*hm->off));
+	memcpy((char *)(void *)(nhead + 1) + isz, hm->data,
+	    (size_t)head->dend);
+	(void)munmap(p, mapsz);
+	if (fsync(fd) == -1 || rename(tmp, hm->fname) == -1)
+		goto out2;
+	if (history_map_attach(hm, fd) == -1) {
+		/* Keep writing the old file; others will find the copy */
+		(void)close(fd);
+		goto out1;
+	}
+	hm->fd = fd;
+	(void)flock(ofd, LOCK_UN);
+	(void)close(ofd);
+	retval = 0;
+	goto out1;
+out2:
+	(void)close(fd);
+	(void)unlink(tmp);
+out1:
+	h_free(tmp);
+	return retval;
+}
+
+
+/* history_map_reserve():
+ *	Make room in the locked file for one more slot and len more data
+ *	bytes, doubling what is short of them
+ */
+static int
+history_map_reserve(hmap_t *hm, size_t len)
+{
+	hmhead_t *head = hm->head;
+	size_t need, dsize = hm->dsize;
+
+	/* A NUL must be left at the end */
+	if (head->dend >= dsize || len > SIZE_MAX - 1 - (size_t)head->dend)
+		return -1;
+	need = (size_t)head->dend + len + 1;
+	if (hm->n < head->cap && need <= dsize)
+		return 0;
+	while (dsize < need) {
+		if (dsize > SIZE_MAX / 2)
+			return -1;
+		dsize *= 2;
+	}
+	if (hm->n == head->cap)
+		return history_map_rewrite(hm, head->cap * 2, dsize);
+	if (ftruncate(hm->fd, (off_t)(hm->mapsz - hm->dsize + dsize)) == -1)
+		return -1;
+	return history_map_attach(hm, hm->fd);
+}
+
+
+/* history_map_put():
+ *	Append the strings s1 and s2 to the data of the locked file,
+ *	and return where they start, or -1.  The strings may be in the
+ *	mapping themselves.
+ */
+static int64_t
+history_map_put(hmap_t *hm, const char *s1, const char *s2)
+{
+	size_t l1 = strlen(s1), l2 = strlen(s2), d1 = SIZE_MAX, d2 = SIZE_MAX;
+	uint64_t o;
+	char *d;
+
+	if (s1 >= hm->data && s1 < hm->data + hm->dsize)
+		d1 = (size_t)(s1 - hm->data);
+	if (s2 >= hm->data && s2 < hm->data + hm->dsize)
+		d2 = (size_t)(s2 - hm->data);
+	if (l1 + l2 < l1 || history_map_reserve(hm, l1 + l2 + 1) == -1)
+		return -1;
+	/* The data keeps its offsets when the file is remapped */
+	if (d1 != SIZE_MAX)
+		s1 = hm->data + d1;
+	if (d2 != SIZE_MAX)
+		s2 = hm->data + d2;
+	o = hm->head->dend;
+	d = hm->data + o;
+	memcpy(d, s1, l1);
+	memcpy(d + l1, s2, l2 + 1);
+	hm->head->dend += l1 + l2 + 1;
+	return (int64_t)o;
+}
+
+
+/* history_map_enter():
+ *	Append an event to the file
+ */
+static int
+history_map_enter(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	hmap_t *hm = p;
+	const char *s;
+	int64_t i, o;
+
+	if (history_map_sync(hm, 1) == -1) {
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	if ((s = ct_encode_string(str, &hm->conv)) == NULL) {
+		history_map_unlock(hm);
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	if (hm->unique &&
+	    (i = history_map_step(hm, (int64_t)hm->n - 1, -1)) != -1 &&
+	    hm->off[i] < hm->dsize && strcmp(hm->data + hm->off[i], s) == 0) {
+		history_map_unlock(hm);
+		hm->cursor = i;
+		return history_map_ev(hm, ev) == -1 ? -1 : 0;
+	}
+	if ((o = history_map_put(hm, s, "")) == -1) {
+		history_map_unlock(hm);
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	/* Commit the slot last, so readers never see it too early */
+	hm->off[hm->n] = (uint64_t)o;
+	atomic_store_explicit(&hm->head->n, hm->n + 1, memory_order_release);
+	history_map_unlock(hm);
+	hm->cursor = (int64_t)hm->n++;
+	hm->live++;
+	return history_map_ev(hm, ev) == -1 ? -1 : 1;
+}
+
+
+/* history_map_add():
+ *	Append to the current event, by appending the whole string and
+ *	pointing its slot there
+ */
+static int
+history_map_add(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	hmap_t *hm = p;
+	const char *s;
+	uint64_t o;
+	int64_t no;
+
+	if (hm->cursor == -1)
+		return history_map_enter(p, ev, str);
+	if (history_map_sync(hm, 1) == -1) {
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	if (hm->cursor == -1) {
+		history_map_unlock(hm);
+		return history_map_enter(p, ev, str);
+	}
+	if ((s = ct_encode_string(str, &hm->conv)) == NULL) {
+		history_map_unlock(hm);
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	o = hm->off[hm->cursor] & ~H_MAP_DEAD;
+	if (o >= hm->dsize || (no = history_map_put(hm, hm->data + o, s))
+	    == -1) {
+		history_map_unlock(hm);
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	hm->off[hm->cursor] = (uint64_t)no |
+	    (hm->off[hm->cursor] & H_MAP_DEAD);
+	history_map_unlock(hm);
+	return history_map_ev(hm, ev);
+}
+
+
+/* history_map_del():
+ *	Delete the event numbered num, marking its slot
+ */
+static int
+history_map_del(void *p, TYPE(HistEvent) *ev, const int num)
+{
+	hmap_t *hm = p;
+	TYPE(HistEvent) cev;
+	Char *s;
+	int64_t i;
+
+	if (history_map_sync(hm, 1) == -1) {
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	if (history_map_set(hm, ev, num) == -1) {
+		history_map_unlock(hm);
+		return -1;
+	}
+	if (history_map_ev(hm, &cev) == -1 ||
+	    (s = Strdup(cev.str)) == NULL) {
+		history_map_unlock(hm);
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	i = hm->cursor;
+	hm->off[i] |= H_MAP_DEAD;
+	hm->head->dead++;
+	history_map_unlock(hm);
+	hm->live--;
+	if ((hm->cursor = history_map_step(hm, i + 1, 1)) == -1)
+		hm->cursor = history_map_step(hm, i - 1, -1);
+	ev->str = s;
+	ev->num = num;
+	return 0;
+}
+
+
+/* history_map_clear():
+ *	Drop all the events of the file; event numbers go on from
+ *	where they were.  Their strings stay in the data, where the
+ *	strings handed out may still point.
+ */
+static void
+history_map_clear(void *p, TYPE(HistEvent) *ev libedit_unused)
+{
+	hmap_t *hm = p;
+	hmhead_t *head;
+
+	if (history_map_sync(hm, 1) == -1)
+		return;
+	head = hm->head;
+	head->base += hm->n;
+	head->dead = 0;
+	atomic_store_explicit(&head->n, 0, memory_order_release);
+	history_map_unlock(hm);
+	hm->n = 0;
+	hm->base = head->base;
+	hm->live = 0;
+	hm->cursor = -1;
+}
+
+
+/* history_map_free():
+ *	Unmap the file and free the mapped history
+ */
+static void
+history_map_free(hmap_t *hm)
+{
+#ifdef NARROWCHAR
+	hmold_t *o;
+
+	while ((o = hm->old) != NULL) {
+		hm->old = o->next;
+		(void)munmap(o->addr, o->len);
+		h_free(o);
+	}
+#endif
+	if (hm->head != NULL)
+		(void)munmap(hm->head, hm->mapsz);
+	if (hm->fd != -1)
+		(void)close(hm->fd);
+	h_free(hm->fname);
+#ifndef NARROWCHAR
+	h_free(hm->conv.cbuff);
+	h_free(hm->conv.wbuff);
+#endif
+	h_free(hm);
+}
+
+
+/* history_map_open():
+ *	Map the history file fname, creating it if it does not exist,
+ *	and switch to reading and appending the events there.  Nothing
+ *	is read until it is asked for.
+ */
+static int
+history_map_open(TYPE(History) *h, TYPE(HistEvent) *ev, const char *fname)
+{
+	TYPE(History) nh;
+	struct stat st;
+	hmhead_t head;
+	hmap_t *hm;
+	size_t len;
+	int fd;
+
+	len = strlen(fname) + 1;
+	if ((hm = h_malloc(sizeof(*hm))) == NULL)
+		goto oomem;
+	memset(hm, 0, sizeof(*hm));
+	hm->fd = -1;
+	hm->cursor = -1;
+	if ((hm->fname = h_malloc(len)) == NULL) {
+		h_free(hm);
+		goto oomem;
+	}
+	memcpy(hm->fname, fname, len);
+	if ((fd = open(fname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+		goto fail;
+	/* Only one session may create the file */
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+		goto fail1;
+	if (st.st_size == 0) {
+		memset(&head, 0, sizeof(head));
+		memcpy(head.magic, hist_map_cookie, sizeof(head.magic));
+		head.cap = H_MAP_SLOTS;
+		atomic_init(&head.n, 0);
+		if (ftruncate(fd, (off_t)(sizeof(head) +
+		    H_MAP_SLOTS * sizeof(*hm->off) + H_MAP_DATA)) == -1 ||
+		    pwrite(fd, &head, sizeof(head), 0) != sizeof(head))
+			goto fail1;
+	}
+	if (history_map_attach(hm, fd) == -1)
+		goto fail1;
+	hm->fd = fd;
+	(void)history_map_sync(hm, 0);
+	(void)flock(fd, LOCK_UN);
+
+	nh.h_ref = hm;
+	nh.h_first = history_map_first;
+	nh.h_next = history_map_next;
+	nh.h_last = history_map_last;
+	nh.h_prev = history_map_prev;
+	nh.h_curr = history_map_curr;
+	nh.h_set = history_map_set;
+	nh.h_clear = history_map_clear;
+	nh.h_enter = history_map_enter;
+	nh.h_add = history_map_add;
+	nh.h_del = history_map_del;
+	return history_set_fun(h, &nh);
+
+fail1:
+	(void)close(fd);
+fail:
+	history_map_free(hm);
+	he_seterrev(ev, _HE_HIST_READ);
+	return -1;
+oomem:
+	he_seterrev(ev, _HE_MALLOC_FAILED);
+	return -1;
+}
+
+
+/* history_map_close():
+ *	Stop using the file, reading its events into the builtin
+ *	history
+ */
+static int
+history_map_close(TYPE(History) *h, TYPE(HistEvent) *ev)
+{
+	TYPE(HistEvent) cev;
+	history_t *hd;
+	hmap_t *hm;
+	int64_t i, cur;
+	int num = -1;
+
+	if (h->h_next != history_map_next)
+		return 0;
+	hm = h->h_ref;
+	(void)history_map_sync(hm, 0);
+	if (history_def_init((void **)&hd, ev, hm->live) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	if (hm->unique)
+		hd->flags |= H_UNIQUE;
+	cur = hm->cursor;
+	for (i = 0; (i = history_map_step(hm, i, 1)) != -1; i++) {
+		hm->cursor = i;
+		if (history_map_ev(hm, &cev) == -1)
+			continue;
+		if (i == cur)
+			num = cev.num;
+		/* history_def_insert() numbers it */
+		hd->eventid = cev.num - 1;
+		if (history_def_insert(hd, ev, cev.str) == -1) {
+			hm->cursor = cur;
+			history_def_clear(hd, ev);
+			h_free(hd);
+			he_seterrev(ev, _HE_MALLOC_FAILED);
+			return -1;
+		}
+	}
+	hd->eventid = (int)(hm->base + hm->n);
+	hd->cursor = num == -1 ? -1 : history_def_find(hd, num);
+	history_map_free(hm);
+
+	h->h_ref = hd;
+	h->h_first = history_def_first;
+	h->h_next = history_def_next;
+	h->h_last = history_def_last;
+	h->h_prev = history_def_prev;
+	h->h_curr = history_def_curr;
+	h->h_set = history_def_set;
+	h->h_clear = history_def_clear;
+	h->h_enter = history_def_enter;
+	h->h_add = history_def_add;
+	h->h_del = history_def_del;
+	return 0;
+}
+#else
+static int
+history_map_open(TYPE(History) *h libedit_unused, TYPE(HistEvent) *ev,
+    const char *fname libedit_unused)
+{
+	he_seterrev(ev, _HE_NOT_ALLOWED);
+	return -1;
+}
+
+
+static int
+history_map_close(TYPE(History) *h libedit_unused,
+    TYPE(HistEvent) *ev libedit_unused)
+{
+	return 0;
+}
+#endif
+
+
+/* history_pack_putnum():
+ *	Code v as a varint at p, and return the end of it
+ */
+static unsigned char *
+history_pack_putnum(unsigned char *p, size_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = (unsigned char)(v | 0x80);
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+
+/* history_pack_getnum():
+ *	Decode the varint at p into *v, and return the end of it
+ */
+static const unsigned char *
+history_pack_getnum(const unsigned char *p, size_t *v)
+{
+	size_t r = 0;
+	unsigned int s;
+
+	for (s = 0; *p & 0x80; s += 7)
+		r |= (size_t)(*p++ & 0x7f) << s;
+	*v = r | (size_t)*p++ << s;
+	return p;
+}
+
+
+/* history_pack_newblk():
+ *	Allocate an empty block with room for size code bytes
+ */
+static hpblk_t *
+history_pack_newblk(hpack_t *hp, size_t size)
+{
+	hpblk_t *b;
+
+	if ((b = h_malloc(sizeof(*b) + size)) == NULL)
+		return NULL;
+	b->len = 0;
+	b->size = size;
+	b->n = 0;
+	b->skip = 0;
+	b->last = 0;
+	hp->mem += sizeof(*b) + size;
+	return b;
+}
+
+
+/* history_pack_forget():
+ *	Drop the decoded strings of block b from the views but keep
+ */
+static void
+history_pack_forget(hpack_t *hp, hpblk_t *b, hpview_t *keep)
+{
+	if (hp->tail.blk == b && &hp->tail != keep)
+		hp->tail.blk = NULL;
+	if (hp->view.blk == b && &hp->view != keep)
+		hp->view.blk = NULL;
+}
+
+
+/* history_pack_freeblk():
+ *	Free block b
+ */
+static void
+history_pack_freeblk(hpack_t *hp, hpblk_t *b)
+{
+	history_pack_forget(hp, b, NULL);
+	hp->mem -= sizeof(*b) + b->size;
+	h_free(b);
+}
+
+
+/* history_pack_viewfree():
+ *	Free the strings of view v
+ */
+static void
+history_pack_viewfree(hpack_t *hp, hpview_t *v)
+{
+	hp->mem -= v->size * sizeof(*v->buf);
+	h_free(v->buf);
+	v->buf = NULL;
+	v->size = v->len = 0;
+	v->blk = NULL;
+}
+
+
+/* history_pack_grow():
+ *	Make room for len characters in the strings of view v
+ */
+static int
+history_pack_grow(hpack_t *hp, hpview_t *v, size_t len)
+{
+	Char *nbuf;
+	size_t nsize;
+
+	if (len <= v->size)
+		return 0;
+	for (nsize = v->size ? v->size : 1024; nsize < len; nsize *= 2)
+		continue;
+	if ((nbuf = h_realloc(v->buf, nsize * sizeof(*nbuf))) == NULL)
+		return -1;
+	hp->mem += (nsize - v->size) * sizeof(*nbuf);
+	v->buf = nbuf;
+	v->size = nsize;
+	return 0;
+}
+
+
+/* history_pack_decode():
+ *	Decode the strings of block b into view v
+ */
+static int
+history_pack_decode(hpack_t *hp, hpview_t *v, hpblk_t *b)
+{
+	const unsigned char *p = b->code;
+	size_t x, shared, slen, len = 0;
+	int i, num = 0;
+
+	v->blk = NULL;
+	for (i = 0; i < b->n; i++) {
+		p = history_pack_getnum(p, &x);
+		num += (int)x;
+		p = history_pack_getnum(p, &x);
+		shared = x / HP_DICT;
+		p = history_pack_getnum(p, &slen);
+		if (history_pack_grow(hp, v, len + shared + slen + 1) == -1)
+			return -1;
+		v->off[i] = len;
+		v->num[i] = num;
+		if (shared != 0)
+			memcpy(v->buf + len, v->buf + v->off[i - 1 -
+			    (int)(x % HP_DICT)], shared * sizeof(*v->buf));
+		len += shared;
+#ifdef NARROWCHAR
+		memcpy(v->buf + len, p, slen);
+		p += slen;
+		len += slen;
+#else
+		for (; slen > 0; slen--) {
+			p = history_pack_getnum(p, &x);
+			v->buf[len++] = (Char)x;
+		}
+#endif
+		v->buf[len++] = '\0';
+	}
+	v->len = len;
+	v->blk = b;
+	return 0;
+}
+
+
+/* history_pack_code():
+ *	Code str as event num after the ones in block *bp, which are
+ *	decoded in view v, moving the block if it has to grow
+ */
+static int
+history_pack_code(hpack_t *hp, hpblk_t **bp, hpview_t *v, const Char *str,
+    int num)
+{
+	hpblk_t *b = *bp;
+	const Char *s;
+	unsigned char *p;
+	size_t slen = Strlen(str), shared = 0, l, need;
+	int j, back = 0;
+
+	history_pack_forget(hp, b, v);
+	for (j = 1; j <= HP_DICT && j <= b->n; j++) {
+		s = v->buf + v->off[b->n - j];
+		for (l = 0; l < slen && s[l] == str[l]; l++)
+			continue;
+		if (l > shared) {
+			shared = l;
+			back = j - 1;
+		}
+	}
+	need = b->len + 3 * HP_NUMMAX + (slen - shared) * HP_CHARMAX;
+	if (need > b->size) {
+		hpblk_t *nb;
+		size_t nsize;
+		for (nsize = b->size ? b->size * 2 : HP_MINCODE; nsize < need;
+		    nsize *= 2)
+			continue;
+		if ((nb = h_realloc(b, sizeof(*nb) + nsize)) == NULL)
+			return -1;
+		hp->mem += nsize - nb->size;
+		nb->size = nsize;
+		v->blk = *bp = b = nb;
+	}
+	if (history_pack_grow(hp, v, v->len + slen + 1) == -1)
+		return -1;
+
+	p = b->code + b->len;
+	p = history_pack_putnum(p, (size_t)(b->n == 0 ? num : num - b->last));
+	p = history_pack_putnum(p, shared * HP_DICT + (size_t)back);
+	p = history_pack_putnum(p, slen - shared);
+#ifdef NARROWCHAR
+	memcpy(p, str + shared, slen - shared);
+	p += slen - shared;
+#else
+	for (l = shared; l < slen; l++)
+		p = history_pack_putnum(p, (size_t)(unsigned int)str[l]);
+#endif
+	b->len = (size_t)(p - b->code);
+
+	v->off[b->n] = v->len;
+	v->num[b->n] = num;
+	memcpy(v->buf + v->len, str, (slen + 1) * sizeof(*str));
+	v->len += slen + 1;
+	b->last = num;
+	b->n++;
+	return 0;
+}
+
+
+/* history_pack_shrink():
+ *	Give back the code bytes a full block will not grow into
+ */
+static void
+history_pack_shrink(hpack_t *hp, hpblk_t **bp)
+{
+	hpblk_t *nb;
+	size_t len = (*bp)->len, size = (*bp)->size;
+
+	if (len == size)
+		return;
+	history_pack_forget(hp, *bp, NULL);
+	if ((nb = h_realloc(*bp, sizeof(*nb) + len)) == NULL)
+		return;
+	hp->mem -= size - len;
+	nb->size = len;
+	*bp = nb;
+}
+
+
+/* history_pack_view():
+ *	Return the view with block bi decoded
+ */
+static hpview_t *
+history_pack_view(hpack_t *hp, int bi)
+{
+	hpview_t *v = bi == hp->nblk - 1 ? &hp->tail : &hp->view;
+
+	if (v->blk != hp->blk[bi] &&
+	    history_pack_decode(hp, v, hp->blk[bi]) == -1)
+		return NULL;
+	return v;
+}
+
+
+/* history_pack_num():
+ *	Return the number of event k of block bi, or -1
+ */
+static int
+history_pack_num(hpack_t *hp, int bi, int k)
+{
+	hpview_t *v;
+
+	if ((v = history_pack_view(hp, bi)) == NULL)
 		return -1;
-	}
-	if (num < 0) {
-		he_seterrev(ev, _HE_BAD_PARAM);
+	return v->num[k];
+}
+
+
+/* history_pack_ev():
+ *	Return the current event
+ */
+static int
+history_pack_ev(hpack_t *hp, TYPE(HistEvent) *ev)
+{
+	hpview_t *v;
+
+	if ((v = history_pack_view(hp, hp->cb)) == NULL) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
 		return -1;
 	}
-	history_def_setsize(h->h_ref, num);
+	ev->num = v->num[hp->ck];
+	ev->str = v->buf + v->off[hp->ck];
 	return 0;
 }
 
 
-/* history_getsize():
- *      Get number of events currently in history
+/* history_pack_older():
+ *	Move *bp, *kp to the next older event, if any
  */
 static int
-history_getsize(TYPE(History) *h, TYPE(HistEvent) *ev)
+history_pack_older(hpack_t *hp, int *bp, int *kp)
 {
-	if (h->h_next != history_def_next) {
-		he_seterrev(ev, _HE_NOT_ALLOWED);
-		return -1;
+	if (*kp > hp->blk[*bp]->skip) {
+		(*kp)--;
+		return 0;
 	}
-	ev->num = history_def_getsize(h->h_ref);
-	if (ev->num < -1) {
-		he_seterrev(ev, _HE_SIZE_NEGATIVE);
+	if (*bp == hp->b0)
 		return -1;
+	(*bp)--;
+	*kp = hp->blk[*bp]->n - 1;
+	return 0;
+}
+
+
+/* history_pack_newer():
+ *	Move *bp, *kp to the next newer event, if any
+ */
+static int
+history_pack_newer(hpack_t *hp, int *bp, int *kp)
+{
+	if (*kp < hp->blk[*bp]->n - 1) {
+		(*kp)++;
+		return 0;
 	}
+	if (*bp == hp->nblk - 1)
+		return -1;
+	(*bp)++;
+	*kp = hp->blk[*bp]->skip;
 	return 0;
 }
 
 
-/* history_setunique():
- *	Set if adjacent equal events should not be entered in history.
+/* history_pack_find():
+ *	Find the event numbered num: the last event number of each
+ *	block leads to the block, which is then decoded
  */
 static int
-history_setunique(TYPE(History) *h, TYPE(HistEvent) *ev, int uni)
+history_pack_find(hpack_t *hp, int num, int *bp, int *kp)
 {
-	if (h->h_next != history_def_next) {
-		he_seterrev(ev, _HE_NOT_ALLOWED);
+	hpview_t *v;
+	int lo = hp->b0, hi = hp->nblk - 1, mid, k;
+
+	if (hp->cur == 0 || num > hp->blk[hi]->last)
+		return -1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (hp->blk[mid]->last < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((v = history_pack_view(hp, lo)) == NULL)
 		return -1;
+	for (k = hp->blk[lo]->skip; k < hp->blk[lo]->n; k++)
+		if (v->num[k] == num) {
+			*bp = lo;
+			*kp = k;
+			return 0;
+		}
+	return -1;
+}
+
+
+/* history_pack_push():
+ *	Add block b as the newest one
+ */
+static int
+history_pack_push(hpack_t *hp, hpblk_t *b)
+{
+	hpblk_t **nblk;
+	int nsize;
+
+	if (hp->nblk == hp->blksz) {
+		if (hp->b0 > 0 && hp->b0 >= hp->blksz / 2) {
+			memmove(hp->blk, hp->blk + hp->b0,
+			    (size_t)(hp->nblk - hp->b0) * sizeof(*hp->blk));
+			if (hp->cb != -1)
+				hp->cb -= hp->b0;
+			hp->nblk -= hp->b0;
+			hp->b0 = 0;
+		} else {
+			nsize = hp->blksz ? hp->blksz * 2 : 16;
+			if ((nblk = h_realloc(hp->blk,
+			    (size_t)nsize * sizeof(*nblk))) == NULL)
+				return -1;
+			hp->mem += (size_t)(nsize - hp->blksz) *
+			    sizeof(*nblk);
+			hp->blk = nblk;
+			hp->blksz = nsize;
+		}
 	}
-	history_def_setunique(h->h_ref, uni);
+	hp->blk[hp->nblk++] = b;
 	return 0;
 }
 
 
-/* history_getunique():
- *	Get if adjacent equal events should not be entered in history.
+/* history_pack_append():
+ *	Add str as event num, the newest one
  */
 static int
-history_getunique(TYPE(History) *h, TYPE(HistEvent) *ev)
+history_pack_append(hpack_t *hp, const Char *str, int num)
 {
-	if (h->h_next != history_def_next) {
-		he_seterrev(ev, _HE_NOT_ALLOWED);
+	hpblk_t *b;
+
+	if (hp->nblk == hp->b0 || hp->blk[hp->nblk - 1]->n == HP_BLOCK) {
+		if (hp->nblk > hp->b0)
+			history_pack_shrink(hp, &hp->blk[hp->nblk - 1]);
+		if ((b = history_pack_newblk(hp, HP_MINCODE)) == NULL)
+			return -1;
+		if (history_pack_push(hp, b) == -1) {
+			history_pack_freeblk(hp, b);
+			return -1;
+		}
+		hp->tail.blk = b;
+		hp->tail.len = 0;
+	} else if (history_pack_view(hp, hp->nblk - 1) == NULL)
+		return -1;
+	if (history_pack_code(hp, &hp->blk[hp->nblk - 1], &hp->tail, str,
+	    num) == -1) {
+		if (hp->blk[hp->nblk - 1]->n == 0) {
+			history_pack_freeblk(hp, hp->blk[--hp->nblk]);
+			if (hp->nblk == hp->b0)
+				hp->nblk = hp->b0 = 0;
+		}
 		return -1;
 	}
-	ev->num = history_def_getunique(h->h_ref);
+	hp->cur++;
 	return 0;
 }
 
 
-/* history_set_fun():
- *	Set history functions
+/* history_pack_drop():
+ *	Drop the oldest event
+ */
+static void
+history_pack_drop(hpack_t *hp)
+{
+	hpblk_t *b = hp->blk[hp->b0];
+
+	if (hp->cb == hp->b0 && hp->ck == b->skip &&
+	    history_pack_newer(hp, &hp->cb, &hp->ck) == -1)
+		hp->cb = -1;
+	if (++b->skip == b->n) {
+		history_pack_freeblk(hp, b);
+		if (++hp->b0 == hp->nblk)
+			hp->b0 = hp->nblk = 0;
+	}
+	hp->cur--;
+}
+
+
+/* history_pack_recode():
+ *	Replace event ki of block bi by str, or delete it if str is
+ *	NULL, recoding the block.  The current event stays, or moves
+ *	like it does in the builtin history when it is deleted.
  */
 static int
-history_set_fun(TYPE(History) *h, TYPE(History) *nh)
+history_pack_recode(hpack_t *hp, TYPE(HistEvent) *ev, int bi, int ki,
+    const Char *str)
 {
-	TYPE(HistEvent) ev;
+	hpview_t nv, *v;
+	hpblk_t *ob = hp->blk[bi], *nb;
+	const Char *s;
+	int i, b, k, target = -1;
 
-	if (nh->h_first == NULL || nh->h_next == NULL || nh->h_last == NULL ||
-	    nh->h_prev == NULL || nh->h_curr == NULL || nh->h_set == NULL ||
-	    nh->h_enter == NULL || nh->h_add == NULL || nh->h_clear == NULL ||
-	    nh->h_del == NULL || nh->h_ref == NULL) {
-		if (h->h_next != history_def_next) {
-			if (history_def_init(&h->h_ref, &ev, 0) == -1)
-				return -1;
-			h->h_first = history_def_first;
-			h->h_next = history_def_next;
-			h->h_last = history_def_last;
-			h->h_prev = history_def_prev;
-			h->h_curr = history_def_curr;
-			h->h_set = history_def_set;
-			h->h_clear = history_def_clear;
-			h->h_enter = history_def_enter;
-			h->h_add = history_def_add;
-			h->h_del = history_def_del;
+	if (str == NULL && bi == hp->b0 && ki == ob->skip) {
+		history_pack_drop(hp);
+		return 0;
+	}
+	if (hp->cb != -1) {
+		b = hp->cb;
+		k = hp->ck;
+		if ((str == NULL && b == bi && k == ki) &&
+		    history_pack_newer(hp, &b, &k) == -1 &&
+		    history_pack_older(hp, &b, &k) == -1)
+			b = -1;
+		if (b != -1)
+			target = history_pack_num(hp, b, k);
+	}
+
+	memset(&nv, 0, sizeof(nv));
+	if ((v = history_pack_view(hp, bi)) == NULL ||
+	    (nb = history_pack_newblk(hp, ob->len)) == NULL)
+		goto oomem;
+	nv.blk = nb;
+	for (i = ob->skip; i < ob->n; i++) {
+		if ((s = i == ki ? str : v->buf + v->off[i]) == NULL)
+			continue;
+		if (history_pack_code(hp, &nb, &nv, s, v->num[i]) == -1) {
+			history_pack_freeblk(hp, nb);
+			history_pack_viewfree(hp, &nv);
+			goto oomem;
 		}
+	}
+
+	v = bi == hp->nblk - 1 ? &hp->tail : &hp->view;
+	history_pack_freeblk(hp, ob);
+	history_pack_viewfree(hp, v);
+	if (nb->n == 0) {
+		history_pack_freeblk(hp, nb);
+		history_pack_viewfree(hp, &nv);
+		memmove(hp->blk + bi, hp->blk + bi + 1,
+		    (size_t)(hp->nblk - bi - 1) * sizeof(*hp->blk));
+		if (--hp->nblk == hp->b0)
+			hp->nblk = hp->b0 = 0;
+	} else {
+		hp->blk[bi] = nb;
+		*v = nv;
+	}
+	if (str == NULL)
+		hp->cur--;
+	if (target == -1 ||
+	    history_pack_find(hp, target, &hp->cb, &hp->ck) == -1)
+		hp->cb = -1;
+	return 0;
+oomem:
+	he_seterrev(ev, _HE_MALLOC_FAILED);
+	return -1;
+}
+
+
+/* history_pack_first():
+ *	Return the first event in the packed history
+ */
+static int
+history_pack_first(void *p, TYPE(HistEvent) *ev)
+{
+	hpack_t *hp = p;
+
+	if (hp->cur == 0) {
+		hp->cb = -1;
+		he_seterrev(ev, _HE_FIRST_NOTFOUND);
 		return -1;
 	}
-	if (h->h_next == history_def_next)
-		history_def_clear(h->h_ref, &ev);
+	hp->cb = hp->nblk - 1;
+	hp->ck = hp->blk[hp->cb]->n - 1;
+	return history_pack_ev(hp, ev);
+}
 
-	h->h_ent = -1;
-	h->h_first = nh->h_first;
-	h->h_next = nh->h_next;
-	h->h_last = nh->h_last;
-	h->h_prev = nh->h_prev;
-	h->h_curr = nh->h_curr;
-	h->h_set = nh->h_set;
-	h->h_clear = nh->h_clear;
-	h->h_enter = nh->h_enter;
-	h->h_add = nh->h_add;
-	h->h_del = nh->h_del;
 
+/* history_pack_last():
+ *	Return the last event in the packed history
+ */
+static int
+history_pack_last(void *p, TYPE(HistEvent) *ev)
+{
+	hpack_t *hp = p;
+
+	if (hp->cur == 0) {
+		hp->cb = -1;
+		he_seterrev(ev, _HE_LAST_NOTFOUND);
+		return -1;
+	}
+	hp->cb = hp->b0;
+	hp->ck = hp->blk[hp->cb]->skip;
+	return history_pack_ev(hp, ev);
+}
+
+
+/* history_pack_next():
+ *	Return the next event in the packed history
+ */
+static int
+history_pack_next(void *p, TYPE(HistEvent) *ev)
+{
+	hpack_t *hp = p;
+
+	if (hp->cb == -1) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (history_pack_older(hp, &hp->cb, &hp->ck) == -1) {
+		he_seterrev(ev, _HE_END_REACHED);
+		return -1;
+	}
+	return history_pack_ev(hp, ev);
+}
+
+
+/* history_pack_prev():
+ *	Return the previous event in the packed history
+ */
+static int
+history_pack_prev(void *p, TYPE(HistEvent) *ev)
+{
+	hpack_t *hp = p;
+
+	if (hp->cb == -1) {
+		he_seterrev(ev,
+		    (hp->cur > 0) ? _HE_END_REACHED : _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (history_pack_newer(hp, &hp->cb, &hp->ck) == -1) {
+		he_seterrev(ev, _HE_START_REACHED);
+		return -1;
+	}
+	return history_pack_ev(hp, ev);
+}
+
+
+/* history_pack_curr():
+ *	Return the current event in the packed history
+ */
+static int
+history_pack_curr(void *p, TYPE(HistEvent) *ev)
+{
+	hpack_t *hp = p;
+
+	if (hp->cb == -1) {
+		he_seterrev(ev,
+		    (hp->cur > 0) ? _HE_CURR_INVALID : _HE_EMPTY_LIST);
+		return -1;
+	}
+	return history_pack_ev(hp, ev);
+}
+
+
+/* history_pack_set():
+ *	Make the event numbered n the current one
+ */
+static int
+history_pack_set(void *p, TYPE(HistEvent) *ev, const int n)
+{
+	hpack_t *hp = p;
+
+	if (hp->cur == 0) {
+		he_seterrev(ev, _HE_EMPTY_LIST);
+		return -1;
+	}
+	if (hp->cb != -1 && history_pack_num(hp, hp->cb, hp->ck) == n)
+		return 0;
+	if (history_pack_find(hp, n, &hp->cb, &hp->ck) == -1) {
+		hp->cb = -1;
+		he_seterrev(ev, _HE_NOT_FOUND);
+		return -1;
+	}
 	return 0;
 }
 
 
-/* history_load():
- *	TYPE(History) load function
+/* history_pack_enter():
+ *	Enter an event in the packed history
  */
 static int
-history_load(TYPE(History) *h, const char *fname)
+history_pack_enter(void *p, TYPE(HistEvent) *ev, const Char *str)
 {
-	FILE *fp;
-	char *line;
-	size_t llen;
-	ssize_t sz;
-	size_t max_size;
-	char *ptr;
-	int i = -1;
-	TYPE(HistEvent) ev;
-	Char *decode_result;
-#ifndef NARROWCHAR
-	static ct_buffer_t conv;
-#endif
+	hpack_t *hp = p;
+	hpview_t *v;
 
-	if ((fp = fopen(fname, "r")) == NULL)
-		return i;
+	if (hp->unique && hp->cur > 0 &&
+	    (v = history_pack_view(hp, hp->nblk - 1)) != NULL &&
+	    Strcmp(v->buf + v->off[v->blk->n - 1], str) == 0)
+		return 0;
 
-	line = NULL;
-	llen = 0;
-	if ((sz = getline(&line, &llen, fp)) == -1)
-		goto done;
+	if (history_pack_append(hp, str, hp->eventid + 1) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	hp->eventid++;
+	hp->cb = hp->nblk - 1;
+	hp->ck = hp->blk[hp->cb]->n - 1;
+	while (hp->cur > hp->max && hp->cur > 0)
+		history_pack_drop(hp);
+	if (hp->cb == -1) {
+		ev->num = hp->eventid;
+		ev->str = str;
+	} else if (history_pack_ev(hp, ev) == -1)
+		return -1;
+	return 1;
+}
 
-	if (strncmp(line, hist_cookie, (size_t)sz) != 0)
-		goto done;
 
-	ptr = h_malloc((max_size = 1024) * sizeof(*ptr));
-	if (ptr == NULL)
-		goto done;
-	for (i = 0; (sz = getline(&line, &llen, fp)) != -1; i++) {
-		if (sz > 0 && line[sz - 1] == '\n')
-			line[--sz] = '\0';
-		if (max_size < (size_t)sz) {
-			char *nptr;
-			max_size = ((size_t)sz + 1024) & (size_t)~1023;
-			nptr = h_realloc(ptr, max_size * sizeof(*ptr));
-			if (nptr == NULL) {
-				i = -1;
-				goto oomem;
-			}
-			ptr = nptr;
-		}
-		strunvis(ptr, line);
-		decode_result = ct_decode_string(ptr, &conv);
-		if (decode_result == NULL)
-			continue;
-		if (HENTER(h, &ev, decode_result) == -1) {
-			i = -1;
-			goto oomem;
-		}
+/* history_pack_add():
+ *	Append string to the current event
+ */
+static int
+history_pack_add(void *p, TYPE(HistEvent) *ev, const Char *str)
+{
+	hpack_t *hp = p;
+	TYPE(HistEvent) cev;
+	Char *s;
+	size_t elen, slen;
+	int retval;
+
+	if (hp->cb == -1)
+		return history_pack_enter(p, ev, str);
+	if (history_pack_ev(hp, &cev) == -1) {
+		*ev = cev;
+		return -1;
 	}
-oomem:
-	h_free(ptr);
-done:
-	free(line);
-	fclose(fp);
-	return i;
+	elen = Strlen(cev.str);
+	slen = Strlen(str);
+	if ((s = h_malloc((elen + slen + 1) * sizeof(*s))) == NULL) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	memcpy(s, cev.str, elen * sizeof(*s));
+	memcpy(s + elen, str, (slen + 1) * sizeof(*s));
+	retval = history_pack_recode(hp, ev, hp->cb, hp->ck, s);
+	h_free(s);
+	if (retval == -1)
+		return -1;
+	return history_pack_ev(hp, ev);
 }
 
 
-/* history_save_fp():
- *	TYPE(History) save function
+/* history_pack_del():
+ *	Delete the event numbered num, returning a copy of its string
  */
 static int
-history_save_fp(TYPE(History) *h, size_t nelem, FILE *fp)
+history_pack_del(void *p, TYPE(HistEvent) *ev, const int num)
+{
+	hpack_t *hp = p;
+	TYPE(HistEvent) cev;
+	Char *s;
+
+	if (history_pack_set(hp, ev, num) != 0)
+		return -1;
+	if (history_pack_ev(hp, &cev) == -1 ||
+	    (s = Strdup(cev.str)) == NULL) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	if (history_pack_recode(hp, ev, hp->cb, hp->ck, NULL) == -1) {
+		h_free(s);
+		return -1;
+	}
+	ev->str = s;
+	ev->num = num;
+	return 0;
+}
+
+
+/* history_pack_clear():
+ *	Drop all the events of the packed history
+ */
+static void
+history_pack_clear(void *p, TYPE(HistEvent) *ev libedit_unused)
+{
+	hpack_t *hp = p;
+	int i;
+
+	for (i = hp->b0; i < hp->nblk; i++)
+		history_pack_freeblk(hp, hp->blk[i]);
+	h_free(hp->blk);
+	history_pack_viewfree(hp, &hp->tail);
+	history_pack_viewfree(hp, &hp->view);
+	hp->blk = NULL;
+	hp->b0 = hp->nblk = hp->blksz = 0;
+	hp->cb = -1;
+	hp->cur = 0;
+	hp->eventid = 0;
+	hp->mem = 0;
+}
+
+
+/* history_pack_free():
+ *	Free the packed history
+ */
+static void
+history_pack_free(hpack_t *hp)
 {
 	TYPE(HistEvent) ev;
-	int i = -1, retval;
-	size_t len, max_size;
-	char *ptr;
-	const char *str;
-#ifndef NARROWCHAR
-	static ct_buffer_t conv;
-#endif
 
-	if (fchmod(fileno(fp), S_IREAD|S_IWRITE) == -1)
-		goto done;
-	if (ftell(fp) == 0 && fputs(hist_cookie, fp) == EOF)
-		goto done;
-	ptr = h_malloc((max_size = 1024) * sizeof(*ptr));
-	if (ptr == NULL)
-		goto done;
-	if (nelem != (size_t)-1) {
-		for (retval = HFIRST(h, &ev); retval != -1 && nelem-- > 0;
-		    retval = HNEXT(h, &ev))
-			continue;
-	} else
-		retval = -1;
+	history_pack_clear(hp, &ev);
+	h_free(hp);
+}
 
-	if (retval == -1)
-		retval = HLAST(h, &ev);
 
-	for (i = 0; retval != -1; retval = HPREV(h, &ev), i++) {
-		str = ct_encode_string(ev.str, &conv);
-		len = strlen(str) * 4 + 1;
-		if (len > max_size) {
-			char *nptr;
-			max_size = (len + 1024) & (size_t)~1023;
-			nptr = h_realloc(ptr, max_size * sizeof(*ptr));
-			if (nptr == NULL) {
-				i = -1;
-				goto oomem;
-			}
-			ptr = nptr;
-		}
-		strvis(ptr, str, VIS_WHITE);
-		fprintf(fp, "%s\n", ptr);
-	}
-oomem:
-	h_free(ptr);
-done:
-	return i;
+/* history_pack_ref():
+ *	Return the packed history of h, or NULL
+ */
+static hpack_t *
+history_pack_ref(TYPE(History) *h)
+{
+	if (h->h_next == history_pack_next)
+		return h->h_ref;
+	return NULL;
 }
 
 
-/* history_save():
- *    History save function
+/* history_pack_open():
+ *	Pack the events of the builtin history, and keep packing
+ *	them from now on.  The data of the events is lost.
  */
 static int
-history_save(TYPE(History) *h, const char *fname)
+history_pack_open(TYPE(History) *h, TYPE(HistEvent) *ev)
 {
-    FILE *fp;
-    int i;
+	TYPE(History) nh;
+	history_t *hd;
+	hpack_t *hp;
+	int i, ent = h->h_ent;
 
-    if ((fp = fopen(fname, "w")) == NULL)
+	if (h->h_next == history_pack_next)
+		return 0;
+	if (h->h_next != history_def_next) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	hd = h->h_ref;
+	if ((hp = h_malloc(sizeof(*hp))) == NULL)
+		goto oomem;
+	memset(hp, 0, sizeof(*hp));
+	hp->cb = -1;
+	hp->max = hd->max;
+	hp->unique = (hd->flags & (H_UNIQUE | H_ERASEDUPS)) != 0;
+	for (i = hd->cur - 1; i >= 0; i--)
+		if (history_pack_append(hp, HENT(hd, i)->ev.str,
+		    HENT(hd, i)->ev.num) == -1) {
+			history_pack_free(hp);
+			goto oomem;
+		}
+	hp->eventid = hd->eventid;
+	if (hd->cursor != -1 && history_pack_find(hp,
+	    HENT(hd, hd->cursor)->ev.num, &hp->cb, &hp->ck) == -1)
+		hp->cb = -1;
+
+	nh.h_ref = hp;
+	nh.h_first = history_pack_first;
+	nh.h_next = history_pack_next;
+	nh.h_last = history_pack_last;
+	nh.h_prev = history_pack_prev;
+	nh.h_curr = history_pack_curr;
+	nh.h_set = history_pack_set;
+	nh.h_clear = history_pack_clear;
+	nh.h_enter = history_pack_enter;
+	nh.h_add = history_pack_add;
+	nh.h_del = history_pack_del;
+	(void)history_set_fun(h, &nh);
+	h->h_ent = ent;
+	return 0;
+oomem:
+	he_seterrev(ev, _HE_MALLOC_FAILED);
 	return -1;
+}
 
-    i = history_save_fp(h, (size_t)-1, fp);
 
-    fclose(fp);
-    return i;
+/* history_pack_close():
+ *	Unpack the events into the builtin history again
+ */
+static int
+history_pack_close(TYPE(History) *h, TYPE(HistEvent) *ev)
+{
+	history_t *hd;
+	hpack_t *hp;
+	hpview_t *v;
+	int i, k, num = -1;
+
+	if (h->h_next != history_pack_next)
+		return 0;
+	hp = h->h_ref;
+	if (history_def_init((void **)&hd, ev, hp->max) == -1) {
+		he_seterrev(ev, _HE_MALLOC_FAILED);
+		return -1;
+	}
+	if (hp->unique)
+		hd->flags |= H_UNIQUE;
+	if (hp->cb != -1)
+		num = history_pack_num(hp, hp->cb, hp->ck);
+	for (i = hp->b0; i < hp->nblk; i++) {
+		if ((v = history_pack_view(hp, i)) == NULL)
+			goto oomem;
+		for (k = hp->blk[i]->skip; k < hp->blk[i]->n; k++) {
+			/* history_def_insert() numbers it */
+			hd->eventid = v->num[k] - 1;
+			if (history_def_insert(hd, ev, v->buf + v->off[k]) ==
+			    -1)
+				goto oomem;
+		}
+	}
+	hd->eventid = hp->eventid;
+	hd->cursor = num == -1 ? -1 : history_def_find(hd, num);
+	history_pack_free(hp);
+
+	h->h_ref = hd;
+	h->h_first = history_def_first;
+	h->h_next = history_def_next;
+	h->h_last = history_def_last;
+	h->h_prev = history_def_prev;
+	h->h_curr = history_def_curr;
+	h->h_set = history_def_set;
+	h->h_clear = history_def_clear;
+	h->h_enter = history_def_enter;
+	h->h_add = history_def_add;
+	h->h_del = history_def_del;
+	return 0;
+oomem:
+	history_def_clear(hd, ev);
+	h_free(hd);
+	he_seterrev(ev, _HE_MALLOC_FAILED);
+	return -1;
 }
 
 
@@ -894,8 +6127,12 @@ history_save(TYPE(History) *h, const char *fname)
 static int
 history_prev_event(TYPE(History) *h, TYPE(HistEvent) *ev, int num)
 {
+	history_t *hd;
 	int retval;
 
+	if ((hd = history_def_ref(h)) != NULL)
+		return history_def_seek(hd, ev, num, -1);
+
 	for (retval = HCURR(h, ev); retval != -1; retval = HPREV(h, ev))
 		if (ev->num == num)
 			return 0;
@@ -908,12 +6145,21 @@ history_prev_event(TYPE(History) *h, TYPE(HistEvent) *ev, int num)
 static int
 history_next_evdata(TYPE(History) *h, TYPE(HistEvent) *ev, int num, void **d)
 {
+	history_t *hd;
 	int retval;
 
+	if ((hd = history_def_ref(h)) != NULL) {
+		if (history_def_seek(hd, ev, num, -1) == -1)
+			return -1;
+		if (d)
+			*d = HENT(hd, hd->cursor)->data;
+		return 0;
+	}
+
 	for (retval = HCURR(h, ev); retval != -1; retval = HPREV(h, ev))
 		if (ev->num == num) {
 			if (d)
-				*d = ((history_t *)h->h_ref)->cursor->data;
+				*d = NULL;
 			return 0;
 		}
 
@@ -928,8 +6174,12 @@ history_next_evdata(TYPE(History) *h, TYPE(HistEvent) *ev, int num, void **d)
 static int
 history_next_event(TYPE(History) *h, TYPE(HistEvent) *ev, int num)
 {
+	history_t *hd;
 	int retval;
 
+	if ((hd = history_def_ref(h)) != NULL)
+		return history_def_seek(hd, ev, num, 1);
+
 	for (retval = HCURR(h, ev); retval != -1; retval = HNEXT(h, ev))
 		if (ev->num == num)
 			return 0;
@@ -939,15 +6189,41 @@ history_next_event(TYPE(History) *h, TYPE(HistEvent) *ev, int num)
 }
 
 
+/* history_nth():
+ *	Find the n-th event counting from the first
+ */
+static int
+history_nth(TYPE(History) *h, TYPE(HistEvent) *ev, int n)
+{
+	history_t *hd;
+	int retval;
+
+	if ((hd = history_def_ref(h)) != NULL)
+		return history_def_nth(hd, ev, n);
+
+	if (n < 0) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	for (retval = HFIRST(h, ev); retval != -1 && n > 0; n--)
+		retval = HNEXT(h, ev);
+	return retval;
+}
+
+
 /* history_prev_string():
  *	Find the previous event beginning with string
  */
 static int
 history_prev_string(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str)
 {
+	history_t *hd = history_def_ref(h);
 	size_t len = Strlen(str);
 	int retval;
 
+	if (hd != NULL && hd->trie != NULL)
+		return history_def_prefix(hd, ev, str, 1);
+
 	for (retval = HCURR(h, ev); retval != -1; retval = HNEXT(h, ev))
 		if (Strncmp(str, ev->str, len) == 0)
 			return 0;
@@ -963,9 +6239,13 @@ history_prev_string(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str)
 static int
 history_next_string(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str)
 {
+	history_t *hd = history_def_ref(h);
 	size_t len = Strlen(str);
 	int retval;
 
+	if (hd != NULL && hd->trie != NULL)
+		return history_def_prefix(hd, ev, str, -1);
+
 	for (retval = HCURR(h, ev); retval != -1; retval = HPREV(h, ev))
 		if (Strncmp(str, ev->str, len) == 0)
 			return 0;
@@ -975,6 +6255,151 @@ history_next_string(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str)
 }
 
 
+/* history_substr():
+ *	Find the nearest event containing string, looking from the
+ *	current one towards older (dir > 0) or newer (dir < 0) events.
+ *	If off is not NULL it is set to the distance from the current
+ *	event, or -1 if no event contains string.
+ */
+static int
+history_substr(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str,
+    int dir, int *off)
+{
+	history_t *hd;
+	int retval, n;
+
+	if (str == NULL) {
+		he_seterrev(ev, _HE_PARAM_MISSING);
+		return -1;
+	}
+	if ((hd = history_def_ref(h)) != NULL)
+		return history_def_substr(hd, ev, str, dir, off);
+
+	for (n = 0, retval = HCURR(h, ev); retval != -1;
+	    retval = dir > 0 ? HNEXT(h, ev) : HPREV(h, ev), n++)
+		if (Strstr(ev->str, str) != NULL) {
+			if (off)
+				*off = n;
+			return 0;
+		}
+
+	if (off)
+		*off = -1;
+	he_seterrev(ev, _HE_NOT_FOUND);
+	return -1;
+}
+
+
+#ifdef REGEX
+/* history_regex():
+ *	Find the nearest event containing str or matching it as a basic
+ *	regular expression, the way interactive searches do
+ */
+static int
+history_regex(TYPE(History) *h, TYPE(HistEvent) *ev, const Char *str,
+    int dir, int *off)
+{
+	history_t *hd;
+
+	if (str == NULL) {
+		he_seterrev(ev, _HE_PARAM_MISSING);
+		return -1;
+	}
+	if ((hd = history_def_ref(h)) == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+	return history_def_regex(hd, ev, str, dir, off);
+}
+#endif
+
+
+/* history_enter_batch():
+ *	Enter the n strings of str, oldest first, as if each was
+ *	entered in turn, and give the i-th event data[i] if data is
+ *	not NULL.  Unless older duplicates are erased, the builtin
+ *	history skips the strings and drops the events that would
+ *	only be dropped again to keep it within its size up front,
+ *	and sizes its ring once.  Returns the number of events entered,
+ *	not counting skipped duplicates.
+ */
+static int
+history_enter_batch(TYPE(History) *h, TYPE(HistEvent) *ev,
+    const Char * const *str, void * const *data, int n)
+{
+	history_t *hd = h->h_next == history_def_next ? h->h_ref : NULL;
+	size_t len = 0;
+	int i, first = 0, kept, need, uni, retval, count = 0;
+
+	if (n < 0 || (n > 0 && str == NULL)) {
+		he_seterrev(ev, _HE_BAD_PARAM);
+		return -1;
+	}
+	if (data != NULL && hd == NULL) {
+		he_seterrev(ev, _HE_NOT_ALLOWED);
+		return -1;
+	}
+/* Would str[i] be skipped as equal to the newest event then? */
+#define	BATCH_DUP(i)	(uni && ((i) > 0 ? hd->max > 0 && \
+	Strcmp(str[i], str[(i) - 1]) == 0 : \
+	hd->cur > 0 && Strcmp(str[0], HENT(hd, 0)->ev.str) == 0))
+
+	if (hd != NULL && (hd->flags & H_ERASEDUPS) == 0 &&
+	    n > hd->max - hd->cur) {
+		uni = (hd->flags & H_UNIQUE) != 0;
+		for (kept = 0, first = n; first > 0 && kept < hd->max; first--)
+			if (!BATCH_DUP(first - 1))
+				kept++;
+		for (i = 0; i < first; i++)
+			if (!BATCH_DUP(i))
+				count++;
+		while (first < n && BATCH_DUP(first))
+			first++;
+		hd->eventid += count;
+		while (hd->cur > 0 && hd->cur + kept > hd->max)
+			history_def_delete(hd, ev, hd->cur - 1);
+	} else
+		kept = n;
+	if (hd != NULL) {
+		need = kept < hd->max - hd->cur ? hd->cur + kept : hd->max;
+		while (hd->nslots < need)
+			if (history_def_grow(hd) == -1) {
+				he_seterrev(ev, _HE_MALLOC_FAILED);
+				return -1;
+			}
+	}
+#undef	BATCH_DUP
+
+	for (i = first; i < n; i++) {
+		if ((retval = HENTER(h, ev, str[i])) == -1)
+			return -1;
+		/* the builtin histories return 0 for a skipped duplicate */
+		if (retval == 0 && (hd != NULL ||
+		    h->h_next == history_pack_next || history_is_mapped(h)))
+			continue;
+		count++;
+		h->h_ent = ev->num;
+		if (data != NULL)
+			HENT(hd, 0)->data = data[i];
+		if (h->h_jfd == -1)
+			continue;
+		if (history_journal_add(h, ev->str, &len) == -1 ||
+		    (len >= H_JOURNAL_BATCH &&
+		    history_journal_flush(h, len) == -1)) {
+			he_seterrev(ev, _HE_HIST_WRITE);
+			return -1;
+		}
+		if (len >= H_JOURNAL_BATCH)
+			len = 0;
+	}
+	if (h->h_jfd != -1 && history_journal_flush(h, len) == -1) {
+		he_seterrev(ev, _HE_HIST_WRITE);
+		return -1;
+	}
+	return count;
+}
+
+
 /* history():
  *	User interface to history functions.
  */
@@ -1006,6 +6431,22 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 		retval = history_setunique(h, ev, va_arg(va, int));
 		break;
 
+	case H_GETMEM:
+		retval = history_getmem(h, ev, va_arg(va, size_t *));
+		break;
+
+	case H_GETBYTES:
+		retval = history_getbytes(h, ev, va_arg(va, size_t *));
+		break;
+
+	case H_GETGEN:
+	{
+		unsigned long *gen = va_arg(va, unsigned long *);
+		retval = history_getgen(h, ev, gen,
+		    va_arg(va, unsigned long *));
+		break;
+	}
+
 	case H_ADD:
 		str = va_arg(va, const Char *);
 		retval = HADD(h, ev, str);
@@ -1019,7 +6460,24 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 		str = va_arg(va, const Char *);
 		if ((retval = HENTER(h, ev, str)) != -1)
 			h->h_ent = ev->num;
+		/* the builtin histories return 0 for a skipped duplicate */
+		if (h->h_jfd != -1 && (retval > 0 ||
+		    (retval == 0 && h->h_next != history_def_next &&
+		    h->h_next != history_pack_next && !history_is_mapped(h))) &&
+		    history_journal_enter(h, ev->str) == -1) {
+			he_seterrev(ev, _HE_HIST_WRITE);
+			retval = -1;
+		}
+		break;
+
+	case H_ENTER_BATCH:
+	{
+		const Char * const *strs = va_arg(va, const Char * const *);
+		void * const *data = va_arg(va, void * const *);
+		retval = history_enter_batch(h, ev, strs, data,
+		    va_arg(va, int));
 		break;
+	}
 
 	case H_APPEND:
 		str = va_arg(va, const Char *);
@@ -1083,6 +6541,67 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 		break;
 	}
 
+	case H_JOURNAL:
+		retval = history_journal(h, va_arg(va, const char *));
+		if (retval == -1)
+			he_seterrev(ev, _HE_HIST_WRITE);
+		break;
+
+	case H_COMPACT:
+		retval = history_compact(h);
+		if (retval == -1)
+			he_seterrev(ev, _HE_HIST_WRITE);
+		break;
+
+	case H_ASYNC:
+		if (va_arg(va, int)) {
+			if (h->h_writer != NULL)
+				retval = 0;
+			else if ((retval = history_writer_start(h)) == -1)
+				he_seterrev(ev, _HE_NOT_ALLOWED);
+		} else if ((retval = history_writer_stop(h)) == -1)
+			he_seterrev(ev, _HE_HIST_WRITE);
+		break;
+
+	case H_COMPRESS:
+		if (va_arg(va, int))
+			retval = history_pack_open(h, ev);
+		else
+			retval = history_pack_close(h, ev);
+		break;
+
+	case H_MAPPED:
+	{
+		const char *fname = va_arg(va, const char *);
+		if (fname == NULL)
+			retval = history_map_close(h, ev);
+		else
+			retval = history_map_open(h, ev, fname);
+		break;
+	}
+
+	case H_LOADTHREADS:
+		if ((retval = va_arg(va, int)) < 0) {
+			he_seterrev(ev, _HE_BAD_PARAM);
+			retval = -1;
+		} else {
+			h->h_lthreads = retval;
+			retval = 0;
+		}
+		break;
+
+	case H_SHARED:
+	{
+		const char *fname = va_arg(va, const char *);
+		int size = va_arg(va, int);
+		if (fname == NULL) {
+			history_ring_close(h);
+			retval = 0;
+		} else
+			retval = history_ring_open(h, ev, fname, size);
+		break;
+	}
+
 	case H_PREV_EVENT:
 		retval = history_prev_event(h, ev, va_arg(va, int));
 		break;
@@ -1091,6 +6610,10 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 		retval = history_next_event(h, ev, va_arg(va, int));
 		break;
 
+	case H_NTH:
+		retval = history_nth(h, ev, va_arg(va, int));
+		break;
+
 	case H_PREV_STR:
 		retval = history_prev_string(h, ev, va_arg(va, const Char *));
 		break;
@@ -1099,6 +6622,40 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 		retval = history_next_string(h, ev, va_arg(va, const Char *));
 		break;
 
+	case H_PREV_SUBSTR:
+	case H_NEXT_SUBSTR:
+	{
+		const Char *s = va_arg(va, const Char *);
+		int *off = va_arg(va, int *);
+		retval = history_substr(h, ev, s,
+		    fun == H_PREV_SUBSTR ? 1 : -1, off);
+		break;
+	}
+
+#ifdef REGEX
+	case H_PREV_REGEX:
+	case H_NEXT_REGEX:
+	{
+		const Char *s = va_arg(va, const Char *);
+		int *off = va_arg(va, int *);
+		retval = history_regex(h, ev, s,
+		    fun == H_PREV_REGEX ? 1 : -1, off);
+		break;
+	}
+#endif
+
+	case H_SETINDEX:
+		retval = history_setindex(h, ev, va_arg(va, int));
+		break;
+
+	case H_SETBYTES:
+		retval = history_setbytes(h, ev, va_arg(va, size_t));
+		break;
+
+	case H_FRECENCY:
+		retval = history_setfrecency(h, ev, va_arg(va, int));
+		break;
+
 	case H_FUNC:
 	{
 		TYPE(History) hf;
@@ -1138,7 +6695,13 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 	{
 		int num = va_arg(va, int);
 		void **d = va_arg(va, void **);
-		retval = history_deldata_nth((history_t *)h->h_ref, ev, num, d);
+		history_t *hd = history_def_ref(h);
+		if (hd == NULL) {
+			he_seterrev(ev, _HE_NOT_ALLOWED);
+			retval = -1;
+			break;
+		}
+		retval = history_deldata_nth(hd, ev, num, d);
 		break;
 	}
 
@@ -1146,13 +6709,11 @@ FUNW(history)(TYPE(History) *h, TYPE(HistEvent) *ev, int fun, ...)
 	{
 		const Char *line = va_arg(va, const Char *);
 		void *d = va_arg(va, void *);
-		const Char *s;
-		if(!line || !(s = Strdup(line))) {
+		history_t *hd = history_def_ref(h);
+		if(!line || !hd || history_def_replace(hd, line, d) == -1) {
 			retval = -1;
 			break;
 		}
-		((history_t *)h->h_ref)->cursor->ev.str = s;
-		((history_t *)h->h_ref)->cursor->data = d;
 		retval = 0;
 		break;
 	}
@@ -20,5 +20,6 @@ libedit_private el_action_t	em_toggle_overwrite (EditLine *, wint_t);
 libedit_private el_action_t	em_copy_prev_word (EditLine *, wint_t);
 libedit_private el_action_t	em_inc_search_next (EditLine *, wint_t);
 libedit_private el_action_t	em_inc_search_prev (EditLine *, wint_t);
+libedit_private el_action_t	em_fuzzy_search (EditLine *, wint_t);
 libedit_private el_action_t	em_delete_prev_char (EditLine *, wint_t);
 #endif /* _h_emacs_c */
@@ -35,64 +35,65 @@
 #define	EM_DELETE_OR_LIST             	 33
 #define	EM_DELETE_PREV_CHAR           	 34
 #define	EM_EXCHANGE_MARK              	 35
-#define	EM_GOSMACS_TRANSPOSE          	 36
-#define	EM_INC_SEARCH_NEXT            	 37
-#define	EM_INC_SEARCH_PREV            	 38
-#define	EM_KILL_LINE                  	 39
-#define	EM_KILL_REGION                	 40
-#define	EM_LOWER_CASE                 	 41
-#define	EM_META_NEXT                  	 42
-#define	EM_NEXT_WORD                  	 43
-#define	EM_SET_MARK                   	 44
-#define	EM_TOGGLE_OVERWRITE           	 45
-#define	EM_UNIVERSAL_ARGUMENT         	 46
-#define	EM_UPPER_CASE                 	 47
-#define	EM_YANK                       	 48
-#define	VI_ADD                        	 49
-#define	VI_ADD_AT_EOL                 	 50
-#define	VI_ALIAS                      	 51
-#define	VI_CHANGE_CASE                	 52
-#define	VI_CHANGE_META                	 53
-#define	VI_CHANGE_TO_EOL              	 54
-#define	VI_COMMAND_MODE               	 55
-#define	VI_COMMENT_OUT                	 56
-#define	VI_DELETE_META                	 57
-#define	VI_DELETE_PREV_CHAR           	 58
-#define	VI_END_BIG_WORD               	 59
-#define	VI_END_WORD                   	 60
-#define	VI_HISTEDIT                   	 61
-#define	VI_HISTORY_WORD               	 62
-#define	VI_INSERT                     	 63
-#define	VI_INSERT_AT_BOL              	 64
-#define	VI_KILL_LINE_PREV             	 65
-#define	VI_LIST_OR_EOF                	 66
-#define	VI_MATCH                      	 67
-#define	VI_NEXT_BIG_WORD              	 68
-#define	VI_NEXT_CHAR                  	 69
-#define	VI_NEXT_WORD                  	 70
-#define	VI_PASTE_NEXT                 	 71
-#define	VI_PASTE_PREV                 	 72
-#define	VI_PREV_BIG_WORD              	 73
-#define	VI_PREV_CHAR                  	 74
-#define	VI_PREV_WORD                  	 75
-#define	VI_REDO                       	 76
-#define	VI_REPEAT_NEXT_CHAR           	 77
-#define	VI_REPEAT_PREV_CHAR           	 78
-#define	VI_REPEAT_SEARCH_NEXT         	 79
-#define	VI_REPEAT_SEARCH_PREV         	 80
-#define	VI_REPLACE_CHAR               	 81
-#define	VI_REPLACE_MODE               	 82
-#define	VI_SEARCH_NEXT                	 83
-#define	VI_SEARCH_PREV                	 84
-#define	VI_SUBSTITUTE_CHAR            	 85
-#define	VI_SUBSTITUTE_LINE            	 86
-#define	VI_TO_COLUMN                  	 87
-#define	VI_TO_HISTORY_LINE            	 88
-#define	VI_TO_NEXT_CHAR               	 89
-#define	VI_TO_PREV_CHAR               	 90
-#define	VI_UNDO                       	 91
-#define	VI_UNDO_LINE                  	 92
-#define	VI_YANK                       	 93
-#define	VI_YANK_END                   	 94
-#define	VI_ZERO                       	 95
-#define	EL_NUM_FCNS                   	 96
+#define	EM_FUZZY_SEARCH               	 36
+#define	EM_GOSMACS_TRANSPOSE          	 37
+#define	EM_INC_SEARCH_NEXT            	 38
+#define	EM_INC_SEARCH_PREV            	 39
+#define	EM_KILL_LINE                  	 40
+#define	EM_KILL_REGION                	 41
+#define	EM_LOWER_CASE                 	 42
+#define	EM_META_NEXT                  	 43
+#define	EM_NEXT_WORD                  	 44
+#define	EM_SET_MARK                   	 45
+#define	EM_TOGGLE_OVERWRITE           	 46
+#define	EM_UNIVERSAL_ARGUMENT         	 47
+#define	EM_UPPER_CASE                 	 48
+#define	EM_YANK                       	 49
+#define	VI_ADD                        	 50
+#define	VI_ADD_AT_EOL                 	 51
+#define	VI_ALIAS                      	 52
+#define	VI_CHANGE_CASE                	 53
+#define	VI_CHANGE_META                	 54
+#define	VI_CHANGE_TO_EOL              	 55
+#define	VI_COMMAND_MODE               	 56
+#define	VI_COMMENT_OUT                	 57
+#define	VI_DELETE_META                	 58
+#define	VI_DELETE_PREV_CHAR           	 59
+#define	VI_END_BIG_WORD               	 60
+#define	VI_END_WORD                   	 61
+#define	VI_HISTEDIT                   	 62
+#define	VI_HISTORY_WORD               	 63
+#define	VI_INSERT                     	 64
+#define	VI_INSERT_AT_BOL              	 65
+#define	VI_KILL_LINE_PREV             	 66
+#define	VI_LIST_OR_EOF                	 67
+#define	VI_MATCH                      	 68
+#define	VI_NEXT_BIG_WORD              	 69
+#define	VI_NEXT_CHAR                  	 70
+#define	VI_NEXT_WORD                  	 71
+#define	VI_PASTE_NEXT                 	 72
+#define	VI_PASTE_PREV                 	 73
+#define	VI_PREV_BIG_WORD              	 74
+#define	VI_PREV_CHAR                  	 75
+#define	VI_PREV_WORD                  	 76
+#define	VI_REDO                       	 77
+#define	VI_REPEAT_NEXT_CHAR           	 78
+#define	VI_REPEAT_PREV_CHAR           	 79
+#define	VI_REPEAT_SEARCH_NEXT         	 80
+#define	VI_REPEAT_SEARCH_PREV         	 81
+#define	VI_REPLACE_CHAR               	 82
+#define	VI_REPLACE_MODE               	 83
+#define	VI_SEARCH_NEXT                	 84
+#define	VI_SEARCH_PREV                	 85
+#define	VI_SUBSTITUTE_CHAR            	 86
+#define	VI_SUBSTITUTE_LINE            	 87
+#define	VI_TO_COLUMN                  	 88
+#define	VI_TO_HISTORY_LINE            	 89
+#define	VI_TO_NEXT_CHAR               	 90
+#define	VI_TO_PREV_CHAR               	 91
+#define	VI_UNDO                       	 92
+#define	VI_UNDO_LINE                  	 93
+#define	VI_YANK                       	 94
+#define	VI_YANK_END                   	 95
+#define	VI_ZERO                       	 96
+#define	EL_NUM_FCNS                   	 97
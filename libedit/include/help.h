@@ -132,6 +132,8 @@ static const struct el_bindings_t el_func_help[] = {
       L"Emacs incremental next search" },
     { L"em-inc-search-prev",         EM_INC_SEARCH_PREV,           
       L"Emacs incremental reverse search" },
+    { L"em-fuzzy-search",            EM_FUZZY_SEARCH,              
+      L"Emacs fuzzy history search" },
     { L"em-delete-prev-char",        EM_DELETE_PREV_CHAR,          
       L"Delete the character to the left of the cursor" },
     { L"ed-end-of-file",             ED_END_OF_FILE,               
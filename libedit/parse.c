@@ -97,6 +97,8 @@ el_wparse(EditLine *el, int argc, const wchar_t *argv[])
 
 	if (argc < 1)
 		return -1;
+	/* the builtins print through stdio */
+	terminal__flush(el);
 	ptr = wcschr(argv[0], L':');
 	if (ptr != NULL) {
 		wchar_t *tprog;
@@ -131,6 +131,32 @@ el_read_getfn(struct el_read_t *el_read)
 }
 
 
+/* read_pending():
+ *	Return 1 if a character is waiting to be read, 0 if none is,
+ *	or -1 if that cannot be told without reading, as when a read
+ *	function has been set with EL_GETCFN
+ */
+libedit_private int
+read_pending(EditLine *el)
+{
+#ifdef FIONREAD
+	int chrs = 0;
+#endif
+
+	if (el->el_read->macros.level >= 0)
+		return 1;
+	if (el->el_read->read_char != read_char)
+		return -1;
+#ifdef FIONREAD
+	if (ioctl(el->el_infd, FIONREAD, &chrs) == -1)
+		return -1;
+	return chrs > 0;
+#else
+	return -1;
+#endif
+}
+
+
 /* read__fixio():
  *	Try to recover from a read error
  */
@@ -183,6 +183,7 @@ static char		*_rl_compat_sub(const char *, const char *,
     const char *, int);
 static int		 _rl_event_read_char(EditLine *, wchar_t *);
 static void		 _rl_update_pos(void);
+static void		 _history_list_reset(void);
 
 static HIST_ENTRY rl_he;
 
@@ -305,6 +306,7 @@ rl_initialize(void)
 		el_end(e);
 	if (h != NULL)
 		history_end(h);
+	_history_list_reset();
 
 	RL_UNSETSTATE(RL_STATE_DONE);
 
@@ -1605,18 +1607,20 @@ replace_history_entry(int num, const char *line, histdata_t data)
 	if (history(h, &ev, H_NEXT_EVDATA, num, &he->data))
 		goto out;
 
-	he->line = ev.str;
-	if (he->line == NULL)
+	/* the history owns ev.str and releases it on H_REPLACE */
+	if (ev.str == NULL || (he->line = strdup(ev.str)) == NULL)
 		goto out;
 
 	if (history(h, &ev, H_REPLACE, line, data))
-		goto out;
+		goto out1;
 
 	/* restore pointer to where it was */
 	if (history(h, &ev, H_SET, curr_num))
-		goto out;
+		goto out1;
 
 	return he;
+out1:
+	el_free((void *)(intptr_t)he->line);
 out:
 	el_free(he);
 	return NULL;
@@ -1647,39 +1651,145 @@ where_history(void)
 	return history_offset;
 }
 
+/*
+ * The history_list() snapshot is entries _history_listoff up to
+ * _history_listoff + _history_listn of these arrays, oldest first,
+ * as of history generation _history_listgen.  Entering events only
+ * appends to it and dropping the oldest ones only moves its start.
+ */
 static HIST_ENTRY **_history_listp;
 static HIST_ENTRY *_history_list;
+static int *_history_listev;
+static int _history_listoff, _history_listn, _history_listsz;
+static unsigned long _history_listgen = ULONG_MAX;
 
-HIST_ENTRY **
-history_list(void)
+static void
+_history_list_reset(void)
+{
+	_history_listoff = _history_listn = 0;
+	_history_listgen = ULONG_MAX;
+}
+
+/*
+ * make room for n entries after the snapshot
+ */
+static int
+_history_list_grow(int n)
 {
-	HistEvent ev;
 	HIST_ENTRY **nlp, *nl;
-	int i;
+	int *nev, i, sz;
+
+	if (_history_listoff + _history_listn + n < _history_listsz)
+		return 0;
+	if (_history_listoff > 0) {
+		memmove(_history_list, _history_list + _history_listoff,
+		    (size_t)_history_listn * sizeof(*_history_list));
+		memmove(_history_listev, _history_listev + _history_listoff,
+		    (size_t)_history_listn * sizeof(*_history_listev));
+		_history_listoff = 0;
+	}
+	if (_history_listn + n >= _history_listsz) {
+		if (_history_listn + n >= INT_MAX / 2)
+			return -1;
+		sz = 2 * (_history_listn + n) + 16;
+		if ((nlp = el_realloc(_history_listp,
+		    (size_t)sz * sizeof(*nlp))) == NULL)
+			return -1;
+		_history_listp = nlp;
+		if ((nl = el_realloc(_history_list,
+		    (size_t)sz * sizeof(*nl))) == NULL)
+			return -1;
+		_history_list = nl;
+		if ((nev = el_realloc(_history_listev,
+		    (size_t)sz * sizeof(*nev))) == NULL)
+			return -1;
+		_history_listev = nev;
+		_history_listsz = sz;
+	}
+	for (i = 0; i < _history_listn; i++)
+		_history_listp[i] = &_history_list[i];
+	return 0;
+}
+
+/*
+ * append the current event to the snapshot
+ */
+static void
+_history_list_add(const HistEvent *ev)
+{
+	int i = _history_listoff + _history_listn++;
+
+	_history_listp[i] = &_history_list[i];
+	_history_list[i].line = ev->str;
+	_history_list[i].data = NULL;
+	_history_listev[i] = ev->num;
+}
+
+/*
+ * bring the snapshot up to date with the events entered since it
+ * was taken, returning -1 if it has to be taken again
+ */
+static int
+_history_list_update(void)
+{
+	HistEvent ev;
+	int *lev = _history_listev + _history_listoff;
+	int n, newest;
 
 	if (history(h, &ev, H_LAST) != 0)
-		return NULL;
+		return -1;
+	for (n = 0; n < _history_listn && lev[n] < ev.num; n++)
+		continue;
+	if (n == _history_listn)
+		return -1;
+	_history_listoff += n;
+	_history_listn -= n;
+	newest = _history_listev[_history_listoff + _history_listn - 1];
 
-	if ((nlp = el_realloc(_history_listp,
-	    ((size_t)history_length + 1) * sizeof(*nlp))) == NULL)
-		return NULL;
-	_history_listp = nlp;
+	if (history(h, &ev, H_FIRST) != 0)
+		return -1;
+	for (n = 0; ev.num != newest; n++)
+		if (ev.num < newest || history(h, &ev, H_NEXT) != 0)
+			return -1;
+	if (_history_list_grow(n) == -1)
+		return -1;
+	while (n-- > 0) {
+		if (history(h, &ev, H_PREV) != 0)
+			return -1;
+		_history_list_add(&ev);
+	}
+	return 0;
+}
 
-	if ((nl = el_realloc(_history_list,
-	    (size_t)history_length * sizeof(*nl))) == NULL)
-		return NULL;
-	_history_list = nl;
+HIST_ENTRY **
+history_list(void)
+{
+	HistEvent ev;
+	unsigned long gen, mgen;
+
+	if (history(h, &ev, H_GETGEN, &gen, &mgen) == -1)
+		gen = mgen = ULONG_MAX;		/* not ours, no snapshots */
+	else if (_history_listgen != ULONG_MAX && _history_listn > 0) {
+		if (gen == _history_listgen)
+			goto out;
+		if (mgen <= _history_listgen && _history_list_update() == 0)
+			goto out;
+	}
 
-	i = 0;
+	_history_list_reset();
+	if (history(h, &ev, H_LAST) != 0)
+		return NULL;
 	do {
-		_history_listp[i] = &_history_list[i];
-		_history_list[i].line = ev.str;
-		_history_list[i].data = NULL;
-		if (i++ == history_length)
-			abort();
+		if (_history_list_grow(1) == -1) {
+			_history_list_reset();
+			return NULL;
+		}
+		_history_list_add(&ev);
 	} while (history(h, &ev, H_PREV) == 0);
-	_history_listp[i] = NULL;
-	return _history_listp;
+out:
+	_history_listgen = gen;
+	_history_listp[_history_listoff + _history_listn] = NULL;
+	return _history_listp + _history_listoff;
 }
 
 /*
@@ -1709,6 +1819,9 @@ history_total_bytes(void)
 	int curr_num;
 	size_t size;
 
+	if (history(h, &ev, H_GETBYTES, &size) == 0)
+		return (int)size;
+
 	if (history(h, &ev, H_CURR) != 0)
 		return -1;
 	curr_num = ev.num;
@@ -1779,6 +1892,22 @@ next_history(void)
 }
 
 
+/*
+ * turn the search indexes on once the history is long enough for
+ * the searches to pay for keeping them up to date on every entry
+ */
+#define	HISTORY_INDEXMIN	16384
+
+static void
+_history_index(void)
+{
+	HistEvent ev;
+
+	if (history_length >= HISTORY_INDEXMIN)
+		(void)history(h, &ev, H_SETINDEX, 1);
+}
+
+
 /*
  * searches for first history event containing the str
  */
@@ -1786,19 +1915,16 @@ int
 history_search(const char *str, int direction)
 {
 	HistEvent ev;
-	const char *strp;
 	int curr_num;
 
+	_history_index();
 	if (history(h, &ev, H_CURR) != 0)
 		return -1;
 	curr_num = ev.num;
 
-	for (;;) {
-		if ((strp = strstr(ev.str, str)) != NULL)
-			return (int)(strp - ev.str);
-		if (history(h, &ev, direction < 0 ? H_NEXT:H_PREV) != 0)
-			break;
-	}
+	if (history(h, &ev, direction < 0 ? H_PREV_SUBSTR : H_NEXT_SUBSTR,
+	    str, NULL) == 0)
+		return (int)(strstr(ev.str, str) - ev.str);
 	(void)history(h, &ev, H_SET, curr_num);
 	return -1;
 }
@@ -1812,6 +1938,7 @@ history_search_prefix(const char *str, int direction)
 {
 	HistEvent ev;
 
+	_history_index();
 	return (history(h, &ev, direction < 0 ?
 	    H_PREV_STR : H_NEXT_STR, str));
 }
@@ -1830,6 +1957,7 @@ history_search_pos(const char *str, int direction libedit_unused, int pos)
 	off = (pos > 0) ? pos : -pos;
 	pos = (pos > 0) ? 1 : -1;
 
+	_history_index();
 	if (history(h, &ev, H_CURR) != 0)
 		return -1;
 	curr_num = ev.num;
@@ -1837,12 +1965,9 @@ history_search_pos(const char *str, int direction libedit_unused, int pos)
 	if (!history_set_pos(off) || history(h, &ev, H_CURR) != 0)
 		return -1;
 
-	for (;;) {
-		if (strstr(ev.str, str))
-			return off;
-		if (history(h, &ev, (pos < 0) ? H_PREV : H_NEXT) != 0)
-			break;
-	}
+	if (history(h, &ev, (pos < 0) ? H_NEXT_SUBSTR : H_PREV_SUBSTR,
+	    str, NULL) == 0)
+		return off;
 
 	/* set "current" pointer back to previous state */
 	(void)history(h, &ev,
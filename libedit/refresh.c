@@ -37,6 +37,7 @@
 /*
  * refresh.c: Lower level screen refreshing functions
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,9 +51,33 @@ static void	re_update_line(EditLine *, wchar_t *, wchar_t *, int);
 static void	re_insert (EditLine *, wchar_t *, int, int, wchar_t *, int);
 static void	re_delete(EditLine *, wchar_t *, int, int, int);
 static void	re_fastputc(EditLine *, wint_t);
-static void	re_clear_eol(EditLine *, int, int, int);
+static void	re_clear_eol(EditLine *, int, int, int, int);
 static void	re__strncopy(wchar_t *, wchar_t *, size_t);
 static void	re__copy_and_pad(wchar_t *, const wchar_t *, size_t);
+static size_t	re__samelen(const wchar_t *, const wchar_t *, size_t);
+static size_t	re__sametail(const wchar_t *, const wchar_t *, size_t);
+static wchar_t	*re__trimblanks(wchar_t *, wchar_t *);
+static int	re_layout_alloc(EditLine *);
+static size_t	re_unchanged(EditLine *);
+static int	re_save_line(EditLine *, size_t);
+static int	re_backup(EditLine *, int);
+static void	re_markcut(EditLine *, int);
+static void	re_ltrunc(EditLine *, size_t);
+static const wchar_t *re_lpos(EditLine *, const wchar_t *, coord_t *, int);
+
+/*
+ * re_refresh_cursor() keeps where every RE_LSTEP'th char of the window
+ * lays out, so that finding the cursor never walks more than that.
+ */
+#define	RE_LSTEP	64
+
+/*
+ * The row scans compare RE_BLOCK chars at a time with wmemcmp(), which
+ * the C library vectorizes for the machine it runs on, and only look
+ * at single chars within the block that differs.
+ */
+#define	RE_BLOCK	16
+static const wchar_t re_blanks[RE_BLOCK + 1] = L"                ";
 
 #ifdef DEBUG_REFRESH
 static void	re_printstr(EditLine *, const char *, wchar_t *, wchar_t *);
@@ -104,6 +129,8 @@ re_nextline(EditLine *el)
 
 		firstline[0] = '\0';		/* empty the string */
 		el->el_vdisplay[i - 1] = firstline;
+		/* row numbers no longer match the layout checkpoints */
+		el->el_refresh.r_scrolled = 1;
 	} else
 		el->el_refresh.r_cursor.v++;
 
@@ -226,12 +253,12 @@ re_putc(EditLine *el, wint_t c, int shift)
 libedit_private void
 re_refresh(EditLine *el)
 {
-	int i, rhdiff;
+	el_refresh_t *re = &el->el_refresh;
+	int i, rhdiff, rec, resume, first, lastv;
+	int sizeh, vmax, vs, cut, retry;
 	wchar_t *cp, *st;
 	coord_t cur;
-#ifdef notyet
-	size_t termsz;
-#endif
+	size_t d, same;
 	char *tmp = alloca(MB_CUR_MAX);
 	mbstate_t mbs;
 
@@ -239,18 +266,41 @@ re_refresh(EditLine *el)
 		el->el_line.buffer));
 
 	literal_clear(el);
+	/* count the writes of this refresh */
+	el->el_terminal.t_owrites = el->el_terminal.t_obytes = 0;
+	el->el_terminal.t_omoved = el->el_terminal.t_osaved = 0;
 	/* reset the Drawing cursor */
 	el->el_refresh.r_cursor.h = 0;
 	el->el_refresh.r_cursor.v = 0;
 
 	terminal_move_to_char(el, 0);
 
+	/*
+	 * If the last layout is still on the screen we only lay out
+	 * again from the first row touched by an edit; see below.
+	 */
+	rec = re_layout_alloc(el) == 0;
+	/* not every command edits through chared.c, see re_unchanged() */
+	same = re_unchanged(el);
+	re_ltrunc(el, same);
+	resume = rec && re->r_valid && !re->r_scrolled;
+	re->r_scrolled = 0;
+	if (resume)
+		(void)memcpy(re->r_save, el->el_vdisplay[0],
+		    (size_t)(el->el_terminal.t_size.h + 1) *
+		    sizeof(*re->r_save));
+
 	/* temporarily draw rprompt to calculate its size */
 	prompt_print(el, EL_RPROMPT);
 
-	/* reset the Drawing cursor */
-	el->el_refresh.r_cursor.h = 0;
-	el->el_refresh.r_cursor.v = 0;
+	if (resume) {
+		if (re->r_cursor.v == 0)
+			(void)memcpy(el->el_vdisplay[0], re->r_save,
+			    (size_t)(el->el_terminal.t_size.h + 1) *
+			    sizeof(*re->r_save));
+		else
+			resume = 0;
+	}
 
 	if (el->el_line.cursor >= el->el_line.lastchar) {
 		if (el->el_map.current == el->el_map.alt
@@ -260,67 +310,162 @@ re_refresh(EditLine *el)
 			el->el_line.cursor = el->el_line.lastchar;
 	}
 
-	cur.h = -1;		/* set flag in case I'm not set */
-	cur.v = 0;
-
-	prompt_print(el, EL_PROMPT);
-
-	/* draw the current input buffer */
-#if notyet
-	termsz = el->el_terminal.t_size.h * el->el_terminal.t_size.v;
-	if (el->el_line.lastchar - el->el_line.buffer > termsz) {
-		/*
-		 * If line is longer than terminal, process only part
-		 * of line which would influence display.
-		 */
-		size_t rem = (el->el_line.lastchar-el->el_line.buffer)%termsz;
-
-		st = el->el_line.lastchar - rem
-			- (termsz - (((rem / el->el_terminal.t_size.v) - 1)
-					* el->el_terminal.t_size.v));
-	} else
-#endif
-		st = el->el_line.buffer;
+	/*
+	 * A line that does not fit on the screen is shown through a
+	 * window that starts at r_vstart (0 meaning with the prompt)
+	 * and is cut short at row vmax; we only ever lay out what is
+	 * in it. The window stays put while the cursor is inside it
+	 * and is moved to centre the cursor when it is not.
+	 */
+	sizeh = el->el_terminal.t_size.h;
+	vmax = el->el_terminal.t_size.v > 1 ?
+	    el->el_terminal.t_size.v - 1 : INT_MAX;
+	vs = re->r_vstart;
+	if (el->el_line.buffer + vs > el->el_line.cursor ||
+	    (el->el_line.lastchar - el->el_line.buffer) / sizeh < vmax)
+		vs = 0;
+
+	for (retry = 0;; retry++) {
+		/* reset the Drawing cursor */
+		el->el_refresh.r_cursor.h = 0;
+		el->el_refresh.r_cursor.v = 0;
+
+		cur.h = -1;		/* set flag in case I'm not set */
+		cur.v = 0;
+
+		/* draw the current input buffer */
+		st = el->el_line.buffer + vs;
+		first = 0;
+		if (vs == 0) {
+			prompt_print(el, EL_PROMPT);
+			if (el->el_prompt.p_pos.v != re->r_pend.v ||
+			    el->el_prompt.p_pos.h != re->r_pend.h)
+				resume = 0;
+			lastv = el->el_prompt.p_pos.v;
+		} else {
+			re_putc(el, '<', 1);	/* more to the left */
+			resume = rec = 0;
+			lastv = 0;
+		}
+		if (resume) {
+			/*
+			 * Everything before the first changed char lays out
+			 * the same as last time, so continue from the last
+			 * row that starts before it (and before the cursor,
+			 * which we must pass to find its position). Those
+			 * rows are left as they are in both el_vdisplay and
+			 * el_display.
+			 */
+			d = same;
+			if (d > (size_t)(el->el_line.cursor -
+			    el->el_line.buffer))
+				d = (size_t)(el->el_line.cursor -
+				    el->el_line.buffer);
+			for (i = el->el_terminal.t_size.v - 1; i > lastv; i--)
+				if (re->r_rows[i] != -1 &&
+				    (size_t)re->r_rows[i] <= d)
+					break;
+			if (i > lastv) {
+				st = el->el_line.buffer + re->r_rows[i];
+				el->el_refresh.r_cursor.h = 0;
+				el->el_refresh.r_cursor.v = i;
+				first = lastv = i;
+			}
+			resume = 0;
+		} else if (rec)
+			for (i = 0; i <= lastv &&
+			    i < el->el_terminal.t_size.v; i++)
+				re->r_rows[i] = -1;
+
+		cut = 0;
+		for (cp = st; cp < el->el_line.lastchar; cp++) {
+			if (el->el_refresh.r_cursor.v >= vmax) {
+				cut = 1;	/* the rest is off screen */
+				break;
+			}
+			if (rec && el->el_refresh.r_cursor.v != lastv) {
+				/*
+				 * Remember where each row starts; rows that
+				 * begin part way through a char (a tab or a
+				 * wrapped wide char) cannot be laid out from
+				 * their first column.
+				 */
+				if (re->r_scrolled)
+					rec = 0;
+				else {
+					while (++lastv <
+					    el->el_refresh.r_cursor.v)
+						re->r_rows[lastv] = -1;
+					re->r_rows[lastv] =
+					    el->el_refresh.r_cursor.h == 0 ?
+					    (int)(cp - el->el_line.buffer) : -1;
+				}
+			}
+			if (cp == el->el_line.cursor) {
+				memset(&mbs, 0, sizeof(mbs));
+				int w = (int)wcrtomb(tmp, *cp, &mbs);
+				/* save for later */
+				cur.h = el->el_refresh.r_cursor.h;
+				cur.v = el->el_refresh.r_cursor.v;
+				/* handle being at a linebroken doublewidth char */
+				if (w > 1 && el->el_refresh.r_cursor.h + w >
+					el->el_terminal.t_size.h) {
+					cur.h = 0;
+					cur.v++;
+				}
+			}
+			re_addc(el, *cp);
+		}
 
-	for (cp = st; cp < el->el_line.lastchar; cp++) {
-		if (cp == el->el_line.cursor) {
-			memset(&mbs, 0, sizeof(mbs));
-			int w = (int)wcrtomb(tmp, *cp, &mbs);
-			/* save for later */
-			cur.h = el->el_refresh.r_cursor.h;
-			cur.v = el->el_refresh.r_cursor.v;
-			/* handle being at a linebroken doublewidth char */
-			if (w > 1 && el->el_refresh.r_cursor.h + w >
-				el->el_terminal.t_size.h) {
-				cur.h = 0;
-				cur.v++;
+		if (!cut) {
+			if (cur.h == -1) {	/* if I haven't been set yet, */
+				cur.h = el->el_refresh.r_cursor.h; /* I'm at */
+				cur.v = el->el_refresh.r_cursor.v; /* the end */
 			}
+			break;
+		}
+		/* the cursor must not be under the marker on row vmax - 1 */
+		if (cur.h != -1 && (cur.v < vmax - 1 || (cur.v == vmax - 1 &&
+		    cur.h + (int)MB_CUR_MAX < sizeh)))
+			break;
+		if (retry == 0)
+			vs = re_backup(el, vmax * sizeh / 2);
+		else if (retry == 1)
+			vs = (int)(el->el_line.cursor - el->el_line.buffer);
+		else {
+			cur.h = cur.v = 0;	/* give up */
+			break;
 		}
-		re_addc(el, *cp);
 	}
+	re->r_vstart = vs;
+	re->r_vcut = cut;
 
-	if (cur.h == -1) {	/* if I haven't been set yet, I'm at the end */
-		cur.h = el->el_refresh.r_cursor.h;
-		cur.v = el->el_refresh.r_cursor.v;
-	}
-	rhdiff = el->el_terminal.t_size.h - el->el_refresh.r_cursor.h -
-		el->el_rprompt.p_pos.h;
-	if (el->el_rprompt.p_pos.h && !el->el_rprompt.p_pos.v &&
-		!el->el_refresh.r_cursor.v && rhdiff > 1) {
-		/*
-		 * have a right-hand side prompt that will fit
-		 * on the end of the first line with at least
-		 * one character gap to the input buffer.
-		 */
-		while (--rhdiff > 0)	/* pad out with spaces */
-			re_putc(el, ' ', 1);
-		prompt_print(el, EL_RPROMPT);
+	if (cut) {
+		re_putc(el, '\0', 0);	/* end row vmax (not shown) */
+		el->el_refresh.r_cursor.v = vmax - 1;
+		re_markcut(el, vmax - 1);
 	} else {
-		el->el_rprompt.p_pos.h = 0;	/* flag "not using rprompt" */
-		el->el_rprompt.p_pos.v = 0;
-	}
+		rhdiff = el->el_terminal.t_size.h - el->el_refresh.r_cursor.h -
+			el->el_rprompt.p_pos.h;
+		if (vs == 0 && el->el_rprompt.p_pos.h &&
+			!el->el_rprompt.p_pos.v &&
+			!el->el_refresh.r_cursor.v && rhdiff > 1) {
+			/*
+			 * have a right-hand side prompt that will fit
+			 * on the end of the first line with at least
+			 * one character gap to the input buffer.
+			 */
+			while (--rhdiff > 0)	/* pad out with spaces */
+				re_putc(el, ' ', 1);
+			prompt_print(el, EL_RPROMPT);
+		} else {
+			el->el_rprompt.p_pos.h = 0; /* flag "not using rprompt" */
+			el->el_rprompt.p_pos.v = 0;
+		}
 
-	re_putc(el, '\0', 0);	/* make line ended with NUL, no cursor shift */
+		/* make line ended with NUL, no cursor shift */
+		re_putc(el, '\0', 0);
+	}
 
 	el->el_refresh.r_newcv = el->el_refresh.r_cursor.v;
 
@@ -330,8 +475,23 @@ re_refresh(EditLine *el)
 		el->el_refresh.r_cursor.v, ct_encode_string(el->el_vdisplay[0],
 		&el->el_scratch)));
 
+	if (re_save_line(el, same) == -1)
+		rec = 0;
+	if (rec && !re->r_scrolled && !cut && vs == 0) {
+		while (++lastv < el->el_terminal.t_size.v)
+			re->r_rows[lastv] = -1;
+		re->r_pend = el->el_prompt.p_pos;
+		re->r_valid = 1;
+	} else
+		re->r_valid = 0;
+	re->r_dmg = (size_t)-1;
+	if (re->r_scrolled)
+		first = 0;	/* every row has moved */
+
 	ELRE_DEBUG(1, (__F, "updating %d lines.\r\n", el->el_refresh.r_newcv));
 	for (i = 0; i <= el->el_refresh.r_newcv; i++) {
+		if (i > el->el_prompt.p_pos.v && i < first)
+			continue;	/* laid out as last time */
 		/* NOTE THAT re_update_line MAY CHANGE el_display[i] */
 		re_update_line(el, (wchar_t *)el->el_display[i],
 			(wchar_t *)el->el_vdisplay[i], i);
@@ -476,8 +636,59 @@ re_delete(EditLine *el libedit_unused, wchar_t *d, int dat, int dlen, int num)
 static void
 re__strncopy(wchar_t *a, wchar_t *b, size_t n)
 {
-	while (n-- && *b)
-		*a++ = *b++;
+	(void)wmemcpy(a, b, wcsnlen(b, n));
+}
+
+
+/* re__samelen():
+ *	Return how many leading chars of a and b are the same, up to n
+ */
+static size_t
+re__samelen(const wchar_t *a, const wchar_t *b, size_t n)
+{
+	size_t i = 0;
+
+	if (wmemcmp(a, b, n) == 0)
+		return n;
+	while (n - i >= RE_BLOCK && wmemcmp(a + i, b + i, RE_BLOCK) == 0)
+		i += RE_BLOCK;
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+
+/* re__sametail():
+ *	Return how many trailing chars of a[0..n) and b[0..n) are the same
+ */
+static size_t
+re__sametail(const wchar_t *a, const wchar_t *b, size_t n)
+{
+	size_t i = n;
+
+	if (wmemcmp(a, b, n) == 0)
+		return n;
+	while (i >= RE_BLOCK &&
+	    wmemcmp(a + i - RE_BLOCK, b + i - RE_BLOCK, RE_BLOCK) == 0)
+		i -= RE_BLOCK;
+	while (i > 0 && a[i - 1] == b[i - 1])
+		i--;
+	return n - i;
+}
+
+
+/* re__trimblanks():
+ *	Return where the trailing blanks of [st, e) begin
+ */
+static wchar_t *
+re__trimblanks(wchar_t *st, wchar_t *e)
+{
+	while (e - st >= RE_BLOCK &&
+	    wmemcmp(e - RE_BLOCK, re_blanks, RE_BLOCK) == 0)
+		e -= RE_BLOCK;
+	while (e > st && e[-1] == ' ')
+		e--;
+	return e;
 }
 
 /* re_clear_eol():
@@ -485,14 +696,19 @@ re__strncopy(wchar_t *a, wchar_t *b, size_t n)
  *	in order to make sure that we have cleared the previous contents of
  *	the line. fx and sx is the number of characters inserted or deleted
  *	in the first or second diff, diff is the difference between the
- *	number of characters between the new and old line.
+ *	number of characters between the new and old line. If writing
+ *	line i wrapped the cursor onto the next one, i is full and the
+ *	clear would wipe the wrong line instead.
  */
 static void
-re_clear_eol(EditLine *el, int fx, int sx, int diff)
+re_clear_eol(EditLine *el, int i, int fx, int sx, int diff)
 {
 	ELRE_DEBUG(1, (__F, "re_clear_eol sx %d, fx %d, diff %d\n",
 		sx, fx, diff));
 
+	if (el->el_cursor.v != i)
+		return;
+
 	if (fx < 0)
 		fx = -fx;
 	if (sx < 0)
@@ -537,43 +753,26 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 	wchar_t *ofd, *ols, *oe, *nfd, *nls, *ne;
 	wchar_t *osb, *ose, *nsb, *nse;
 	int fx, sx;
-	size_t len;
+	size_t len, olen, nlen, same;
 
 	/*
 	 * find first diff
 	 */
-	for (o = old, n = new; *o && (*o == *n); o++, n++)
-		continue;
-	ofd = o;
-	nfd = n;
+	olen = wcslen(old);
+	nlen = wcslen(new);
+	len = re__samelen(old, new, olen < nlen ? olen : nlen);
+	ofd = old + len;
+	nfd = new + len;
 
-	/*
-	 * Find the end of both old and new
-	 */
-	while (*o)
-		o++;
 	/*
 	 * Remove any trailing blanks off of the end, being careful not to
 	 * back up past the beginning.
 	 */
-	while (ofd < o) {
-		if (o[-1] != ' ')
-			break;
-		o--;
-	}
-	oe = o;
+	oe = re__trimblanks(ofd, old + olen);
 	*oe = '\0';
 
-	while (*n)
-		n++;
-
 	/* remove blanks from end of new */
-	while (nfd < n) {
-		if (n[-1] != ' ')
-			break;
-		n--;
-	}
-	ne = n;
+	ne = re__trimblanks(nfd, new + nlen);
 	*ne = '\0';
 
 	/*
@@ -584,12 +783,13 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 		return;
 	}
 	/*
-	 * find last same pointer
+	 * find last same pointer; a same part that runs all the way back
+	 * to the first diff is taken one char short of it
 	 */
-	while ((o > ofd) && (n > nfd) && (*--o == *--n))
-		continue;
-	ols = ++o;
-	nls = ++n;
+	len = (size_t)(oe - ofd < ne - nfd ? oe - ofd : ne - nfd);
+	same = re__sametail(oe - len, ne - len, len);
+	ols = oe - same + (same == len);
+	nls = ne - same + (same == len);
 
 	/*
 	 * find same beginning and same end
@@ -603,23 +803,22 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 	 * case 1: insert: scan from nfd to nls looking for *ofd
 	 */
 	if (*ofd) {
-		for (c = *ofd, n = nfd; n < nls; n++) {
-			if (c == *n) {
-				for (o = ofd, p = n;
-					p < nls && o < ols && *o == *p;
-					o++, p++)
-					continue;
-				/*
-				 * if the new match is longer and it's worth
-				 * keeping, then we take it
-				 */
-				if (((nse - nsb) < (p - n)) &&
-					(2 * (p - n) > n - nfd)) {
-					nsb = n;
-					nse = p;
-					osb = ofd;
-					ose = o;
-				}
+		for (c = *ofd, n = nfd; n < nls &&
+		    (n = wmemchr(n, c, (size_t)(nls - n))) != NULL; n++) {
+			len = re__samelen(ofd, n, (size_t)
+			    (nls - n < ols - ofd ? nls - n : ols - ofd));
+			o = ofd + len;
+			p = n + len;
+			/*
+			 * if the new match is longer and it's worth
+			 * keeping, then we take it
+			 */
+			if (((nse - nsb) < (p - n)) &&
+				(2 * (p - n) > n - nfd)) {
+				nsb = n;
+				nse = p;
+				osb = ofd;
+				ose = o;
 			}
 		}
 	}
@@ -627,23 +826,22 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 	 * case 2: delete: scan from ofd to ols looking for *nfd
 	 */
 	if (*nfd) {
-		for (c = *nfd, o = ofd; o < ols; o++) {
-			if (c == *o) {
-				for (n = nfd, p = o;
-					p < ols && n < nls && *p == *n;
-					p++, n++)
-					continue;
-				/*
-				 * if the new match is longer and it's worth
-				 * keeping, then we take it
-				 */
-				if (((ose - osb) < (p - o)) &&
-					(2 * (p - o) > o - ofd)) {
-					nsb = nfd;
-					nse = n;
-					osb = o;
-					ose = p;
-				}
+		for (c = *nfd, o = ofd; o < ols &&
+		    (o = wmemchr(o, c, (size_t)(ols - o))) != NULL; o++) {
+			len = re__samelen(o, nfd, (size_t)
+			    (ols - o < nls - nfd ? ols - o : nls - nfd));
+			n = nfd + len;
+			p = o + len;
+			/*
+			 * if the new match is longer and it's worth
+			 * keeping, then we take it
+			 */
+			if (((ose - osb) < (p - o)) &&
+				(2 * (p - o) > o - ofd)) {
+				nsb = nfd;
+				nse = n;
+				osb = o;
+				ose = p;
 			}
 		}
 	}
@@ -872,7 +1070,7 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 			 * write (nsb-nfd) chars of new starting at nfd
 			 */
 			terminal_overwrite(el, nfd, (size_t)(nsb - nfd));
-			re_clear_eol(el, fx, sx,
+			re_clear_eol(el, i, fx, sx,
 				(int)((oe - old) - (ne - new)));
 			/*
 			 * Done
@@ -914,7 +1112,7 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 			ELRE_DEBUG(1, (__F,
 				"but with nothing left to save\r\n"));
 			terminal_overwrite(el, nse, (size_t)(nls - nse));
-			re_clear_eol(el, fx, sx,
+			re_clear_eol(el, i, fx, sx,
 				(int)((oe - old) - (ne - new)));
 		}
 	}
@@ -1003,18 +1201,11 @@ re_update_line(EditLine *el, wchar_t *old, wchar_t *new, int i)
 static void
 re__copy_and_pad(wchar_t *dst, const wchar_t *src, size_t width)
 {
-	size_t i;
-
-	for (i = 0; i < width; i++) {
-		if (*src == '\0')
-			break;
-		*dst++ = *src++;
-	}
+	size_t len = wcsnlen(src, width);
 
-	for (; i < width; i++)
-		*dst++ = ' ';
-
-	*dst = '\0';
+	(void)wmemcpy(dst, src, len);
+	(void)wmemset(dst + len, ' ', width - len);
+	dst[width] = '\0';
 }
 
 
@@ -1024,8 +1215,10 @@ re__copy_and_pad(wchar_t *dst, const wchar_t *src, size_t width)
 libedit_private void
 re_refresh_cursor(EditLine *el)
 {
-	wchar_t *cp;
-	int h, v, th, w;
+	el_refresh_t *re = &el->el_refresh;
+	const wchar_t *cp;
+	coord_t pos;
+	int h, v, th, w, vlast;
 	char *tmp = alloca(MB_CUR_MAX);
 	mbstate_t mbs;
 
@@ -1038,37 +1231,21 @@ re_refresh_cursor(EditLine *el)
 	}
 
 	/* first we must find where the cursor is... */
-	h = el->el_prompt.p_pos.h;
-	v = el->el_prompt.p_pos.v;
+	if (re->r_vstart > 0) {
+		pos.h = 1;	/* after the "<" */
+		pos.v = 0;
+	} else
+		pos = el->el_prompt.p_pos;
 	th = el->el_terminal.t_size.h;	/* optimize for speed */
+	/* last row of a cut window, see re_refresh() */
+	vlast = re->r_vcut ? el->el_terminal.t_size.v - 2 : INT_MAX;
 
-	/* do input buffer to el->el_line.cursor */
-	for (cp = el->el_line.buffer; cp < el->el_line.cursor; cp++) {
-		switch (ct_chr_class(*cp)) {
-		case CHTYPE_NL:  /* handle newline in data part too */
-			h = 0;
-			v++;
-			break;
-		case CHTYPE_TAB: /* if a tab, to next tab stop */
-			while (++h & 07)
-				continue;
-			break;
-		default:
-			memset(&mbs, 0, sizeof(mbs));
-			w = (int)wcrtomb(tmp, *cp, &mbs);
-			if (w > 1 && h + w > th) { /* won't fit on line */
-				h = 0;
-				v++;
-			}
-			h += ct_visual_width(*cp);
-			break;
-		}
+	if (el->el_line.cursor < el->el_line.buffer + re->r_vstart)
+		goto window;
+	cp = re_lpos(el, el->el_line.cursor, &pos, vlast);
+	h = pos.h;
+	v = pos.v;
 
-		if (h >= th) {	/* check, extra long tabs picked up here also */
-			h -= th;
-			v++;
-		}
-	}
 	/* if we have a next character, and it's a doublewidth one, we need to
 	 * check whether we need to linebreak for it to fit */
 	memset(&mbs, 0, sizeof(mbs));
@@ -1078,10 +1255,17 @@ re_refresh_cursor(EditLine *el)
 			v++;
 		}
 
+	if (v > vlast || (v == vlast && h + (int)MB_CUR_MAX >= th))
+		goto window;
+
 	/* now go there */
 	terminal_move_to_line(el, v);
 	terminal_move_to_char(el, h);
 	terminal__flush(el);
+	return;
+window:
+	re_refresh(el);		/* move the window to the cursor */
+	terminal__flush(el);
 }
 
 
@@ -1120,14 +1304,16 @@ re_fastputc(EditLine *el, wint_t c)
 		if (el->el_cursor.v + 1 >= el->el_terminal.t_size.v) {
 			int i, lins = el->el_terminal.t_size.v;
 
+			el->el_refresh.r_valid = 0;
 			lastline = el->el_display[0];
 			for(i = 1; i < lins; i++)
 				el->el_display[i - 1] = el->el_display[i];
 
 			el->el_display[i - 1] = lastline;
 		} else {
-			el->el_cursor.v++;
-			lastline = el->el_display[++el->el_refresh.r_oldcv];
+			lastline = el->el_display[++el->el_cursor.v];
+			if (el->el_refresh.r_oldcv < el->el_cursor.v)
+				el->el_refresh.r_oldcv = el->el_cursor.v;
 		}
 		re__copy_and_pad((wchar_t *)lastline, L"",
 			(size_t)el->el_terminal.t_size.h);
@@ -1157,7 +1343,9 @@ re_fastaddc(EditLine *el)
 
 	c = el->el_line.cursor[-1];
 
-	if (c == '\t' || el->el_line.cursor != el->el_line.lastchar) {
+	if (c == '\t' || el->el_line.cursor != el->el_line.lastchar ||
+	    el->el_refresh.r_vcut ||
+	    el->el_cursor.v + 1 >= el->el_terminal.t_size.v) {
 		re_refresh(el);	/* too hard to handle */
 		return;
 	}
@@ -1201,6 +1389,7 @@ re_clear_display(EditLine *el)
 	for (i = 0; i < el->el_terminal.t_size.v; i++)
 		el->el_display[i][0] = '\0';
 	el->el_refresh.r_oldcv = 0;
+	el->el_refresh.r_valid = 0;
 }
 
 
@@ -1225,3 +1414,281 @@ re_clear_lines(EditLine *el)
 		terminal__putc(el, '\n');	/* go to new line */
 	}
 }
+
+
+/* re_damage():
+ *	Note that the line buffer changed from p on
+ */
+libedit_private void
+re_damage(EditLine *el, const wchar_t *p)
+{
+	size_t off = (size_t)(p - el->el_line.buffer);
+
+	if (off < el->el_refresh.r_dmg)
+		el->el_refresh.r_dmg = off;
+	re_ltrunc(el, off);
+}
+
+
+/* re_layout_alloc():
+ *	Size the layout checkpoints to the terminal
+ */
+static int
+re_layout_alloc(EditLine *el)
+{
+	el_refresh_t *re = &el->el_refresh;
+	int v = el->el_terminal.t_size.v;
+	int h = el->el_terminal.t_size.h + 1;
+	void *p;
+
+	if (re->r_nrows < v) {
+		p = el_realloc(re->r_rows, (size_t)v * sizeof(*re->r_rows));
+		if (p == NULL)
+			return -1;
+		re->r_rows = p;
+		re->r_nrows = v;
+		re->r_valid = 0;
+	}
+	if (re->r_nsave < h) {
+		p = el_realloc(re->r_save, (size_t)h * sizeof(*re->r_save));
+		if (p == NULL)
+			return -1;
+		re->r_save = p;
+		re->r_nsave = h;
+	}
+	return 0;
+}
+
+
+/* re_unchanged():
+ *	Return how many leading chars of the line lay out as last time
+ */
+static size_t
+re_unchanged(EditLine *el)
+{
+	el_refresh_t *re = &el->el_refresh;
+	const wchar_t *a = el->el_line.buffer, *b = re->r_line;
+	size_t n = (size_t)(el->el_line.lastchar - a);
+
+	/*
+	 * The editing primitives record where they changed the line,
+	 * but not every command goes through them, so also compare
+	 * with the copy taken at the last layout.
+	 */
+	if (n > re->r_linelen)
+		n = re->r_linelen;
+	if (n > re->r_dmg)
+		n = re->r_dmg;
+	return re__samelen(a, b, n);
+}
+
+
+/* re_save_line():
+ *	Copy the line as laid out, from off on
+ */
+static int
+re_save_line(EditLine *el, size_t off)
+{
+	el_refresh_t *re = &el->el_refresh;
+	size_t len = (size_t)(el->el_line.lastchar - el->el_line.buffer);
+	wchar_t *p;
+
+	if (len > re->r_linesz) {
+		p = el_realloc(re->r_line, len * sizeof(*re->r_line));
+		if (p == NULL) {
+			re->r_linelen = 0;
+			return -1;
+		}
+		re->r_line = p;
+		re->r_linesz = len;
+	}
+	if (len > off)
+		(void)wmemcpy(re->r_line + off, el->el_line.buffer + off,
+		    len - off);
+	re->r_linelen = len;
+	return 0;
+}
+
+
+/* re_backup():
+ *	Return the offset of a char about cells columns before the
+ *	cursor, erring on the side of the cursor
+ */
+static int
+re_backup(EditLine *el, int cells)
+{
+	wchar_t *cp;
+
+	for (cp = el->el_line.cursor; cp > el->el_line.buffer; cp--) {
+		switch (ct_chr_class(cp[-1])) {
+		case CHTYPE_NL:		/* may end a row anywhere */
+			cells -= el->el_terminal.t_size.h;
+			break;
+		case CHTYPE_TAB:
+			cells -= 8;
+			break;
+		default:
+			cells -= ct_visual_width(cp[-1]);
+			break;
+		}
+		if (cells < 0)
+			break;
+	}
+	return (int)(cp - el->el_line.buffer);
+}
+
+
+/* re_markcut():
+ *	Show that row v is followed by more of the line
+ */
+static void
+re_markcut(EditLine *el, int v)
+{
+	wint_t *row = el->el_vdisplay[v];
+	int h, sizeh = el->el_terminal.t_size.h;
+
+	for (h = 0; h < sizeh && row[h] != '\0'; h++)
+		continue;
+	if (h < sizeh) {
+		row[h] = '>';
+		row[h + 1] = '\0';
+		return;
+	}
+	/* blank out a wide char we would otherwise split */
+	for (h = sizeh - 1; h > 0 && row[h] == MB_FILL_CHAR; h--)
+		row[h] = ' ';
+	if (h < sizeh - 1)
+		row[h] = ' ';
+	row[sizeh - 1] = '>';
+}
+
+
+/* re_ltrunc():
+ *	Forget the cursor positions that depend on chars from off on
+ */
+static void
+re_ltrunc(EditLine *el, size_t off)
+{
+	el_refresh_t *re = &el->el_refresh;
+	size_t n;
+
+	if (off < (size_t)re->r_lvs)
+		n = 0;
+	else
+		n = (off - (size_t)re->r_lvs) / RE_LSTEP + 1;
+	if (n < re->r_nlpos)
+		re->r_nlpos = n;
+}
+
+
+/* re_lpos():
+ *	Lay out the window from *pos, which is where its first char
+ *	goes, up to the char at to, and leave where that lands in *pos.
+ *	Returns to, or an earlier char once the layout is past row
+ *	vlast. The positions seen on the way are kept in r_lpos so
+ *	that the next call can start from the nearest one.
+ */
+static const wchar_t *
+re_lpos(EditLine *el, const wchar_t *to, coord_t *pos, int vlast)
+{
+	el_refresh_t *re = &el->el_refresh;
+	const wchar_t *st = el->el_line.buffer + re->r_vstart;
+	const wchar_t *cp;
+	int h, v, th, w;
+	size_t i;
+	char *tmp = alloca(MB_CUR_MAX);
+	mbstate_t mbs;
+	void *p;
+
+	th = el->el_terminal.t_size.h;
+	if (re->r_lpossz == 0 &&
+	    (p = el_malloc(16 * sizeof(*re->r_lpos))) != NULL) {
+		re->r_lpos = p;
+		re->r_lpossz = 16;
+	}
+	if (re->r_lvs != re->r_vstart || re->r_lth != th ||
+	    re->r_lorg.h != pos->h || re->r_lorg.v != pos->v)
+		re->r_nlpos = 0;	/* laid out some other way */
+	if (re->r_nlpos == 0 && re->r_lpossz > 0) {
+		re->r_lvs = re->r_vstart;
+		re->r_lth = th;
+		re->r_lorg = re->r_lpos[0] = *pos;
+		re->r_nlpos = 1;
+	}
+
+	i = (size_t)(to - st) / RE_LSTEP;
+	if (i >= re->r_nlpos)
+		i = re->r_nlpos > 0 ? re->r_nlpos - 1 : 0;
+	if (re->r_nlpos > 0)
+		*pos = re->r_lpos[i];
+	cp = st + i * RE_LSTEP;
+	h = pos->h;
+	v = pos->v;
+
+	while (cp < to && v <= vlast) {
+		switch (ct_chr_class(*cp)) {
+		case CHTYPE_NL:  /* handle newline in data part too */
+			h = 0;
+			v++;
+			break;
+		case CHTYPE_TAB: /* if a tab, to next tab stop */
+			while (++h & 07)
+				continue;
+			break;
+		default:
+			memset(&mbs, 0, sizeof(mbs));
+			w = (int)wcrtomb(tmp, *cp, &mbs);
+			if (w > 1 && h + w > th) { /* won't fit on line */
+				h = 0;
+				v++;
+			}
+			h += ct_visual_width(*cp);
+			break;
+		}
+
+		if (h >= th) {	/* check, extra long tabs picked up here also */
+			h -= th;
+			v++;
+		}
+
+		if ((size_t)(++cp - st) != re->r_nlpos * RE_LSTEP ||
+		    re->r_nlpos == 0)
+			continue;
+		if (re->r_nlpos == re->r_lpossz) {
+			p = el_realloc(re->r_lpos,
+			    re->r_lpossz * 2 * sizeof(*re->r_lpos));
+			if (p == NULL)
+				continue;
+			re->r_lpos = p;
+			re->r_lpossz *= 2;
+		}
+		re->r_lpos[re->r_nlpos].h = h;
+		re->r_lpos[re->r_nlpos++].v = v;
+	}
+	pos->h = h;
+	pos->v = v;
+	return cp;
+}
+
+
+/* re_end():
+ *	Free the layout state
+ */
+libedit_private void
+re_end(EditLine *el)
+{
+	el_refresh_t *re = &el->el_refresh;
+
+	el_free(re->r_rows);
+	re->r_rows = NULL;
+	el_free(re->r_save);
+	re->r_save = NULL;
+	el_free(re->r_line);
+	re->r_line = NULL;
+	el_free(re->r_lpos);
+	re->r_lpos = NULL;
+	re->r_nlpos = re->r_lpossz = 0;
+	re->r_nrows = re->r_nsave = 0;
+	re->r_linelen = re->r_linesz = 0;
+	re->r_valid = 0;
+}
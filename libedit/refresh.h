@@ -44,6 +44,25 @@ typedef struct {
 	coord_t	r_cursor;	/* Refresh cursor position	*/
 	int	r_oldcv;	/* Vertical locations		*/
 	int	r_newcv;
+	int	r_valid;	/* r_rows/r_line describe el_vdisplay */
+	int	r_scrolled;	/* Layout dropped rows off the top */
+	coord_t	r_pend;		/* Prompt end of the last layout */
+	size_t	r_dmg;		/* Lowest offset edited since then */
+	int	*r_rows;	/* Char starting each row, or -1 */
+	int	r_nrows;
+	wint_t	*r_save;	/* Row 0 under the sizing rprompt */
+	int	r_nsave;
+	wchar_t	*r_line;	/* Line as of the last layout	*/
+	size_t	r_linelen;
+	size_t	r_linesz;
+	int	r_vstart;	/* First char shown, when it doesn't fit */
+	int	r_vcut;		/* The line runs past the last row */
+	coord_t	*r_lpos;	/* Cursor position every RE_LSTEP chars */
+	size_t	r_nlpos;	/* How many of those still hold */
+	size_t	r_lpossz;
+	coord_t	r_lorg;		/* Where r_lpos[0] was laid out from */
+	int	r_lvs;		/* ... for which r_vstart */
+	int	r_lth;		/* ... and which terminal width */
 } el_refresh_t;
 
 libedit_private void	re_putc(EditLine *, wint_t, int);
@@ -55,5 +74,7 @@ libedit_private void	re_refresh(EditLine *);
 libedit_private void	re_refresh_cursor(EditLine *);
 libedit_private void	re_fastaddc(EditLine *);
 libedit_private void	re_goto_bottom(EditLine *);
+libedit_private void	re_damage(EditLine *, const wchar_t *);
+libedit_private void	re_end(EditLine *);
 
 #endif /* _h_el_refresh */
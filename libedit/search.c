@@ -37,8 +37,11 @@
 /*
  * search.c: History and character search functions
  */
+#include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
 #if defined(REGEX)
 #include <sys/types.h>
 #include <regex.h>
@@ -49,6 +52,7 @@
 #include "el.h"
 #include "common.h"
 #include "fcns.h"
+#include "read.h"
 
 /*
  * Adjust cursor in vi mode to include the character under it
@@ -57,6 +61,8 @@
 	((el)->el_line.cursor + (((el)->el_map.type == MAP_VI) && \
 				((el)->el_map.current == (el)->el_map.alt)))
 
+static void	fz_free(struct fuzzy_t *);
+
 /* search_init():
  *	Initialize the search stuff
  */
@@ -73,6 +79,7 @@ search_init(EditLine *el)
 	el->el_search.chacha = L'\0';
 	el->el_search.chadir = CHAR_FWD;
 	el->el_search.chatflg = 0;
+	el->el_search.fuzzy = NULL;
 	return 0;
 }
 
@@ -85,6 +92,8 @@ search_end(EditLine *el)
 {
 	el_free(el->el_search.patbuf);
 	el->el_search.patbuf = NULL;
+	fz_free(el->el_search.fuzzy);
+	el->el_search.fuzzy = NULL;
 }
 
 
@@ -161,6 +170,50 @@ c_hmatch(EditLine *el, const wchar_t *str)
 }
 
 
+/* c_hsearch():
+ *	Find the nearest history event from event h on that matches the
+ *	pattern and differs from the line being edited, looking at older
+ *	events for ED_SEARCH_PREV_HISTORY and newer ones otherwise.
+ *	Return its number, 0 if there is none, or -1 if the history
+ *	cannot search for the pattern itself.
+ */
+libedit_private int
+c_hsearch(EditLine *el, int h, int dir)
+{
+	const wchar_t *hp, *pat = el->el_search.patbuf;
+	size_t len = (size_t)(el->el_line.lastchar - el->el_line.buffer);
+	int fn, off, re = 0;
+
+	for (hp = pat; *hp; hp++)
+		if (wcschr(L".[]*^$\\", *hp) != NULL)
+			re = 1;
+#if !defined(REGEX)
+	if (re)
+		return -1;
+#endif
+	if (dir == ED_SEARCH_PREV_HISTORY) {
+		fn = re ? H_PREV_REGEX : H_PREV_SUBSTR;
+		dir = 1;
+	} else {
+		fn = re ? H_NEXT_REGEX : H_NEXT_SUBSTR;
+		dir = -1;
+	}
+	if (h < 1 || hist_nth(el, h - 1) == NULL)
+		return 0;
+	for (;;) {
+		if ((hp = hist_search(el, fn, pat, &off)) == NULL)
+			return off == -1 ? 0 : -1;
+		h += dir * off;
+		if (wcsncmp(hp, el->el_line.buffer, len) || hp[len])
+			return h;
+		hp = dir > 0 ? HIST_NEXT(el) : HIST_PREV(el);
+		if (hp == NULL)
+			return 0;
+		h += dir;
+	}
+}
+
+
 /* c_setpat():
  *	Set the history seatch pattern
  */
@@ -435,6 +488,662 @@ ce_inc_search(EditLine *el, int dir)
 }
 
 
+/*
+ * Fuzzy history search: a line matches if it contains the characters
+ * of the pattern in order, ignoring case.  The history lines are kept
+ * oldest first in one buffer of bytes, lowercased and with characters
+ * past ASCII folded into bytes with the high bit set; for patterns
+ * with such characters the lines that match are matched again in wide
+ * characters.  The buffer is kept from one search to the next, and as
+ * long as H_GETGEN tells that the history only had events entered and
+ * the oldest ones dropped since, only the new lines are added to it.
+ * A bit mask of the bytes of each line rejects most lines with a single
+ * AND.  For each length of the pattern the lines matching it are kept
+ * with where their match ends, so that typing a character only goes on
+ * from there in the lines that matched before it, and erasing it looks
+ * at none.  Lines are looked at newest first and FZ_SLICE at a time:
+ * after each character the best matches among the lines looked at so
+ * far are shown, and the rest are looked at while no input is waiting.
+ * The matches are shown in the prompt, above the line being edited.
+ */
+#define	FZ_TOP		8	/* Most matches shown		*/
+#define	FZ_SLICE	65536	/* Lines looked at between input checks */
+
+typedef struct fzlevel_t {
+	size_t beg;		/* First of its matches in cand	*/
+	size_t end;		/* End of its matches		*/
+	int src;		/* Level whose matches are looked at */
+	size_t next;		/* Next one of them		*/
+	int line;		/* Next line looked at, for level 0 */
+	uint64_t mask;		/* Bytes in the pattern		*/
+	int wide;		/* Pattern has characters past ASCII */
+	int top[FZ_TOP];	/* Best matches, best first	*/
+	int score[FZ_TOP];	/* And their scores		*/
+	int ntop;		/* Number of best matches	*/
+} fzlevel_t;
+
+typedef struct fuzzy_t {
+	hist_fun_t fun;		/* History the lines are from	*/
+	void *ref;		/* And its argument		*/
+	unsigned long gen;	/* Its generation then		*/
+	int newest;		/* Number of its newest event	*/
+	char *text;		/* Folded lines, oldest first	*/
+	size_t used;		/* Bytes of text in use		*/
+	size_t size;		/* Bytes of text allocated	*/
+	size_t *off;		/* Offset of each line, and of the end */
+	uint64_t *mask;		/* Bytes in each line		*/
+	int first;		/* Oldest line still in the history */
+	int nlines;		/* Number of lines		*/
+	int nalloc;		/* Allocated lines		*/
+	int *cand;		/* Matching lines of each level	*/
+	size_t *cend;		/* And where their match ends	*/
+	size_t candsz;		/* Allocated matches		*/
+	fzlevel_t *lv;		/* One level per pattern length	*/
+	size_t nlv;		/* Allocated levels		*/
+	wchar_t *prompt;	/* Prompt showing the matches	*/
+	size_t promptsz;	/* Its allocated size		*/
+} fuzzy_t;
+
+#define	FZ_MASK(b)	((uint64_t)1 << ((unsigned char)(b) & 63))
+
+
+/* fz_fold():
+ *	Return the byte character c is matched as
+ */
+static char
+fz_fold(wint_t c)
+{
+	if (c >= 0x80)
+		c = towlower(c);
+	else if (c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	return (char)(c < 0x80 ? c : 0x80 | (c & 0x7f));
+}
+
+
+/* fz_add():
+ *	Add the string of event ev as the newest line
+ */
+static int
+fz_add(EditLine *el, fuzzy_t *fz, const HistEventW *ev)
+{
+	const char *s = (const char *)(const void *)ev->str, *e;
+	const wchar_t *ws = ev->str;
+	mbstate_t mbs;
+	wchar_t wc;
+	uint64_t m = 0;
+	size_t len, n;
+	char *cp;
+	void *p;
+
+	len = (el->el_flags & NARROW_HISTORY) ? strlen(s) : wcslen(ws);
+	if (fz->nlines + 1 >= fz->nalloc) {
+		int nalloc = fz->nalloc ? fz->nalloc * 2 : 1024;
+
+		if ((p = el_realloc(fz->off,
+		    (size_t)nalloc * sizeof(*fz->off))) == NULL)
+			return -1;
+		fz->off = p;
+		if ((p = el_realloc(fz->mask,
+		    (size_t)nalloc * sizeof(*fz->mask))) == NULL)
+			return -1;
+		fz->mask = p;
+		fz->nalloc = nalloc;
+	}
+	if (fz->used + len + 1 > fz->size) {
+		n = (fz->used + len + 1) * 2;
+		if ((p = el_realloc(fz->text, n)) == NULL)
+			return -1;
+		fz->text = p;
+		fz->size = n;
+	}
+
+	cp = fz->text + fz->used;
+	if (el->el_flags & NARROW_HISTORY) {
+		memset(&mbs, 0, sizeof(mbs));
+		for (e = s + len; s < e; m |= FZ_MASK(*cp++)) {
+			if ((unsigned char)*s < 0x80) {
+				*cp = fz_fold((unsigned char)*s++);
+				continue;
+			}
+			n = mbrtowc(&wc, s, (size_t)(e - s), &mbs);
+			if (n == (size_t)-1 || n == (size_t)-2 || n == 0) {
+				memset(&mbs, 0, sizeof(mbs));
+				wc = (unsigned char)*s;
+				n = 1;
+			}
+			*cp = fz_fold(wc);
+			s += n;
+		}
+	} else {
+		for (; *ws; ws++)
+			m |= FZ_MASK(*cp++ = fz_fold(*ws));
+	}
+	*cp++ = '\0';
+	fz->off[fz->nlines] = fz->used;
+	fz->used = (size_t)(cp - fz->text);
+	fz->mask[fz->nlines++] = m;
+	fz->off[fz->nlines] = fz->used;
+	return 0;
+}
+
+
+/* fz_load():
+ *	Gather the history lines anew
+ */
+static int
+fz_load(EditLine *el, fuzzy_t *fz)
+{
+	HistEventW ev;
+	int rv;
+
+	fz->used = 0;
+	fz->first = fz->nlines = 0;
+	fz->newest = -1;
+	for (rv = (*el->el_history.fun)(el->el_history.ref, &ev, H_LAST,
+	    NULL); rv != -1; rv = (*el->el_history.fun)(el->el_history.ref,
+	    &ev, H_PREV, NULL)) {
+		if (fz_add(el, fz, &ev) == -1)
+			return -1;
+		fz->newest = ev.num;
+	}
+	return 0;
+}
+
+
+/* fz_sync():
+ *	Bring the lines up to date with the history: add the events
+ *	entered since they were gathered and leave out those dropped,
+ *	or gather them anew if the history changed otherwise
+ */
+static int
+fz_sync(EditLine *el, fuzzy_t *fz)
+{
+	hist_fun_t fun = el->el_history.fun;
+	void *ref = el->el_history.ref;
+	HistEventW ev;
+	unsigned long gen, mgen;
+	size_t base;
+	int i, k, n;
+
+	if (fun != fz->fun || ref != fz->ref ||
+	    (*fun)(ref, &ev, H_GETGEN, &gen, &mgen) == -1 || mgen > fz->gen ||
+	    (*fun)(ref, &ev, H_GETSIZE, NULL) == -1)
+		goto reload;
+	n = ev.num;
+	for (k = 0, i = (*fun)(ref, &ev, H_FIRST, NULL);
+	    i != -1 && ev.num != fz->newest;
+	    i = (*fun)(ref, &ev, H_NEXT, NULL))
+		k++;
+	if (i == -1 || n - k < 1 || n - k > fz->nlines - fz->first)
+		goto reload;
+	fz->first = fz->nlines - (n - k);
+	for (; k > 0; k--) {
+		if ((*fun)(ref, &ev, H_PREV, NULL) == -1 ||
+		    fz_add(el, fz, &ev) == -1)
+			goto reload;
+		fz->newest = ev.num;
+	}
+	fz->gen = gen;
+
+	if (fz->first >= 1024 && fz->first > fz->nlines / 2) {
+		base = fz->off[fz->first];
+		n = fz->nlines - fz->first;
+		memmove(fz->text, fz->text + base, fz->used - base);
+		memmove(fz->mask, fz->mask + fz->first,
+		    (size_t)n * sizeof(*fz->mask));
+		for (i = 0; i <= n; i++)
+			fz->off[i] = fz->off[fz->first + i] - base;
+		fz->used -= base;
+		fz->nlines = n;
+		fz->first = 0;
+	}
+	return 0;
+
+reload:
+	/* Without generations the lines have to be gathered every time */
+	if ((*fun)(ref, &ev, H_GETGEN, &gen, &mgen) == -1) {
+		fz->fun = NULL;
+		fz->ref = NULL;
+	} else {
+		fz->fun = fun;
+		fz->ref = ref;
+		fz->gen = gen;
+	}
+	if (fz_load(el, fz) == -1) {
+		fz->fun = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* fz_free():
+ *	Free what the fuzzy search allocated
+ */
+static void
+fz_free(fuzzy_t *fz)
+{
+	if (fz == NULL)
+		return;
+	el_free(fz->text);
+	el_free(fz->off);
+	el_free(fz->mask);
+	el_free(fz->cand);
+	el_free(fz->cend);
+	el_free(fz->prompt);
+	el_free(fz->lv);
+	el_free(fz);
+}
+
+
+/* fz_score():
+ *	Score the match of the folded pattern in line s that ends at
+ *	p: the shortest match ending there is scored, favoring characters
+ *	that start words or follow each other and penalizing the gaps
+ *	between them
+ */
+static int
+fz_score(const char *s, const char *p, const char *pat, size_t plen)
+{
+	const char *q, *prev = NULL;
+	size_t i;
+	int score = 0;
+
+	for (q = p, i = plen; i-- > 0; prev = q) {
+		while (*--q != pat[i])
+			continue;
+		score += 16;
+		if (q == s || (!(q[-1] & 0x80) && !isalnum((unsigned char)q[-1])))
+			score += 8;
+		if (prev == q + 1)
+			score += 4;
+	}
+	score -= (int)((size_t)(p - q) - plen);
+	if (q == s)
+		score += 8;
+	return score;
+}
+
+
+/* fz_wmatch():
+ *	Return if the history line s contains the characters of pat in
+ *	order ignoring case, for patterns that folding may have made
+ *	ambiguous
+ */
+static int
+fz_wmatch(const wchar_t *s, const wchar_t *pat, size_t plen)
+{
+	size_t i;
+	wint_t c;
+
+	if (s == NULL)
+		return 0;
+	for (i = 0; i < plen; i++, s++) {
+		for (c = towlower(pat[i]); *s && towlower(*s) != c; s++)
+			continue;
+		if (*s == '\0')
+			return 0;
+	}
+	return 1;
+}
+
+
+/* fz_start():
+ *	Start a search with the empty pattern, which the newest lines
+ *	match best
+ */
+static void
+fz_start(fuzzy_t *fz)
+{
+	fzlevel_t *lv = &fz->lv[0];
+
+	lv->beg = lv->end = lv->next = 0;
+	lv->src = 0;
+	lv->line = fz->nlines - 1;
+	lv->mask = 0;
+	lv->wide = 0;
+	for (lv->ntop = 0; lv->ntop < FZ_TOP &&
+	    fz->nlines - 1 - lv->ntop >= fz->first; lv->ntop++) {
+		lv->top[lv->ntop] = fz->nlines - 1 - lv->ntop;
+		lv->score[lv->ntop] = 0;
+	}
+}
+
+
+/* fz_level():
+ *	Start level plen, for the pattern grown by one character, from
+ *	the matches of the level below
+ */
+static int
+fz_level(fuzzy_t *fz, const wchar_t *pat, const char *fpat, size_t plen)
+{
+	fzlevel_t *lv;
+	void *p;
+
+	if (plen >= fz->nlv) {
+		if ((p = el_realloc(fz->lv,
+		    fz->nlv * 2 * sizeof(*fz->lv))) == NULL)
+			return -1;
+		fz->lv = p;
+		fz->nlv *= 2;
+	}
+	lv = &fz->lv[plen];
+	lv->beg = lv->end = lv[-1].end;
+	lv->src = (int)plen - 1;
+	lv->next = lv[-1].beg;
+	lv->line = lv[-1].line;
+	lv->mask = lv[-1].mask | FZ_MASK(fpat[plen - 1]);
+	lv->wide = lv[-1].wide || pat[plen - 1] >= 0x80;
+	lv->ntop = 0;
+	return 0;
+}
+
+
+/* fz_done():
+ *	Return if level plen has looked at all the lines
+ */
+static int
+fz_done(const fuzzy_t *fz, size_t plen)
+{
+	const fzlevel_t *lv = &fz->lv[plen];
+
+	return plen == 0 || (lv->src == 0 && lv->line < fz->first);
+}
+
+
+/* fz_run():
+ *	Look at up to budget more lines for level plen, newest first.
+ *	The lines are the matches of the level below, then the lines
+ *	that level had not looked at yet, and so on down to level 0,
+ *	whose lines are all of them.
+ */
+static int
+fz_run(EditLine *el, fuzzy_t *fz, const wchar_t *pat, const char *fpat,
+    size_t plen, size_t budget)
+{
+	fzlevel_t *lv = &fz->lv[plen], *sv;
+	const char *s, *e;
+	size_t i, d, pos;
+	int j, k, sc;
+	void *p;
+
+	while (budget > 0) {
+		if (lv->src == 0) {
+			if (lv->line < fz->first)
+				break;
+			j = lv->line--;
+			pos = fz->off[j];
+			d = 0;
+		} else if (lv->next < fz->lv[lv->src].end) {
+			j = fz->cand[lv->next];
+			pos = fz->cend[lv->next++];
+			d = (size_t)lv->src;
+		} else {
+			sv = &fz->lv[lv->src];
+			lv->src = sv->src;
+			lv->next = sv->next;
+			lv->line = sv->line;
+			continue;
+		}
+		budget--;
+		if ((fz->mask[j] & lv->mask) != lv->mask)
+			continue;
+		s = fz->text + pos;
+		e = fz->text + fz->off[j + 1] - 1;
+		for (i = d; i < plen && s != NULL; i++)
+			if ((s = memchr(s, fpat[i], (size_t)(e - s))) != NULL)
+				s++;
+		if (s == NULL || (lv->wide &&
+		    !fz_wmatch(hist_nth(el, fz->nlines - 1 - j), pat, plen)))
+			continue;
+
+		if (lv->end == fz->candsz) {
+			size_t nsz = fz->candsz ? fz->candsz * 2 : 1024;
+
+			if ((p = el_realloc(fz->cand,
+			    nsz * sizeof(*fz->cand))) == NULL)
+				return -1;
+			fz->cand = p;
+			if ((p = el_realloc(fz->cend,
+			    nsz * sizeof(*fz->cend))) == NULL)
+				return -1;
+			fz->cend = p;
+			fz->candsz = nsz;
+		}
+		fz->cand[lv->end] = j;
+		fz->cend[lv->end++] = (size_t)(s - fz->text);
+
+		sc = fz_score(fz->text + fz->off[j], s, fpat, plen);
+		if (lv->ntop == FZ_TOP && sc <= lv->score[FZ_TOP - 1])
+			continue;
+		for (k = lv->ntop < FZ_TOP ? lv->ntop++ : FZ_TOP - 1;
+		    k > 0 && lv->score[k - 1] < sc; k--) {
+			lv->top[k] = lv->top[k - 1];
+			lv->score[k] = lv->score[k - 1];
+		}
+		lv->top[k] = j;
+		lv->score[k] = sc;
+	}
+	return 0;
+}
+
+
+/* fz_prompt():
+ *	Return the prompt showing the matches
+ */
+static wchar_t *
+fz_prompt(EditLine *el)
+{
+	return el->el_search.fuzzy->prompt;
+}
+
+
+/* fz_show():
+ *	Show the best matches in the prompt, each on a line of its own
+ *	with the best one last, and the history line selected on the
+ *	line being edited.  Return how many fit on the screen.
+ */
+static int
+fz_show(EditLine *el, fuzzy_t *fz, const wchar_t *pat, size_t plen, int sel)
+{
+	static const wchar_t STRfuzzy[] = L"fuzzy `";
+	static const wchar_t STRquote[] = L"': ";
+	fzlevel_t *lv = &fz->lv[plen];
+	int cols = el->el_terminal.t_size.h, col, w, i, n = lv->ntop;
+	size_t need;
+	const wchar_t *s;
+	wchar_t *cp;
+	void *p;
+
+	if (n > el->el_terminal.t_size.v - 2)
+		n = el->el_terminal.t_size.v > 2 ?
+		    el->el_terminal.t_size.v - 2 : 0;
+	if (cols < 3)
+		n = 0;
+	need = (size_t)n * (size_t)cols + plen + 16;
+	if (need > fz->promptsz) {
+		if ((p = el_realloc(fz->prompt,
+		    need * sizeof(*fz->prompt))) == NULL) {
+			n = 0;
+			if (plen + 16 > fz->promptsz)
+				plen = fz->promptsz - 16;
+		} else {
+			fz->prompt = p;
+			fz->promptsz = need;
+		}
+	}
+
+	/*
+	 * The lines are padded to the width of the screen, so that the
+	 * prompt wraps after each of them
+	 */
+	cp = fz->prompt;
+	for (i = n; i-- > 0;) {
+		*cp++ = i == sel ? '>' : ' ';
+		*cp++ = ' ';
+		col = 2;
+		s = hist_nth(el, fz->nlines - 1 - lv->top[i]);
+		for (; s != NULL && *s && *s != '\n'; s++, col += w) {
+			w = iswprint(*s) ? ct_visual_width(*s) : 1;
+			if (w < 1 || col + w > cols)
+				break;
+			*cp++ = iswprint(*s) ? *s : '?';
+		}
+		while (col++ < cols)
+			*cp++ = ' ';
+	}
+	for (s = STRfuzzy; *s; *cp++ = *s++)
+		continue;
+	memcpy(cp, pat, plen * sizeof(*cp));
+	cp += plen;
+	for (s = STRquote; *s; *cp++ = *s++)
+		continue;
+	*cp = '\0';
+
+	if (lv->ntop > 0)
+		el->el_history.eventno = fz->nlines - lv->top[sel];
+	(void)hist_get(el);
+	re_refresh(el);
+	terminal__flush(el);
+	return n;
+}
+
+
+/* ce_fuzzy_search():
+ *	Emacs fuzzy history search
+ */
+libedit_private el_action_t
+ce_fuzzy_search(EditLine *el)
+{
+	static wchar_t endcmd[2] = {'\0', '\0'};
+	wchar_t pat[EL_BUFSIZ], ch;
+	char fpat[EL_BUFSIZ];
+	size_t plen = 0;
+	fuzzy_t *fz;
+	el_prompt_t oprompt;
+	el_action_t ret;
+	int sel = 0, nshown, pending, ohisteventno = el->el_history.eventno;
+
+	if (el->el_history.ref == NULL)
+		return CC_ERROR;
+	if (el->el_history.eventno == 0) {
+		wcsncpy(el->el_history.buf, el->el_line.buffer,
+		    el->el_history.sz);
+		el->el_history.last = el->el_history.buf +
+		    (el->el_line.lastchar - el->el_line.buffer);
+	}
+	if ((fz = el->el_search.fuzzy) == NULL) {
+		if ((fz = el_calloc(1, sizeof(*fz))) == NULL)
+			return CC_ERROR;
+		el->el_search.fuzzy = fz;
+	}
+	if (fz->prompt == NULL) {
+		if ((fz->prompt = el_calloc(EL_BUFSIZ + 16,
+		    sizeof(*fz->prompt))) == NULL)
+			return CC_ERROR;
+		fz->promptsz = EL_BUFSIZ + 16;
+	}
+	if (fz->lv == NULL) {
+		if ((fz->lv = el_calloc(16, sizeof(*fz->lv))) == NULL)
+			return CC_ERROR;
+		fz->nlv = 16;
+	}
+	if (fz_sync(el, fz) == -1)
+		return CC_ERROR;
+	fz_start(fz);
+
+	oprompt = el->el_prompt;
+	el->el_prompt.p_func = fz_prompt;
+	el->el_prompt.p_ignore = '\0';
+	el->el_prompt.p_wide = 1;
+
+	for (;;) {
+		if (fz->lv[plen].ntop == 0)
+			el->el_history.eventno = ohisteventno;
+		nshown = fz_show(el, fz, pat, plen, sel);
+
+		/* Look at the rest of the lines until a key is pressed */
+		if (!fz_done(fz, plen) && (pending = read_pending(el)) != 1) {
+			if (fz_run(el, fz, pat, fpat, plen,
+			    pending == 0 ? FZ_SLICE : SIZE_MAX) == 0)
+				continue;
+			terminal_beep(el);
+		}
+
+		if (el_wgetc(el, &ch) != 1) {
+			ret = ed_end_of_file(el, 0);
+			goto out;
+		}
+
+		switch (el->el_map.current[(unsigned char) ch]) {
+		case ED_INSERT:
+		case ED_DIGIT:
+			if (plen == EL_BUFSIZ - 1) {
+				terminal_beep(el);
+				break;
+			}
+			pat[plen] = ch;
+			fpat[plen] = fz_fold(ch);
+			if (fz_level(fz, pat, fpat, plen + 1) == -1 ||
+			    fz_run(el, fz, pat, fpat, plen + 1, FZ_SLICE) == -1)
+				terminal_beep(el);
+			else
+				plen++;
+			sel = 0;
+			break;
+
+		case EM_DELETE_PREV_CHAR:
+		case ED_DELETE_PREV_CHAR:
+		case VI_DELETE_PREV_CHAR:
+			if (plen == 0)
+				terminal_beep(el);
+			else
+				plen--;
+			sel = 0;
+			break;
+
+		case EM_INC_SEARCH_PREV:
+		case ED_PREV_HISTORY:
+			if (sel + 1 < fz->lv[plen].ntop && sel + 1 < nshown)
+				sel++;
+			else
+				terminal_beep(el);
+			break;
+
+		case EM_INC_SEARCH_NEXT:
+		case ED_NEXT_HISTORY:
+			if (sel > 0)
+				sel--;
+			else
+				terminal_beep(el);
+			break;
+
+		default:
+			switch (ch) {
+			case 0007:	/* ^G: Abort */
+				el->el_history.eventno = ohisteventno;
+				(void)hist_get(el);
+				ret = CC_REFRESH;
+				goto out;
+
+			default:	/* Terminate and execute cmd */
+				endcmd[0] = ch;
+				el_wpush(el, endcmd);
+				/* FALLTHROUGH */
+
+			case 0033:	/* ESC: Terminate */
+				ret = CC_REFRESH;
+				goto out;
+			}
+		}
+	}
+out:
+	el->el_prompt = oprompt;
+	return ret;
+}
+
+
 /* cv_search():
  *	Vi search.
  */
@@ -47,6 +47,7 @@ typedef struct el_search_t {
 	int	 chadir;		/* Character search direction	*/
 	wchar_t	 chacha;		/* Character we are looking for	*/
 	char	 chatflg;		/* 0 if f, 1 if t */
+	struct fuzzy_t *fuzzy;		/* Lines of the fuzzy search	*/
 } el_search_t;
 
 
@@ -54,8 +55,10 @@ libedit_private int		el_match(const wchar_t *, const wchar_t *);
 libedit_private int		search_init(EditLine *);
 libedit_private void		search_end(EditLine *);
 libedit_private int		c_hmatch(EditLine *, const wchar_t *);
+libedit_private int		c_hsearch(EditLine *, int, int);
 libedit_private void		c_setpat(EditLine *);
 libedit_private el_action_t	ce_inc_search(EditLine *, int);
+libedit_private el_action_t	ce_fuzzy_search(EditLine *);
 libedit_private el_action_t	cv_search(EditLine *, int);
 libedit_private el_action_t	ce_search_line(EditLine *, int);
 libedit_private el_action_t	cv_repeat_srch(EditLine *, wint_t);
@@ -41,6 +41,7 @@
  */
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <errno.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
@@ -78,6 +79,8 @@ extern char* tgetstr(char*, char**);
  */
 
 #define	TC_BUFSIZE	((size_t)2048)
+#define	TC_OUTSIZE	((size_t)4096)	/* Initial output buffer size */
+#define	TC_NOMOVE	(INT_MAX / 4)	/* Cost of a motion we can't do */
 
 #define	GoodStr(a)	(el->el_terminal.t_str[a] != NULL && \
 				el->el_terminal.t_str[a][0] != '\0')
@@ -201,15 +204,22 @@ static void	terminal_free_display(EditLine *);
 static int	terminal_alloc_display(EditLine *);
 static void	terminal_alloc(EditLine *, const struct termcapstr *,
 	const char *);
+static void	terminal_mvcost_reset(EditLine *);
 static void	terminal_init_arrow(EditLine *);
 static void	terminal_reset_arrow(EditLine *);
 static int	terminal_putc(int);
 static void	terminal_tputs(EditLine *, const char *, int);
+static char	*terminal_obuf(EditLine *, size_t);
+static int	terminal_oputs(EditLine *, const char *);
+static int	terminal_capcost(EditLine *, int, int);
+static int	terminal_owcost(EditLine *, int, int, int);
+static int	terminal_hcost(EditLine *, int, int, int *);
+static int	terminal_oldhcost(EditLine *, int, int, int *);
 
 #ifdef _REENTRANT
 static pthread_mutex_t terminal_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
-static FILE *terminal_outfile = NULL;
+static EditLine *terminal_el = NULL;
 
 
 /* terminal_setflags():
@@ -263,6 +273,11 @@ terminal_setflags(EditLine *el)
 libedit_private int
 terminal_init(EditLine *el)
 {
+	el->el_terminal.t_obuf = NULL;
+	el->el_terminal.t_olen = el->el_terminal.t_osize = 0;
+	el->el_terminal.t_owrites = el->el_terminal.t_obytes = 0;
+	el->el_terminal.t_omoved = el->el_terminal.t_osaved = 0;
+	el->el_terminal.t_mvcost = NULL;
 	el->el_terminal.t_buf = el_calloc(TC_BUFSIZE,
 		sizeof(*el->el_terminal.t_buf));
 	if (el->el_terminal.t_buf == NULL)
@@ -298,6 +313,11 @@ out:
 libedit_private void
 terminal_end(EditLine *el)
 {
+	if (el->el_terminal.t_olen > 0)
+		terminal__flush(el);
+	el_free(el->el_terminal.t_obuf);
+	el->el_terminal.t_obuf = NULL;
+	el->el_terminal.t_osize = 0;
 	el_free(el->el_terminal.t_buf);
 	el->el_terminal.t_buf = NULL;
 	el_free(el->el_terminal.t_cap);
@@ -324,6 +344,7 @@ terminal_alloc(EditLine *el, const struct termcapstr *t, const char *cap)
 	char **tlist = el->el_terminal.t_str;
 	char **tmp, **str = &tlist[t - tstr];
 
+	terminal_mvcost_reset(el);
 	memset(termbuf, 0, sizeof(termbuf));
 	if (cap == NULL || *cap == '\0') {
 		*str = NULL;
@@ -401,20 +422,27 @@ terminal_alloc_buffer(EditLine *el)
 {
 	wint_t **b;
 	coord_t *c = &el->el_terminal.t_size;
+	size_t stride;
 	int i;
 
-	b =  el_calloc((size_t)(c->v + 1), sizeof(*b));
+	/*
+	 * The rows share one block, a multiple of 8 chars apart so
+	 * that they stay aligned for block compares; refresh.c
+	 * shuffles the row pointers, so the block itself is kept
+	 * after the NULL that ends them.
+	 */
+	stride = ((size_t)c->h + 1 + 7) & ~(size_t)7;
+	b =  el_calloc((size_t)(c->v + 2), sizeof(*b));
 	if (b == NULL)
 		return NULL;
-	for (i = 0; i < c->v; i++) {
-		b[i] = el_calloc((size_t)(c->h + 1), sizeof(**b));
-		if (b[i] == NULL) {
-			while (--i >= 0)
-				el_free(b[i]);
-			el_free(b);
-			return NULL;
-		}
+	b[c->v + 1] = el_calloc((size_t)(c->v > 0 ? c->v : 1) * stride,
+	    sizeof(**b));
+	if (b[c->v + 1] == NULL) {
+		el_free(b);
+		return NULL;
 	}
+	for (i = 0; i < c->v; i++)
+		b[i] = b[c->v + 1] + (size_t)i * stride;
 	b[c->v] = NULL;
 	return b;
 }
@@ -432,7 +460,8 @@ terminal_free_buffer(wint_t ***bp)
 	*bp = NULL;
 
 	for (bufp = b; *bufp != NULL; bufp++)
-		el_free(*bufp);
+		continue;
+	el_free(bufp[1]);
 	el_free(b);
 }
 
@@ -442,6 +471,14 @@ terminal_free_buffer(wint_t ***bp)
 static int
 terminal_alloc_display(EditLine *el)
 {
+	coord_t *c = &el->el_terminal.t_size;
+
+	/* ch, RI and LE for every column, then UP for every line */
+	el->el_terminal.t_mvcost = el_calloc((size_t)(3 * (c->h + 1) +
+	    c->v + 1), sizeof(*el->el_terminal.t_mvcost));
+	if (el->el_terminal.t_mvcost == NULL)
+		goto done;
+	terminal_mvcost_reset(el);
 	el->el_display = terminal_alloc_buffer(el);
 	if (el->el_display == NULL)
 		goto done;
@@ -463,6 +500,201 @@ terminal_free_display(EditLine *el)
 {
 	terminal_free_buffer(&el->el_display);
 	terminal_free_buffer(&el->el_vdisplay);
+	el_free(el->el_terminal.t_mvcost);
+	el->el_terminal.t_mvcost = NULL;
+}
+
+
+/* terminal_mvcost_reset():
+ *	Forget the motion string lengths, the strings or size changed
+ */
+static void
+terminal_mvcost_reset(EditLine *el)
+{
+	coord_t *c = &el->el_terminal.t_size;
+	int i, n = 3 * (c->h + 1) + c->v + 1;
+
+	if (el->el_terminal.t_mvcost == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		el->el_terminal.t_mvcost[i] = -1;
+}
+
+
+/* terminal_capcost():
+ *	Return how many bytes the motion capability cap takes to move n
+ *	(or to column n, for ch), or TC_NOMOVE if we don't have it
+ */
+static int
+terminal_capcost(EditLine *el, int cap, int n)
+{
+	coord_t *c = &el->el_terminal.t_size;
+	int *cost, i, max;
+
+	if (!GoodStr(cap))
+		return TC_NOMOVE;
+	switch (cap) {
+	case T_ch:
+		i = 0;
+		max = c->h;
+		break;
+	case T_RI:
+		i = c->h + 1;
+		max = c->h;
+		break;
+	case T_LE:
+		i = 2 * (c->h + 1);
+		max = c->h;
+		break;
+	default:	/* T_UP */
+		i = 3 * (c->h + 1);
+		max = c->v;
+		break;
+	}
+	if (el->el_terminal.t_mvcost == NULL || n < 0 || n > max)
+		return (int)strlen(tgoto(Str(cap), n, n));
+	cost = &el->el_terminal.t_mvcost[i + n];
+	if (*cost == -1)
+		*cost = (int)strlen(tgoto(Str(cap), n, n));
+	return *cost;
+}
+
+
+/* terminal_owcost():
+ *	Return how many bytes rewriting the current line from column
+ *	from up to column to takes, or max if it is at least that
+ */
+static int
+terminal_owcost(EditLine *el, int from, int to, int max)
+{
+	const wint_t *d = el->el_display[el->el_cursor.v];
+	int cost = 0;
+
+	for (; from < to && cost < max; from++) {
+		if (d[from] == MB_FILL_CHAR)
+			continue;
+		if (d[from] & EL_LITERAL) {
+			/* literals from before the last refresh are gone */
+			if ((d[from] & ~EL_LITERAL) < el->el_literal.l_idx)
+				cost += (int)strlen(literal_get(el, d[from]));
+			else
+				cost++;
+		} else if (d[from] < 0x80)
+			cost++;
+		else
+			cost += (int)ct_enc_width((wchar_t)d[from]);
+	}
+	return cost < max ? cost : max;
+}
+
+
+/*
+ * The ways terminal_move_to_char() can get from one column to another
+ * on the same line
+ */
+#define	MV_CH		0	/* ch to the column */
+#define	MV_RI		1	/* RI right by the distance */
+#define	MV_LE		2	/* LE left by the distance */
+#define	MV_BS		3	/* backspaces */
+#define	MV_OW		4	/* write out what is on the screen */
+#define	MV_TAB		5	/* tab as far as we can, then as MV_OW */
+#define	MV_CR		6	/* carriage return, then any of the above */
+
+/* terminal_hcost():
+ *	Return the fewest bytes that move the cursor on the current line
+ *	from column from to column where, and leave how to in *how
+ */
+static int
+terminal_hcost(EditLine *el, int from, int where, int *how)
+{
+	int del = where - from, best, cost, tab, dummy;
+
+	/*
+	 * Writing out the screen and backspacing always work, so start
+	 * from those and only take something else if it is shorter.
+	 */
+	if (del > 0) {
+		best = terminal_owcost(el, from, where, TC_NOMOVE);
+		*how = MV_OW;
+		if (EL_CAN_TAB && (from & ~07) != (where & ~07) &&
+		    el->el_display[el->el_cursor.v][where & ~07] !=
+		    MB_FILL_CHAR) {
+			tab = (where >> 3) - (from >> 3);
+			if (tab < best && (cost = tab + terminal_owcost(el,
+			    where & ~07, where, best - tab)) < best) {
+				best = cost;
+				*how = MV_TAB;
+			}
+		}
+		if ((cost = terminal_capcost(el, T_RI, del)) < best) {
+			best = cost;
+			*how = MV_RI;
+		}
+	} else {
+		best = -del;
+		*how = MV_BS;
+		if ((cost = terminal_capcost(el, T_LE, -del)) < best) {
+			best = cost;
+			*how = MV_LE;
+		}
+		if (from > 0 && where > 0 &&
+		    (cost = 1 + terminal_hcost(el, 0, where, &dummy)) < best) {
+			best = cost;
+			*how = MV_CR;
+		}
+	}
+	if ((cost = terminal_capcost(el, T_ch, where)) < best) {
+		best = cost;
+		*how = MV_CH;
+	}
+	return best;
+}
+
+
+/* terminal_oldhcost():
+ *	Like terminal_hcost(), but going by the fixed rules we used
+ *	before we counted bytes
+ */
+static int
+terminal_oldhcost(EditLine *el, int from, int where, int *how)
+{
+	int del = where - from, cost, dummy;
+
+	if (where == 0) {
+		*how = MV_CR;
+		return 1;
+	}
+	if ((del < -4 || del > 4) && GoodStr(T_ch)) {
+		*how = MV_CH;
+		return terminal_capcost(el, T_ch, where);
+	}
+	if (del > 0) {
+		if (del > 4 && GoodStr(T_RI)) {
+			*how = MV_RI;
+			return terminal_capcost(el, T_RI, del);
+		}
+		cost = 0;
+		*how = MV_OW;
+		if (EL_CAN_TAB && (from & 0370) != (where & ~07) &&
+		    el->el_display[el->el_cursor.v][where & 0370] !=
+		    MB_FILL_CHAR) {
+			cost = (where >> 3) - (from >> 3);
+			from = where & ~07;
+			*how = MV_TAB;
+		}
+		return cost + terminal_owcost(el, from, where, TC_NOMOVE);
+	}
+	if (-del > 4 && GoodStr(T_LE)) {
+		*how = MV_LE;
+		return terminal_capcost(el, T_LE, -del);
+	}
+	if (EL_CAN_TAB ? ((unsigned int)-del >
+	    (((unsigned int)where >> 3) + (where & 07))) : (-del > where)) {
+		*how = MV_CR;
+		return 1 + terminal_oldhcost(el, 0, where, &dummy);
+	}
+	*how = MV_BS;
+	return -del;
 }
 
 
@@ -473,7 +705,7 @@ terminal_free_display(EditLine *el)
 libedit_private void
 terminal_move_to_line(EditLine *el, int where)
 {
-	int del;
+	int del, up, UP, old;
 
 	if (where == el->el_cursor.v)
 		return;
@@ -490,18 +722,27 @@ terminal_move_to_line(EditLine *el, int where)
 		 * We don't use DO here because some terminals are buggy
 		 * if the destination is beyond bottom of the screen.
 		 */
+		el->el_terminal.t_omoved += (size_t)del;
 		for (; del > 0; del--)
 			terminal__putc(el, '\n');
 		/* because the \n will become \r\n */
 		el->el_cursor.h = 0;
 	} else {		/* del < 0 */
-		if (GoodStr(T_UP) && (-del > 1 || !GoodStr(T_up)))
+		up = GoodStr(T_up) ? -del * (int)strlen(Str(T_up)) : TC_NOMOVE;
+		UP = terminal_capcost(el, T_UP, -del);
+		old = GoodStr(T_UP) && (-del > 1 || !GoodStr(T_up)) ? UP : up;
+		if (UP < up) {
 			terminal_tputs(el, tgoto(Str(T_UP), -del, -del), -del);
-		else {
+			up = UP;
+		} else {
 			if (GoodStr(T_up))
 				for (; del < 0; del++)
 					terminal_tputs(el, Str(T_up), 1);
 		}
+		if (up < TC_NOMOVE) {
+			el->el_terminal.t_omoved += (size_t)up;
+			el->el_terminal.t_osaved += (size_t)(old - up);
+		}
 	}
 	el->el_cursor.v = where;/* now where is here */
 }
@@ -513,9 +754,8 @@ terminal_move_to_line(EditLine *el, int where)
 libedit_private void
 terminal_move_to_char(EditLine *el, int where)
 {
-	int del, i;
+	int del, how, old, cost, i;
 
-mc_again:
 	if (where == el->el_cursor.h)
 		return;
 
@@ -526,77 +766,65 @@ mc_again:
 #endif /* DEBUG_SCREEN */
 		return;
 	}
-	if (!where) {		/* if where is first column */
-		terminal__putc(el, '\r');	/* do a CR */
-		el->el_cursor.h = 0;
-		return;
-	}
-	del = where - el->el_cursor.h;
+	/*
+	 * Work out what each way of getting there would write, as it
+	 * comes out for this terminal, and take the shortest.
+	 */
+	old = terminal_oldhcost(el, el->el_cursor.h, where, &how);
+	if (where > 0 && where < el->el_terminal.t_size.h &&
+	    el->el_cursor.h < el->el_terminal.t_size.h)
+		cost = terminal_hcost(el, el->el_cursor.h, where, &how);
+	else
+		/*
+		 * Terminals differ on where they leave the cursor past the
+		 * last column, so moves to or from there only use what we
+		 * always used.
+		 */
+		cost = old;
+	el->el_terminal.t_omoved += (size_t)cost;
+	if (old > cost)
+		el->el_terminal.t_osaved += (size_t)(old - cost);
 
-	if ((del < -4 || del > 4) && GoodStr(T_ch))
-		/* go there directly */
+mc_again:
+	del = where - el->el_cursor.h;
+	switch (how) {
+	case MV_CH:		/* go there directly */
 		terminal_tputs(el, tgoto(Str(T_ch), where, where), where);
-	else {
-		if (del > 0) {	/* moving forward */
-			if ((del > 4) && GoodStr(T_RI))
-				terminal_tputs(el, tgoto(Str(T_RI), del, del),
-					del);
-			else {
-					/* if I can do tabs, use them */
-				if (EL_CAN_TAB) {
-					if ((el->el_cursor.h & 0370) !=
-						(where & ~0x7)
-						&& (el->el_display[
-						el->el_cursor.v][where & 0370] !=
-						MB_FILL_CHAR)
-						) {
-						/* if not within tab stop */
-						for (i =
-							(el->el_cursor.h & 0370);
-							i < (where & ~0x7);
-							i += 8)
-							terminal__putc(el,
-								'\t');
-							/* then tab over */
-						el->el_cursor.h = where & ~0x7;
-					}
-				}
-				/*
-				 * it's usually cheaper to just write the
-				 * chars, so we do.
-				 */
-				/*
-				 * NOTE THAT terminal_overwrite() WILL CHANGE
-				 * el->el_cursor.h!!!
-				 */
-				terminal_overwrite(el,
-					(wchar_t *)&el->el_display[
-					el->el_cursor.v][el->el_cursor.h],
-					(size_t)(where - el->el_cursor.h));
-
-			}
-		} else {	/* del < 0 := moving backward */
-			if ((-del > 4) && GoodStr(T_LE))
-				terminal_tputs(el, tgoto(Str(T_LE), -del, -del),
-					-del);
-			else {	/* can't go directly there */
-				/*
-				 * if the "cost" is greater than the "cost"
-				 * from col 0
-				 */
-				if (EL_CAN_TAB ?
-					((unsigned int)-del >
-					(((unsigned int) where >> 3) +
-					 (where & 07)))
-					: (-del > where)) {
-					terminal__putc(el, '\r');/* do a CR */
-					el->el_cursor.h = 0;
-					goto mc_again;	/* and try again */
-				}
-				for (i = 0; i < -del; i++)
-					terminal__putc(el, '\b');
-			}
-		}
+		break;
+	case MV_RI:
+		terminal_tputs(el, tgoto(Str(T_RI), del, del), del);
+		break;
+	case MV_LE:
+		terminal_tputs(el, tgoto(Str(T_LE), -del, -del), -del);
+		break;
+	case MV_BS:
+		for (i = 0; i < -del; i++)
+			terminal__putc(el, '\b');
+		break;
+	case MV_TAB:
+		for (i = el->el_cursor.h & ~0x7; i < (where & ~0x7); i += 8)
+			terminal__putc(el, '\t');
+		el->el_cursor.h = where & ~0x7;
+		/*FALLTHROUGH*/
+	case MV_OW:
+		/*
+		 * NOTE THAT terminal_overwrite() WILL CHANGE
+		 * el->el_cursor.h!!!
+		 */
+		terminal_overwrite(el, (wchar_t *)
+		    &el->el_display[el->el_cursor.v][el->el_cursor.h],
+		    (size_t)(where - el->el_cursor.h));
+		break;
+	case MV_CR:
+		terminal__putc(el, '\r');	/* do a CR */
+		el->el_cursor.h = 0;
+		if (where == 0)
+			return;
+		if (where < el->el_terminal.t_size.h)
+			(void)terminal_hcost(el, 0, where, &how);
+		else
+			(void)terminal_oldhcost(el, 0, where, &how);
+		goto mc_again;		/* and go on from there */
 	}
 	el->el_cursor.h = where;		/* now where is here */
 }
@@ -1174,25 +1402,82 @@ terminal_bind_arrow(EditLine *el)
 	}
 }
 
+/* terminal_obuf():
+ *	Make room for len more bytes in the output buffer, and return
+ *	where they go, or NULL if they must be written directly
+ */
+static char *
+terminal_obuf(EditLine *el, size_t len)
+{
+	el_terminal_t *t = &el->el_terminal;
+	size_t size;
+	char *p;
+
+	/* Anything written through stdio so far goes out first */
+	if (t->t_olen == 0)
+		(void)fflush(el->el_outfile);
+	if (len <= t->t_osize - t->t_olen)
+		return t->t_obuf + t->t_olen;
+	for (size = t->t_osize ? t->t_osize : TC_OUTSIZE;
+	    size - t->t_olen < len; size *= 2)
+		continue;
+	if ((p = el_realloc(t->t_obuf, size)) == NULL) {
+		terminal__flush(el);
+		return len <= t->t_osize ? t->t_obuf : NULL;
+	}
+	t->t_obuf = p;
+	t->t_osize = size;
+	return p + t->t_olen;
+}
+
+/* terminal_oputs():
+ *	Add a string to the output buffer
+ */
+static int
+terminal_oputs(EditLine *el, const char *s)
+{
+	size_t len = strlen(s);
+	char *p;
+
+	if ((p = terminal_obuf(el, len)) == NULL)
+		return fputs(s, el->el_outfile);
+	memcpy(p, s, len);
+	el->el_terminal.t_olen += len;
+	return 0;
+}
+
 /* terminal_putc():
  *	Add a character
  */
 static int
 terminal_putc(int c)
 {
-	if (terminal_outfile == NULL)
+	char *p;
+
+	if (terminal_el == NULL)
 		return -1;
-	return fputc(c, terminal_outfile);
+	if ((p = terminal_obuf(terminal_el, (size_t)1)) == NULL)
+		return fputc(c, terminal_el->el_outfile);
+	*p = (char)c;
+	terminal_el->el_terminal.t_olen++;
+	return c;
 }
 
 static void
 terminal_tputs(EditLine *el, const char *cap, int affcnt)
 {
+	/* Only padding needs tputs(), and it is rare in practice */
+	if (cap != NULL && strstr(cap, "$<") == NULL &&
+	    !(*cap >= '0' && *cap <= '9')) {
+		(void)terminal_oputs(el, cap);
+		return;
+	}
 #ifdef _REENTRANT
 	pthread_mutex_lock(&terminal_mutex);
 #endif
-	terminal_outfile = el->el_outfile;
+	terminal_el = el;
 	tputs(cap, affcnt, terminal_putc);
+	terminal_el = NULL;
 #ifdef _REENTRANT
 	pthread_mutex_unlock(&terminal_mutex);
 #endif
@@ -1206,24 +1491,61 @@ terminal__putc(EditLine *el, wint_t c)
 {
 	char buf[MB_LEN_MAX +1];
 	ssize_t i;
+	char *p;
+
 	if (c == MB_FILL_CHAR)
 		return 0;
 	if (c & EL_LITERAL)
-		return fputs(literal_get(el, c), el->el_outfile);
-	i = ct_encode_char(buf, (size_t)MB_LEN_MAX, c);
+		return terminal_oputs(el, literal_get(el, c));
+	if ((p = terminal_obuf(el, (size_t)MB_LEN_MAX)) == NULL) {
+		i = ct_encode_char(buf, (size_t)MB_LEN_MAX, c);
+		if (i <= 0)
+			return (int)i;
+		buf[i] = '\0';
+		return fputs(buf, el->el_outfile);
+	}
+	if (c < 0x80) {
+		*p = (char)c;
+		el->el_terminal.t_olen++;
+		return 0;
+	}
+	i = ct_encode_char(p, (size_t)MB_LEN_MAX, c);
 	if (i <= 0)
 		return (int)i;
-	buf[i] = '\0';
-	return fputs(buf, el->el_outfile);
+	el->el_terminal.t_olen += (size_t)i;
+	return 0;
 }
 
 /* terminal__flush():
- *	Flush output
+ *	Write out the output buffer in one go if it can, and flush
+ *	output
  */
 libedit_private void
 terminal__flush(EditLine *el)
 {
-	fflush(el->el_outfile);
+	el_terminal_t *t = &el->el_terminal;
+	const char *p = t->t_obuf;
+	size_t len = t->t_olen;
+	ssize_t n;
+	int fd = -1;
+
+	t->t_olen = 0;
+	if (len > 0 && (fd = fileno(el->el_outfile)) == -1) {
+		(void)fwrite(p, len, (size_t)1, el->el_outfile);
+		len = 0;
+	}
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		t->t_owrites++;
+		t->t_obytes += (size_t)n;
+		p += n;
+		len -= (size_t)n;
+	}
+	(void)fflush(el->el_outfile);
 }
 
 /* terminal_writec():
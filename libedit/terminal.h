@@ -66,6 +66,14 @@ typedef struct {
 	int	 *t_val;		/* termcap values	*/
 	char	 *t_cap;		/* Termcap buffer	*/
 	funckey_t	 *t_fkey;		/* Array of keys	*/
+	char	 *t_obuf;		/* Output of a refresh	*/
+	size_t	  t_olen;		/* bytes used		*/
+	size_t	  t_osize;		/* bytes allocated	*/
+	size_t	  t_owrites;		/* writes this refresh	*/
+	size_t	  t_obytes;		/* bytes written	*/
+	int	 *t_mvcost;		/* Motion string lengths */
+	size_t	  t_omoved;		/* motion bytes this refresh */
+	size_t	  t_osaved;		/* ... fewer than before costing */
 } el_terminal_t;
 
 /*
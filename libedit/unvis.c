@@ -34,6 +34,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 
 #include "vis.h"
 
@@ -480,6 +481,8 @@ strnunvisx(char *dst, size_t dlen, const char *src, int flag)
 {
 	char c;
 	char t = '\0', *start = dst;
+	const char *reject;
+	size_t n;
 	int state = 0;
 
 	assert(src != NULL);
@@ -492,7 +495,30 @@ strnunvisx(char *dst, size_t dlen, const char *src, int flag)
 		} \
 	} while (0)
 
+	/*
+	 * Outside an escape sequence everything up to the next escape
+	 * character decodes to itself; copy such runs in bulk.
+	 */
+	if (flag & (VIS_HTTP1808 | VIS_HTTP1866 | VIS_MIMESTYLE))
+		reject = NULL;
+	else
+		reject = (flag & VIS_NOESCAPE) ? "" : "\\";
+
 	while ((c = *src++) != '\0') {
+		if (state == 0 && reject != NULL && c != '\\') {
+			n = strcspn(src, reject) + 1;
+			if (n > dlen) {
+				memcpy(dst, src - 1, dlen);
+				dst += dlen;
+				dlen = 0;
+				CHECKSPACE();
+			}
+			memcpy(dst, src - 1, n);
+			dst += n;
+			dlen -= n;
+			src += n - 1;
+			continue;
+		}
  again:
 		switch (unvis(&t, c, &state, flag)) {
 		case UNVIS_VALID:
@@ -73,6 +73,9 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
  * The reason for going through the trouble to deal with character encodings
@@ -309,6 +312,31 @@ getvisfun(int flags)
 	return do_svis;
 }
 
+/*
+ * Append the extra characters implied by flags at d; d must have
+ * room for MAXEXTRAS characters.
+ */
+static void
+addextras(wchar_t *d, int flags)
+{
+	const wchar_t *s;
+
+	if (flags & VIS_GLOB)
+		for (s = char_glob; *s; *d++ = *s++)
+			continue;
+
+	if (flags & VIS_SHELL)
+		for (s = char_shell; *s; *d++ = *s++)
+			continue;
+
+	if (flags & VIS_SP) *d++ = L' ';
+	if (flags & VIS_TAB) *d++ = L'\t';
+	if (flags & VIS_NL) *d++ = L'\n';
+	if (flags & VIS_DQ) *d++ = L'"';
+	if ((flags & VIS_NOSLASH) == 0) *d++ = L'\\';
+	*d = L'\0';
+}
+
 /*
  * Expand list of extra characters to not visually encode.
  */
@@ -317,7 +345,6 @@ makeextralist(int flags, const char *src)
 {
 	wchar_t *dst, *d;
 	size_t len;
-	const wchar_t *s;
 	mbstate_t mbstate;
 
 	len = strlen(src);
@@ -334,22 +361,129 @@ makeextralist(int flags, const char *src)
 	} else
 		d = dst + wcslen(dst);
 
-	if (flags & VIS_GLOB)
-		for (s = char_glob; *s; *d++ = *s++)
-			continue;
+	addextras(d, flags);
 
-	if (flags & VIS_SHELL)
-		for (s = char_shell; *s; *d++ = *s++)
-			continue;
+	return dst;
+}
 
-	if (flags & VIS_SP) *d++ = L' ';
-	if (flags & VIS_TAB) *d++ = L'\t';
-	if (flags & VIS_NL) *d++ = L'\n';
-	if (flags & VIS_DQ) *d++ = L'"';
-	if ((flags & VIS_NOSLASH) == 0) *d++ = L'\\';
-	*d = L'\0';
+/*
+ * Bytes that do_svis() copies through unchanged whatever the locale
+ * and look-ahead, unless they are in the extra list.  Space is left
+ * out since VIS_WHITE encodes it.
+ */
+#define VIS_RUNMIN	0x21
+#define VIS_RUNMAX	0x7e
+#define isvisrun(c)	((uchar)(c) >= VIS_RUNMIN && \
+			 (uchar)(c) <= VIS_RUNMAX && (c) != '\\')
 
-	return dst;
+/*
+ * visrun()
+ *	Return the length of the leading run of src that consists of
+ *	isvisrun() bytes, scanning 16 (or 8) bytes at a time.
+ */
+static size_t
+visrun(const char *src, size_t len)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i lo = _mm_set1_epi8(VIS_RUNMIN - 1);
+	const __m128i hi = _mm_set1_epi8(VIS_RUNMAX + 1);
+	const __m128i bs = _mm_set1_epi8('\\');
+	__m128i v, ok;
+
+	/* Bytes >= 0x80 are negative, so the signed compares drop them */
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const void *)(src + i));
+		ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+		    _mm_cmplt_epi8(v, hi));
+		ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, bs), ok);
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			break;
+	}
+#else
+#define VIS_ONES	((uint64_t)0x0101010101010101ULL)
+#define VIS_HIGHS	(VIS_ONES * 0x80)
+	uint64_t w;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, src + i, sizeof(w));
+		/* Any byte < VIS_RUNMIN, > VIS_RUNMAX or backslash? */
+		if (((w - VIS_ONES * VIS_RUNMIN) & ~w & VIS_HIGHS) ||
+		    (((w + VIS_ONES * (0x7f - VIS_RUNMAX)) | w) & VIS_HIGHS) ||
+		    (((w ^ (VIS_ONES * '\\')) - VIS_ONES) &
+		    ~(w ^ (VIS_ONES * '\\')) & VIS_HIGHS))
+			break;
+	}
+#undef VIS_ONES
+#undef VIS_HIGHS
+#endif
+	while (i < len && isvisrun(src[i]))
+		i++;
+	return i;
+}
+
+/*
+ * istrsenvisx_fast()
+ *	Fast path for istrsenvisx().  Its input and output loops go
+ *	byte by byte once past the first character, so when that is
+ *	ASCII the result is just the do_svis() encoding of each byte
+ *	in turn.  Copy the isvisrun() runs in bulk and encode only the
+ *	bytes between them.  Return -1 to have the caller take the
+ *	general path, which also reports any errors.
+ */
+static int
+istrsenvisx_fast(char *mbdst, size_t *dlen, const char *mbsrc,
+	size_t mblength, int flags, const char *mbextra, int *cerr_ptr)
+{
+	wchar_t ebuf[MAXEXTRAS], wbuf[16], *extra, *e, *w;
+	size_t i, n, olen, maxolen;
+	wint_t nextc;
+	int cerr;
+
+	if (mbdst == NULL || mblength < 2 ||
+	    (flags & (VIS_HTTPSTYLE | VIS_MIMESTYLE)) ||
+	    (dlen && *dlen == 0))
+		return -1;
+	cerr = (flags & VIS_NOLOCALE) || (cerr_ptr && *cerr_ptr);
+	if (!cerr && ((uchar)*mbsrc & 0200))
+		return -1;
+
+	if (*mbextra == '\0') {
+		addextras(ebuf, flags);
+		extra = ebuf;
+	} else if ((extra = makeextralist(flags, mbextra)) == NULL)
+		return -1;
+	for (e = extra; *e; e++)
+		if (isvisrun(*e))
+			goto out;
+
+	maxolen = dlen ? *dlen : SIZE_MAX;
+	for (i = olen = 0;; i++) {
+		n = visrun(mbsrc + i, mblength - i);
+		if (olen + n >= maxolen)
+			goto out;
+		memcpy(mbdst + olen, mbsrc + i, n);
+		olen += n;
+		if ((i += n) == mblength)
+			break;
+		nextc = i + 1 < mblength ? (uchar)mbsrc[i + 1] : L'\0';
+		e = do_svis(wbuf, (uchar)mbsrc[i], flags, nextc, extra);
+		if (olen + (size_t)(e - wbuf) >= maxolen)
+			goto out;
+		for (w = wbuf; w < e; w++)
+			mbdst[olen++] = (char)*w;
+	}
+	mbdst[olen] = '\0';
+
+	if ((flags & VIS_NOLOCALE) && cerr_ptr)
+		*cerr_ptr = 1;
+	if (extra != ebuf)
+		free(extra);
+	return (int)olen;
+out:
+	if (extra != ebuf)
+		free(extra);
+	return -1;
 }
 
 /*
@@ -378,6 +512,11 @@ istrsenvisx(char **mbdstp, size_t *dlen, const char *mbsrc, size_t mblength,
 	assert(mbsrc != NULL || mblength == 0);
 	assert(mbextra != NULL);
 
+	if ((error = istrsenvisx_fast(*mbdstp, dlen, mbsrc, mblength,
+	    flags, mbextra, cerr_ptr)) >= 0)
+		return error;
+	error = -1;
+
 	mbslength = mblength;
 	/*
 	 * When inputing a single character, must also read in the